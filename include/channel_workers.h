@@ -0,0 +1,78 @@
+#ifndef __CHANNEL_WORKERS_H__
+#define __CHANNEL_WORKERS_H__
+
+#include <stdexcept>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "common.h"
+
+// Channels are split in blocks that are multiples of this, so with cache line aligned arrays
+// no two blocks share a cache line (32 channels is 64 bytes of int16, 128 of int32, 256 of double).
+static const unsigned ChannelBlockAlign = 32;
+
+// Row length of the per channel arrays with several rows (filter history records, biquad state):
+// n channels rounded up to ChannelBlockAlign, so every row of a cache line aligned array starts
+// on a cache line too, whatever the number of channels.
+inline unsigned row_stride(unsigned n)
+{
+  return (n + ChannelBlockAlign - 1) / ChannelBlockAlign * ChannelBlockAlign;
+}
+
+// Pool of threads that run a per-channel job on blocks of channels, once per frame.
+// run() splits the channels in one block per partition. The calling thread runs the first
+// block, the workers the others, and run() returns when all blocks are done (a per-frame
+// barrier). Workers spin on an atomic generation counter, so there are no syscalls on the
+// frame path; after a while without frames they back off to yielding, then sleeping.
+// With 1 partition (the default) there are no threads and run() calls the job directly.
+class ChannelWorkers
+{
+public:
+  // Job run on channels [first, first + count)
+  typedef void (*Job)(void *ctx, unsigned first, unsigned count);
+
+  ChannelWorkers();
+  ~ChannelWorkers();
+
+  // Start 'partitions' - 1 worker threads. If firstCpu >= 0, worker i (1..partitions-1) is
+  // pinned to CPU firstCpu + i - 1. Stops the running workers first.
+  void start(unsigned partitions, int firstCpu);
+
+  // Stop the worker threads, run() then runs single threaded
+  void stop();
+
+  // Run 'job' on channels [0, n), split in blocks. Must be called from a single thread.
+  void run(unsigned n, Job job, void *ctx);
+
+  unsigned getPartitions() const { return partitions; };
+  int      getFirstCpu()   const { return firstCpu;   };
+
+private:
+  // Worker thread body, runs block 'index' of every generation after 'seen'
+  void worker(unsigned index, uint64_t seen);
+
+  // First channel and channel count of block 'index', for the current job
+  void block(unsigned index, unsigned &first, unsigned &count) const;
+
+  // Padded so the counters the threads spin on don't share a cache line with anything else
+  struct alignas(64) PaddedCounter
+  {
+    std::atomic<uint64_t> value;
+  };
+
+  unsigned                 partitions;
+  int                      firstCpu;
+  std::vector<std::thread> threads;
+
+  // Current job, written by run() before the generation is bumped
+  Job                      job;
+  void                    *ctx;
+  unsigned                 channels;
+  unsigned                 blockSize;
+  bool                     stopping;
+
+  PaddedCounter            generation;  // Bumped by run() to start a frame
+  PaddedCounter            done;        // Blocks finished by the workers in this frame
+};
+
+#endif
@@ -0,0 +1,112 @@
+#ifndef __COLUMNAR_FORMAT_H__
+#define __COLUMNAR_FORMAT_H__
+
+#include <stdint.h>
+
+// Columnar data file format. An alternative to the raw files (a concatenation of packets),
+// where reading one channel, or a time range, only touches the bytes needed.
+// All the numbers are little endian. The file is:
+//
+//   ColumnarFileHeader
+//   ColumnarFieldDesc[numFields]          layout of the header columns
+//   padding to 64 bytes
+//   chunk 0, chunk 1, ...                 each one starts at a multiple of 64 bytes
+//   ColumnarIndexEntry[numChunks]         one per chunk
+//   ColumnarTrailer                       the last 32 bytes of the file
+//
+// A chunk holds up to chunkFrames consecutive packets with the same number of channels:
+//
+//   ColumnarChunkHeader
+//   header columns: for each field f, numFrames values of fields[f].width bytes
+//   padding to 64 bytes
+//   payload columns: for each channel, numFrames int32 values (avgdata_t)
+//   padding to 64 bytes
+//
+// So channel c of a chunk is the numFrames * 4 bytes at
+//   chunk offset + payloadOffset + c * numFrames * 4
+//
+// With the delta codec (codec = ColumnarCodecDelta), each payload column is compressed with
+// encode_samples() (sample_codec.h), and the payload is instead:
+//
+//   uint32 columnOffset[numChannels + 1]   from payloadOffset; column c ends where c + 1 starts
+//   encoded columns
+//   padding to 64 bytes
+//
+// The header columns are never compressed.
+// The index gives the frame counter and time ranges of each chunk, so a reader finds the chunks
+// of a time range with a binary search in the index. The index is written when the file is
+// closed; a file without it (the trailer magic is missing) can still be read by walking the
+// chunks from the start, with their 'length'.
+
+// File header
+struct ColumnarFileHeader
+{
+  char      magic[8];       // "SMURFCOL"
+  uint32_t  version;        // ColumnarVersion
+  uint32_t  headerLength;   // Length of the SMuRF header the columns come from
+  uint32_t  chunkFrames;    // Maximum number of frames per chunk
+  uint32_t  numFields;      // Number of header columns
+  uint32_t  codec;          // Payload codec, ColumnarCodec
+  uint32_t  reserved;
+};
+
+// Header column: the field's place in the SMuRF header
+struct ColumnarFieldDesc
+{
+  uint16_t  offset;         // Byte offset in the SMuRF header
+  uint16_t  width;          // Number of bytes
+};
+
+// Chunk header
+struct ColumnarChunkHeader
+{
+  char      magic[4];       // "CHNK"
+  uint32_t  numFrames;
+  uint32_t  numChannels;
+  uint32_t  payloadOffset;  // Offset of the payload columns, from the start of the chunk
+  uint64_t  length;         // Length of the chunk, including this header and the padding
+};
+
+// Index entry, one per chunk
+struct ColumnarIndexEntry
+{
+  uint64_t  offset;         // File offset of the chunk
+  uint64_t  length;         // Length of the chunk
+  uint32_t  numFrames;
+  uint32_t  numChannels;
+  uint32_t  firstFrame;     // Frame counter of the first and last frames
+  uint32_t  lastFrame;
+  uint64_t  firstUnixTime;  // Unix time (ns) of the first and last frames
+  uint64_t  lastUnixTime;
+  uint64_t  firstEpicsTime; // Timing system time (epics seconds << 32 | nanoseconds)
+  uint64_t  lastEpicsTime;
+};
+
+// File trailer
+struct ColumnarTrailer
+{
+  uint64_t  indexOffset;    // File offset of the first index entry
+  uint32_t  numChunks;
+  uint32_t  version;        // ColumnarVersion
+  uint64_t  reserved;
+  char      magic[8];       // "SMURFIDX"
+};
+
+// Payload codecs
+enum ColumnarCodec
+{
+  ColumnarCodecNone  = 0,   // int32 values
+  ColumnarCodecDelta = 1,   // Delta, zigzag and bit packing (sample_codec.h)
+};
+
+static const uint32_t ColumnarVersion      = 2;   // Version 1 had no codec
+static const uint32_t ColumnarAlign        = 64;
+static const uint32_t ColumnarMaxChunk     = 16384;  // Largest chunkFrames
+
+static_assert(sizeof(ColumnarFileHeader)  == 32, "Columnar file header layout");
+static_assert(sizeof(ColumnarFieldDesc)   == 4,  "Columnar field layout");
+static_assert(sizeof(ColumnarChunkHeader) == 24, "Columnar chunk header layout");
+static_assert(sizeof(ColumnarIndexEntry)  == 64, "Columnar index entry layout");
+static_assert(sizeof(ColumnarTrailer)     == 32, "Columnar trailer layout");
+
+#endif
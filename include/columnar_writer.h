@@ -0,0 +1,65 @@
+#ifndef __COLUMNAR_WRITER_H__
+#define __COLUMNAR_WRITER_H__
+
+#include <atomic>
+#include <vector>
+#include "columnar_format.h"
+#include "file_writer.h"
+#include "smurf_packet.h"
+
+// Writes packets in the columnar format (see columnar_format.h) to the file of a FileWriter.
+// The packets of a chunk are kept in memory, then the chunk is transposed and written in one
+// piece. Used by the file writer thread only.
+class ColumnarWriter
+{
+public:
+  ColumnarWriter(FileWriter &w);
+
+  // Calls end(), so a file still being written gets its last chunk and its index. The
+  // FileWriter must outlive this object (declare it first).
+  ~ColumnarWriter();
+
+  // Start a file: writes the file header. Call after a file is attached to the FileWriter.
+  // 'codec' is a ColumnarCodec, for the payload columns.
+  void begin(std::size_t chunkFrames, uint32_t codec);
+
+  // Add a packet. A chunk is written when it is full, or before a packet with another number
+  // of channels.
+  void append(const SmurfPacketView &v);
+
+  // Write the last chunk and the index. Call before the file is detached from the FileWriter.
+  void end();
+
+  // True between begin() and end()
+  bool isActive() const { return active; };
+
+  // Payload bytes before and after the codec, and the time spent encoding them (ns), over all
+  // the files written with a codec
+  uint64_t getCodecInBytes()  const { return codecIn;  };
+  uint64_t getCodecOutBytes() const { return codecOut; };
+  uint64_t getCodecTime()     const { return codecNs;  };
+
+private:
+  // Transpose and write the packets kept so far as a chunk
+  void flush();
+
+  // Encode the payload columns at 'cols' to 'out', from 'pos'. Returns the end position.
+  std::size_t encode(const avgdata_t *cols, std::size_t pos);
+
+  FileWriter                      &writer;
+  bool                             active;
+  std::size_t                      chunkFrames;
+  uint32_t                         codec;
+  std::size_t                      count;     // Packets kept
+  std::size_t                      channels;  // Number of channels of the packets kept
+  std::vector<uint8_t>             headers;   // Headers of the packets kept, one after the other
+  std::vector<avgdata_t>           rows;      // Payloads of the packets kept, one after the other
+  std::vector<uint8_t>             out;       // Chunk being written
+  std::vector<avgdata_t>           cols;      // Payload columns, before the codec
+  std::vector<ColumnarIndexEntry>  index;
+  std::atomic<uint64_t>            codecIn;
+  std::atomic<uint64_t>            codecOut;
+  std::atomic<uint64_t>            codecNs;
+};
+
+#endif
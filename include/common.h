@@ -3,12 +3,32 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <time.h>
 
+// Size of a cache line, used to align arrays shared between threads
+const size_t cache_line_size = 64;
+
 // Just prints errors
 void error(const char *msg);
 
 // returns unix sysetm time as 64 bit nanoseconds
 uint64_t get_unix_time();
 
+// CPU features, checked at run time so the same library runs on any x86_64 host
+bool cpu_has_avx2();
+bool cpu_has_avx512();
+bool cpu_has_fma();
+
+// malloc, aligned to a cache line. Free with free(). Returns NULL on failure.
+void *cache_aligned_malloc(size_t size);
+
+// Hint to the CPU that we are in a spin wait loop
+static inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#endif
+}
+
 #endif
\ No newline at end of file
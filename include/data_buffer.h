@@ -3,31 +3,73 @@
 
 #include <iostream>
 #include <vector>
-#include <deque>
 #include <iterator>
 #include <algorithm>
-#include <condition_variable>
+#include <atomic>
 #include <mutex>
 
 #include "smurf_packet.h"
+#include "common.h"
 
 // This class implements a data buffer between new Smurf packet created, and the readers.
-// At this moment there are 2 readers: the user custom transmitter, and file writer.
+// The buffer has a fixed number of reader slots. Readers are attached to a free slot, and
+// detached, at run time; the writer ignores the free slots.
 // The implementation is a circular buffer, which will overwrite old data is the readers
 // don't process the packets fast enough.
 // Readers get read-only (smart) pointer to the data, not a copy of it. The writer on the other
 // hand receives a read-write (smart) pointer to the data cell.
+//
+// The buffer is lock-free, for a single writer and any number of readers:
+// - The writer publishes packets by incrementing an atomic write sequence number, with release
+//   semantics. Packet 'n' lives in slot n % size.
+// - Each reader has an atomic cursor: the sequence number of its next packet, shifted left by
+//   one, plus a 'claimed' bit which is set by getReadPtr() while the reader uses the packet.
+// - When a reader is full, the writer drops the reader's oldest packet by moving its cursor
+//   forward, with a compare and swap (the claimed bit is kept). If the reader is using the packet
+//   in the slot to write, the writer swaps the slot with a free spare packet: the reader keeps
+//   the packet it holds, and the other readers still get the new one. A reader gets its packet
+//   before claiming it, and the writer moves the unclaimed cursors before swapping, so a reader
+//   never gets the spare by mistake. There is a spare per reader slot, plus one.
+// - Readers sleep on a futex. The writer only makes the wake up syscall when a reader is waiting.
+// The writer index, the futex word and each reader cursor live in their own cache lines.
+//
+// What happens when a reader is full depends on its policy:
+// - DropOldest: the reader loses its oldest packet, as described above (the default).
+// - Blocking:   the writer waits up to the reader's timeout for it to read a packet. After a
+//               timeout the reader drops its oldest packets, without any wait, until it has
+//               caught up to half the buffer, so a slow reader can't stall the writer on every
+//               packet. The dropped packets are counted by getOWCnt(). With several full Blocking
+//               readers, the writer waits at most the shortest of their timeouts.
+// - DropNewest: the new packet is dropped. There is a single copy of each packet, so it is
+//               dropped for all the readers, not only for the full one.
+//
+// The buffer size can be changed at run time, up to DataBufferMaxSize. The change is applied by
+// the writer in getWritePtr(), the first time all readers are caught up, so no packet moves.
+static const std::size_t DataBufferMaxSize = 1024;
+
 class DataBuffer
 {
 public:
-    // Constructor. The arguments are the buffer size (bufSize) and the number of readers (numReaders).
+    // What the writer does when a reader is full
+    enum Policy
+    {
+        DropOldest = 0,
+        Blocking   = 1,
+        DropNewest = 2
+    };
+
+    // Constructor. The arguments are the buffer size (bufSize) and the number of reader slots (numReaders).
+    // All the slots start free.
     DataBuffer(std::size_t bufSize, std::size_t numReaders);
     ~DataBuffer();
 
     // Get a pointer to the next available buffer slot, ready to be written to.
+    // Returns an empty pointer if a full DropNewest reader drops the packet, or if no spare
+    // packet is free. In that case the new packet must be dropped, and doneWriting() must not be called.
     SmurfPacket    getWritePtr();
 
     // Get a pointer to the next available data packet, ready to be processed.
+    // The packet stays valid until doneReading() is called.
     // Argument is the reader index.
     SmurfPacket_RO getReadPtr(std::size_t i);
 
@@ -40,6 +82,42 @@ public:
     // Argument is the reader index.
     void doneReading(std::size_t i);
 
+    // Attach a new reader to a free slot and return its index. The reader starts with the next
+    // packet written, with the given policy. Throws if there is no free slot.
+    std::size_t attachReader(Policy policy, std::size_t timeoutMs);
+
+    // Detach reader 'i', freeing its slot. The reader must not be using a packet.
+    void detachReader(std::size_t i);
+
+    // Get whether reader slot 'i' is in use
+    const bool               isAttached(std::size_t i) const;
+
+    // Wait until reader 'i' has data, for up to 'timeoutMs' milliseconds.
+    // Returns true if there is data to read.
+    bool waitForData(std::size_t i, std::size_t timeoutMs);
+
+    // Wake up all the readers waiting in waitForData, for example to stop their threads.
+    void wakeAll();
+
+    // Set the policy of reader 'i'. timeoutMs is the longest wait for the Blocking policy.
+    void setPolicy(std::size_t i, Policy policy, std::size_t timeoutMs);
+
+    // Get the policy of reader 'i'
+    const Policy             getPolicy(std::size_t i) const;
+
+    // Request a new buffer size (1 to DataBufferMaxSize), applied by the writer later.
+    void setSize(std::size_t newSize);
+
+    // Get the number of packets reader 'i' has not read yet
+    const std::size_t        getLag(std::size_t i) const;
+
+    // Get the largest lag of reader 'i' since the counters were cleared
+    const std::size_t        getHighWater(std::size_t i) const;
+
+    // Get the number of times the writer gave up waiting for Blocking reader 'i'
+    // (each one starts a run of dropped packets, until the reader catches up)
+    const std::size_t        getTimeoutCnt(std::size_t i) const;
+
     // Get buffer empty status for each reader.
     // Argument is the reader index.
     const bool               isEmpty(std::size_t i) const;
@@ -55,40 +133,69 @@ public:
     // Argument is the reader index.
     const std::size_t        getOWCnt(std::size_t i) const;
 
+    // Get number of new packets dropped for all readers (DropNewest reader full, or no free spare).
+    const std::size_t        getDropCnt() const;
+
     // Clear counters
     void                     clearCnts();
 
     // Get buffer size
     const std::size_t        getSize() const;
 
-    // Get the number of readers
+    // Get the number of reader slots
     const std::size_t        getNumReaders() const;
 
-    // Get a pointer to the buffer mutex
-    std::mutex*              getMutex();
-
-    // Get a pointer to the new data ready conditional variable
-    std::condition_variable* getDataReady();
-
     // Print the buffer statistics information
     void printStatistic() const;
 
 private:
-    typedef std::vector<SmurfPacket>::iterator data_it_t; // Iterator data type
-
-    std::size_t              size;          // Buffer size
-    std::size_t              numberReaders; // Number of readers
-    std::vector<SmurfPacket> data;          // Raw buffer data
-    std::vector<data_it_t>   readPtr;       // Read iterator (one for each reader)
-    data_it_t                writePtr;      // Write iterator
-    std::deque<bool>         full;          // Buffer full flag (one for each reader)
-    std::deque<bool>         empty;         // Buffer empty flag (one for each reader)
-    std::size_t              writeCnt;      // Write operation counter
-    std::vector<std::size_t> readCnt;       // Read operation counter (one for each reader)
-    std::vector<std::size_t> OWCnt;         // Overwrite counter (one for each reader)
-    std::vector<std::size_t> ROFCnt;        // Read overflow counter (one for each reader)
-    std::mutex               mutex;         // Buffer mutex
-    std::condition_variable  dataReady;     // New data ready conditional variable
+    // Reader state, one cache line each
+    struct alignas(64) Reader
+    {
+        std::atomic<uint64_t>    cursor;    // (next sequence number << 1) | claimed bit
+        std::atomic<std::size_t> readCnt;   // Read operation counter
+        std::atomic<std::size_t> OWCnt;     // Overwrite counter
+        std::atomic<std::size_t> ROFCnt;    // Read overflow counter
+        std::atomic<std::size_t> highWater; // Largest lag seen by the writer
+        std::atomic<std::size_t> timeoutCnt;// Blocking waits that timed out
+        std::atomic<int>         policy;    // Policy when full
+        std::atomic<std::size_t> timeoutMs; // Longest wait, for the Blocking policy
+        std::atomic<bool>        behind;    // Blocking reader timed out, drops until it catches up
+        std::atomic<bool>        active;    // The slot is in use
+    };
+
+    // True if attached reader 'r' has no free slot for packet 'w'
+    bool full(const Reader &r, uint64_t w) const;
+
+    // Wait until Blocking reader 'r' has a free slot, or the deadline passes. Returns false on timeout.
+    bool waitForRoom(Reader &r, uint64_t w, uint64_t deadlineNs);
+
+    // Applies a requested size change, if all the readers are caught up. Writer only.
+    void applySize(uint64_t w);
+
+    // Returns reader 'i', throws if the index is out of range
+    Reader&       reader(std::size_t i);
+    const Reader& reader(std::size_t i) const;
+
+    std::atomic<std::size_t> size;          // Buffer size
+    std::atomic<std::size_t> requestedSize; // Buffer size to apply
+    std::size_t              numberReaders; // Number of reader slots
+    std::mutex               attachMutex;   // Serializes attachReader and detachReader
+    std::vector<SmurfPacket> data;          // Raw buffer data, capacity reserved for the max size
+    std::vector<SmurfPacket> spares;        // Swapped with a slot in use by a reader. Writer only.
+    Reader                  *readers;       // Reader cursors and counters (cache line aligned)
+
+    char                     pad0[cache_line_size];
+    std::atomic<uint64_t>    writeSeq;      // Number of packets published
+    std::atomic<std::size_t> writeCnt;      // Write operation counter
+    std::atomic<std::size_t> dropCnt;       // New packets dropped
+    char                     pad1[cache_line_size];
+    std::atomic<uint32_t>    futexWord;     // Incremented on every publish, readers sleep on it
+    std::atomic<int>         waiters;       // Number of readers sleeping on the futex
+    char                     pad2[cache_line_size];
+    std::atomic<uint32_t>    readWord;      // Incremented on every doneReading, the writer sleeps on it
+    std::atomic<int>         writerWaiting; // The writer is sleeping on readWord
+    char                     pad3[cache_line_size];
 };
 
-#endif
\ No newline at end of file
+#endif
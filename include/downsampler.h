@@ -0,0 +1,116 @@
+#ifndef __DOWNSAMPLER_H__
+#define __DOWNSAMPLER_H__
+
+#include <stdexcept>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "data_buffer.h"
+#include "packet_subscribers.h"
+#include "smurf_packet.h"
+
+// Maximum number of extra output streams
+static const std::size_t DownsamplerMaxStreams = 8;
+
+// An extra output stream of the processor, at its own rate. It samples the filter output on the
+// frames selected by its trigger, and writes them to its own packet buffer, with its own
+// subscribers. So a slow consumer of a low rate stream never sees the full rate traffic.
+// Triggers:
+// - Frames:       every 'period' frames (1 = every frame).
+// - Syncword:     every 'period' changes of the MCE sync word.
+// - EpicsSeconds: on the first frame of each 'period' seconds of timing system time. The
+//                 boundaries are multiples of 'period' seconds, so they are the same in all crates.
+// The filter is the anti aliasing filter of every stream. With the flat average filter (order -1),
+// which restarts at each output of the main stream, a stream gets the average since the last one.
+class DownsamplerStream
+{
+public:
+  enum Trigger
+  {
+    Frames       = 0,
+    Syncword     = 1,
+    EpicsSeconds = 2
+  };
+
+  DownsamplerStream(int id, const std::string &name, Trigger trigger, uint32_t period, std::size_t depth);
+
+  // Check if this stream takes the current frame. Called once per frame by the processing thread.
+  bool tick(SmurfHeader *H);
+
+  // Write the frame to a new packet and publish it. Called by the processing thread on the frames
+  // tick() selected. The packet is dropped (and counted by the buffer) if there is no free slot.
+  void emit(uint8_t *header, avgdata_t *data, std::size_t numCh);
+
+  // True if tick() selected the current frame
+  bool fired() const { return pending; };
+
+  int                 getId()       const { return id;      };
+  const std::string&  getName()     const { return name;    };
+  Trigger             getTrigger()  const { return trigger; };
+  uint32_t            getPeriod()   const { return period;  };
+
+  // Number of packets written
+  std::size_t         getEmitCnt()  const { return emitCnt; };
+
+  DataBuffer&         getBuffer()         { return buffer;      };
+  PacketSubscribers&  getSubscribers()    { return subscribers; };
+
+private:
+  int                       id;
+  std::string               name;
+  Trigger                   trigger;
+  uint32_t                  period;
+  uint32_t                  count;        // Frames or sync word changes since the last output
+  uint64_t                  last;         // Last sync word, or last period of epics seconds
+  bool                      first;        // No frame seen yet
+  bool                      pending;      // The current frame is sent out
+  std::atomic<std::size_t>  emitCnt;
+  DataBuffer                buffer;
+  PacketSubscribers         subscribers;
+};
+
+typedef std::shared_ptr<DownsamplerStream> DownsamplerStreamPtr;
+
+// The extra output streams. Streams can be added and removed at run time, from any thread. The
+// processing thread reads them from a snapshot, so it never waits for add() or remove().
+class Downsampler
+{
+public:
+  Downsampler();
+  ~Downsampler();
+
+  // Add a stream and return its id. 'depth' is the depth of its packet buffer.
+  int add(const std::string &name, DownsamplerStream::Trigger trigger, uint32_t period, std::size_t depth);
+
+  // Remove stream 'id'. Its subscribers are detached first.
+  void remove(int id);
+
+  // Remove all the streams
+  void removeAll();
+
+  // Run the triggers of all the streams. Returns true if any of them takes the current frame.
+  // Called once per frame by the processing thread, before the frame is filtered.
+  bool tick(SmurfHeader *H);
+
+  // Send the current frame to the streams which take it. Called by the processing thread,
+  // after tick() returned true.
+  void emit(uint8_t *header, avgdata_t *data, std::size_t numCh);
+
+  // Stream 'id', throws if unknown
+  DownsamplerStreamPtr get(int id);
+
+  // Ids of the streams
+  std::vector<int> getIds();
+
+private:
+  typedef std::vector<DownsamplerStreamPtr> List;
+
+  std::shared_ptr<const List>  streams;  // Snapshot, replaced by add() and remove()
+  std::shared_ptr<const List>  current;  // Snapshot of the current frame, taken by tick()
+  int                          nextId;
+  std::mutex                   mut;
+};
+
+#endif
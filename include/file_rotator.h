@@ -0,0 +1,64 @@
+#ifndef __FILE_ROTATOR_H__
+#define __FILE_ROTATOR_H__
+
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// Largest space reserved for a data file
+static const uint64_t FileRotatorMaxPrealloc = 2ULL << 30;
+
+// Opens the next data file in the background, so the file writer doesn't wait for unlink(),
+// open() and the file system allocating blocks when it moves to a new file. prepare() asks for
+// the next file as soon as the current one is opened. The background thread deletes an old file
+// with that name, creates the new one, and reserves its space with fallocate() (without changing
+// its size, so readers see only the data written; the writer truncates the file when it closes).
+// take() then hands the file over at rotation time.
+class FileRotator
+{
+public:
+  FileRotator();
+  ~FileRotator();
+
+  // Ask for file 'name' to be created, opened with O_DIRECT if 'direct', with 'prealloc' bytes
+  // reserved. Replaces a file prepared before, which is deleted.
+  void prepare(const std::string &name, bool direct, uint64_t prealloc);
+
+  // Take the file prepared for 'name'. Returns its fd, and sets 'direct' if it was opened with
+  // O_DIRECT, or returns -1 if there is no such file: then the caller opens it. Waits if the file
+  // is still being prepared. A file prepared for another name is deleted.
+  int take(const std::string &name, bool &direct);
+
+  // Delete the prepared file, if any
+  void discard();
+
+  // Files handed over by take(), and rotations where no file was prepared
+  std::size_t getTakenCnt()  const { return takenCnt; };
+  std::size_t getMissedCnt() const { return missedCnt; };
+
+private:
+  // Thread body
+  void run();
+
+  // Close and delete the prepared file. Called with 'mut' held.
+  void drop();
+
+  std::string              name;      // File asked for, or prepared
+  bool                     direct;    // O_DIRECT asked for
+  bool                     gotDirect; // The file was opened with O_DIRECT
+  uint64_t                 prealloc;
+  int                      fd;        // Prepared file, -1 if none
+  bool                     pending;   // A file is asked for, and not prepared yet
+  bool                     stop;
+  bool                     warned;    // fallocate() failure already logged
+  std::atomic<std::size_t> takenCnt;
+  std::atomic<std::size_t> missedCnt;
+  std::mutex               mut;
+  std::condition_variable  cond;
+  std::thread              thread;
+};
+
+#endif
@@ -0,0 +1,134 @@
+#ifndef __FILE_WRITER_H__
+#define __FILE_WRITER_H__
+
+#include <stdint.h>
+#include <atomic>
+#include <cstddef>
+#include <vector>
+#include <sys/uio.h>
+
+// Size and number of the staging buffers of a FileWriter
+static const std::size_t FileWriterBufferSize  = 1 << 20;
+static const std::size_t FileWriterNumBuffers  = 4;
+
+// Alignment of the staging buffers, and of the file offsets and lengths with O_DIRECT
+static const std::size_t FileWriterAlign       = 4096;
+
+// Time after which a partly filled buffer is written anyway (not with O_DIRECT)
+static const uint64_t    FileWriterMaxDelayNs  = 1000000000ULL;
+
+// Writes a data file in large batches. write() copies the data into a page aligned staging
+// buffer, and full buffers are written to the file with one request each:
+// - Async (io_uring, Linux 5.1 and later): the buffer is submitted to the kernel and write()
+//   returns right away. It only waits if all the buffers are still being written.
+// - Sync (pwrite), when io_uring is not available or not requested: the buffer is written
+//   before write() returns.
+// Short writes are completed, and failed writes are counted. With O_DIRECT the page cache is
+// bypassed, and the last buffer is padded to the alignment, then the file is truncated to its
+// real length when it is closed. If the file system doesn't support O_DIRECT, the file is
+// opened without it.
+// Files can be switched without waiting: attach() moves on to a new file right away, and the
+// previous one is closed once its last writes are done.
+// Single threaded: all the methods must be called from the same thread. The counters can be
+// read from any thread.
+class FileWriter
+{
+public:
+  FileWriter();
+  ~FileWriter();
+
+  // Create (or truncate) file 'name', and attach it. Returns false on error.
+  bool open(const char *name, bool async, bool direct);
+
+  // Write to the already open file 'fd' from now on, opened with O_DIRECT if 'direct'. The
+  // current file is detached. If 'trim' is set (the file has space reserved past its end), the
+  // file is truncated to the length written when it is closed.
+  void attach(int fd, bool async, bool direct, bool trim);
+
+  // Write the staged data of the current file, and close it once its writes are done.
+  // Doesn't wait for them.
+  void detach();
+
+  // Append 'len' bytes to the file. Returns false if the file is not open.
+  bool write(const uint8_t *data, std::size_t len);
+
+  // Detach the current file, and wait until all the files are written and closed
+  void close();
+
+  bool isOpen() const { return fd >= 0; };
+
+  // Length of the current file, including the staged data
+  uint64_t getLength() const { return offset; };
+
+  // Name of the backend in use, for the logs
+  const char* backend() const;
+
+  // Bytes written to the file, write requests, short writes (completed later) and failed writes
+  std::size_t getBytes()         const { return bytes;     };
+  std::size_t getWriteCnt()      const { return writeCnt;  };
+  std::size_t getShortWriteCnt() const { return shortCnt;  };
+  std::size_t getErrorCnt()      const { return errorCnt;  };
+
+private:
+  struct Buffer
+  {
+    uint8_t  *data;
+    size_t    used;      // Bytes staged
+    size_t    done;      // Bytes written, while in flight
+    size_t    length;    // Bytes to write (used, padded with O_DIRECT)
+    uint64_t  offset;    // File offset of data[0]
+    int       fd;        // File of the write request
+    bool      direct;    // fd was opened with O_DIRECT
+    bool      inFlight;  // Submitted to io_uring
+    iovec     iov;
+  };
+
+  // Detached file, closed when its writes are done
+  struct Retired
+  {
+    int       fd;
+    uint64_t  length;
+    bool      trim;      // Truncate to 'length' before closing
+  };
+
+  // io_uring instance, set up with raw syscalls
+  struct Ring;
+
+  // Close the retired files which have no write in flight
+  void closeRetired();
+
+  // Submit the current buffer and move to the next one
+  void submit();
+
+  // Write (the rest of) buffer 'b': a request to io_uring, or pwrite() calls
+  void writeBuffer(Buffer &b);
+
+  // Account for 'n' more bytes of buffer 'b' written. Returns false if the rest can't be written.
+  bool advance(Buffer &b, std::size_t n);
+
+  // Wait until buffer 'b' is not in flight
+  void waitFor(Buffer &b);
+
+  // Process the io_uring completions. Waits for one if 'wait' is true.
+  void reap(bool wait);
+
+  bool setupRing();
+  void closeRing();
+
+  int                       fd;
+  bool                      direct;
+  bool                      trim;
+  std::vector<Retired>      retired;
+  Ring                     *ring;        // NULL for the sync backend
+  bool                      ringFailed;  // io_uring is not available, don't try again
+  Buffer                    buffers[FileWriterNumBuffers];
+  std::size_t               cur;         // Buffer being filled
+  uint64_t                  offset;      // File offset of the next staged byte
+  uint64_t                  firstStaged; // Time the current buffer got its first byte (ns)
+  std::atomic<std::size_t>  bytes;
+  std::atomic<std::size_t>  writeCnt;
+  std::atomic<std::size_t>  shortCnt;
+  std::atomic<std::size_t>  errorCnt;
+};
+
+#endif
@@ -0,0 +1,90 @@
+#ifndef _FILTER_KERNELS_H_
+#define _FILTER_KERNELS_H_
+
+#include <stdint.h>
+#include "smurf2mce.h"
+
+// Direct form IIR kernels used by SmurfFilter.
+// One call processes one frame for n channels:
+//   x(n) = in
+//   y(n) = ( b[0]*x(n) + sum_{r=1..order} ( b[r]*x(n-r) - a[r]*y(n-r) ) ) / a[0]
+//   out  = (avgdata_t) ( y(n) * g )
+// x[r] and y[r] (r = 0..order) are precomputed pointers to the ring buffer records holding
+// x(n-r) and y(n-r). x[0] and y[0] are written by the kernel.
+//
+// The vector kernels keep a block of channels in registers and apply every tap to the whole
+// block with one fused multiply-add. Because the FMA rounds once per tap instead of twice,
+// they are not bit-exact with the scalar kernel:
+// - the y(n) history differs by less than 1e-11 of the input full scale (below 0.01 counts
+//   for inputs of +-2^30 counts);
+// - the integer output differs by at most 1 count, when y(n)*g sits next to an integer and
+//   the truncation falls on the other side (about 0.1% of the outputs).
+// These bounds were measured with the 4th order Butterworth from smurf.cfg, on sine and white
+// noise inputs. iir_scalar keeps the original operation order and is bit-exact.
+typedef void (*iir_kernel_t)(const avgdata_t *in, filter_t * const *x, filter_t * const *y,
+                             const filter_t *a, const filter_t *b, filter_t g, int order, uint n, avgdata_t *out);
+
+void iir_scalar(const avgdata_t *in, filter_t * const *x, filter_t * const *y,
+                const filter_t *a, const filter_t *b, filter_t g, int order, uint n, avgdata_t *out);
+void iir_avx2(const avgdata_t *in, filter_t * const *x, filter_t * const *y,
+              const filter_t *a, const filter_t *b, filter_t g, int order, uint n, avgdata_t *out);
+void iir_avx512(const avgdata_t *in, filter_t * const *x, filter_t * const *y,
+                const filter_t *a, const filter_t *b, filter_t g, int order, uint n, avgdata_t *out);
+
+// Returns the fastest kernel supported by this CPU
+iir_kernel_t select_iir_kernel(void);
+
+// Returns the name of a kernel, for diagnostic printouts
+const char *iir_kernel_name(iir_kernel_t kernel);
+
+// Second order sections (cascaded biquads) kernels, in single precision.
+// Each section runs the transposed direct form II, with a[0] normalized to 1:
+//   y  = b0*v + s1
+//   s1 = b1*v - a1*y + s2
+//   s2 = b2*v - a2*y
+// where v is the input of the section (the output of the previous one). Then
+// out = (avgdata_t) ( y * g ) for the last section.
+// coef holds 5 values per section: b0, b1, b2, a1, a2.
+// state holds 2 values per section per channel, laid out as [section][s1/s2][channel], with
+// 'stride' values per row. stride can be larger than n, to run a block of the channels.
+//
+// Biquads are well conditioned, so single precision is enough for the filter itself. With the
+// 4th order Butterworth from smurf.cfg split in 2 sections, on a 2^20 counts sine plus noise,
+// all kernels stay within 2e-5 of the amplitude (20 counts) of the double precision direct
+// form. The vector kernels use FMA, so they are not bit-exact with the scalar one.
+// The int32 to float conversion keeps 24 significant bits, so unwrapped inputs larger than
+// 2^24 counts lose their lowest bits.
+typedef void (*sos_kernel_t)(const avgdata_t *in, sos_t *state, uint stride, const sos_t *coef, int sections,
+                             sos_t g, uint n, avgdata_t *out);
+
+void sos_scalar(const avgdata_t *in, sos_t *state, uint stride, const sos_t *coef, int sections, sos_t g, uint n, avgdata_t *out);
+void sos_avx2(const avgdata_t *in, sos_t *state, uint stride, const sos_t *coef, int sections, sos_t g, uint n, avgdata_t *out);
+void sos_avx512(const avgdata_t *in, sos_t *state, uint stride, const sos_t *coef, int sections, sos_t g, uint n, avgdata_t *out);
+
+// Returns the fastest kernel supported by this CPU
+sos_kernel_t select_sos_kernel(void);
+
+// Returns the name of a kernel, for diagnostic printouts
+const char *sos_kernel_name(sos_kernel_t kernel);
+
+// Flat average (order -1) kernels. Every frame adds the input to a 64-bit integer running sum:
+//   sum[j] += in[j]
+// which is exact, so all kernels give the same result. The average itself is only needed when a
+// packet is sent out, see avg_divide().
+typedef void (*avg_kernel_t)(const avgdata_t *in, int64_t *sum, uint n);
+
+void avg_scalar(const avgdata_t *in, int64_t *sum, uint n);
+void avg_avx2(const avgdata_t *in, int64_t *sum, uint n);
+void avg_avx512(const avgdata_t *in, int64_t *sum, uint n);
+
+// Returns the fastest kernel supported by this CPU
+avg_kernel_t select_avg_kernel(void);
+
+// Returns the name of a kernel, for diagnostic printouts
+const char *avg_kernel_name(avg_kernel_t kernel);
+
+// out[j] = (avgdata_t) ( sum[j] / count ), truncated toward zero like the double precision
+// average it replaces. The results are the same as long as |sum| < 2^53 and count < 2^22.
+void avg_divide(const int64_t *sum, int64_t count, uint n, avgdata_t *out);
+
+#endif
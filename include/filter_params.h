@@ -0,0 +1,80 @@
+#ifndef __FILTER_PARAMS_H__
+#define __FILTER_PARAMS_H__
+
+#include <stdexcept>
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include <functional>
+#include <stdint.h>
+#include "smurf2mce.h"
+
+// Filter settings, as used by SmurfFilter for one frame.
+// Objects are never modified once published, a change is a new object with a new version.
+class FilterParams
+{
+public:
+  FilterParams();
+
+  uint64_t version;                             // Set by FilterParamsPublisher, 0 means never published
+  int      order;                               // Direct form order, -1 is the flat average
+  filter_t a[16];                               // Direct form coefficients
+  filter_t b[16];
+  filter_t g;                                   // Output gain, for both forms
+  int      sos_n;                               // Number of biquad sections, 0 uses the direct form
+  filter_t sos[filter_max_sections][5];         // b0, b1, b2, a1, a2 per section, normalized to a0 = 1
+  bool     decimate;                            // Compute FIR outputs only on frames that are sent out
+  bool     warm_start;                          // Start a new filter from its steady state instead of zeros
+
+  // True if both objects run the same filter, so its state can be kept across the swap.
+  // Only the gain, the decimate flag and the warm start flag can differ.
+  bool sameFilter(const FilterParams& rhs) const;
+
+  // True if all the settings are the same (the version is not compared)
+  bool sameSettings(const FilterParams& rhs) const;
+};
+
+// Publishes FilterParams objects from any thread to a single reader, the processing thread.
+// The reader gets the current object with one atomic load per frame and no lock. Writers
+// are serialized by a mutex.
+//
+// Old objects are freed by the writers once the reader has acknowledged a newer version:
+// read() acknowledges the version it returns, which means the reader no longer uses any
+// older object.
+class FilterParamsPublisher
+{
+public:
+  FilterParamsPublisher();
+  ~FilterParamsPublisher();
+
+  // Reader side. Returns the current object, valid until the next call.
+  const FilterParams* read();
+
+  // Writer side. Copies 'p', publishes it as a new version and returns that version.
+  uint64_t publish(const FilterParams& p);
+
+  // Writer side. Applies 'f' to a copy of the latest settings and publishes the result, all
+  // under the writer mutex, so concurrent writers don't lose each other's changes.
+  uint64_t update(const std::function<void(FilterParams&)>& f);
+
+  // Copy of the latest published settings
+  FilterParams latest();
+
+  // Version acknowledged by the reader
+  uint64_t getAckVersion() const { return ack; };
+
+  // Number of retired objects not freed yet
+  std::size_t getRetiredCnt();
+
+private:
+  // Frees the retired objects the reader can't be using anymore. Called with the mutex held.
+  void reclaim();
+
+  std::atomic<FilterParams*> current;  // Object returned by read()
+  std::atomic<uint64_t>      ack;      // Latest version returned by read()
+  uint64_t                   nextVersion;
+  std::vector<FilterParams*> retired;  // Published objects, older than 'current'
+  std::mutex                 mut;      // Serializes the writers
+};
+
+#endif
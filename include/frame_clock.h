@@ -0,0 +1,55 @@
+#ifndef __FRAME_CLOCK_H__
+#define __FRAME_CLOCK_H__
+
+#include <stdint.h>
+#include <time.h>
+
+// Per-frame timestamps. stamp() reads the clock once per frame, and every stage of the frame
+// uses that value, instead of reading the clock again.
+// On x86 with an invariant TSC, the time is the TSC scaled to CLOCK_MONOTONIC, plus the offset
+// from CLOCK_MONOTONIC to CLOCK_REALTIME: one rdtsc and a multiply, no syscall. The scale and
+// the offset are computed again at intervals growing up to about a second, from clock_gettime
+// (a vDSO call), so the time follows NTP adjustments and the scale gets more precise over time.
+// The time never goes back by a little: if a sync moves it back by up to FrameClockMaxStepBack,
+// it stays put for a moment. A larger step back means the clock was set, then the time follows
+// it (with a message), instead of staying frozen until the clock catches up. Without a usable
+// TSC, stamp() calls clock_gettime(CLOCK_REALTIME).
+// Single threaded: stamp() must be called from one thread.
+static const uint64_t FrameClockMaxStepBack = 100000000ULL;  // 100 ms
+
+class FrameClock
+{
+public:
+  FrameClock();
+
+  // Read the clock. Returns unix time in nanoseconds, and keeps it for get().
+  uint64_t stamp();
+
+  // The last value returned by stamp()
+  uint64_t get() const { return last; };
+
+  // True if stamp() reads the TSC
+  bool usesTsc() const { return tsc; };
+
+  // Number of steps back larger than FrameClockMaxStepBack the time followed
+  uint64_t getStepBackCnt() const { return stepBackCnt; };
+
+private:
+  // Read the TSC, CLOCK_MONOTONIC and CLOCK_REALTIME together
+  void read(uint64_t &t, uint64_t &mono, uint64_t &real);
+
+  // Read the clocks, and refresh the scale and offset
+  void sync();
+
+  bool     tsc;        // The TSC is invariant, so it can be used
+  uint64_t tsc0;       // TSC and monotonic time at the first read, for the scale
+  uint64_t mono0;
+  uint64_t tscBase;    // TSC and realtime at the last sync
+  uint64_t realBase;
+  uint64_t mult;       // Nanoseconds per tick, fixed point with 32 fractional bits
+  uint64_t syncTicks;  // Ticks between syncs (10 ms, doubling up to about 1 s)
+  uint64_t last;       // Last timestamp
+  uint64_t stepBackCnt;// Large steps back followed
+};
+
+#endif
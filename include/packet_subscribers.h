@@ -0,0 +1,93 @@
+#ifndef __PACKET_SUBSCRIBERS_H__
+#define __PACKET_SUBSCRIBERS_H__
+
+#include <stdexcept>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "data_buffer.h"
+
+// Maximum number of threaded subscribers, i.e. of reader slots in the packet buffer
+static const std::size_t PacketMaxSubscribers = 16;
+
+// Consumer of the processed SMuRF packets
+class PacketSubscriber
+{
+public:
+  virtual ~PacketSubscriber() {};
+
+  // Called once for each packet the subscriber receives. The packet is only valid during the call.
+  virtual void process(SmurfPacket_RO packet) = 0;
+};
+
+typedef std::shared_ptr<PacketSubscriber> PacketSubscriberPtr;
+
+// Subscribers attached to a packet buffer, at run time. Two kinds:
+// - Threaded: the subscriber has its own buffer reader (cursor and policy) and its own thread,
+//   which calls process() for each packet it reads. A slow one only loses its own packets,
+//   according to its policy.
+// - Inline: process() is called by the packet writer, right after each packet is written.
+//   No thread, no buffer slot and no packet loss, but it delays the processing thread, so it
+//   must be quick.
+// attach() and detach() can be called from any thread. The writer reads the inline subscribers
+// from a snapshot, so it never waits for attach() or detach().
+class PacketSubscribers
+{
+public:
+  PacketSubscribers(DataBuffer &buffer);
+  ~PacketSubscribers();
+
+  // Attach a subscriber and return its id. Policy and timeoutMs are the buffer reader policy of
+  // threaded subscribers, they are not used by inline subscribers.
+  int attach(PacketSubscriberPtr sub, const std::string &name, bool threaded, DataBuffer::Policy policy, std::size_t timeoutMs);
+
+  // Detach subscriber 'id'. For threaded subscribers, waits for the thread to stop.
+  void detach(int id);
+
+  // Detach all the subscribers
+  void detachAll();
+
+  // Call the inline subscribers. Called by the packet writer after each packet.
+  void publish(const SmurfPacket_RO &packet);
+
+  // Buffer reader index of threaded subscriber 'id'. Throws for unknown ids and inline subscribers.
+  std::size_t reader(int id);
+
+  // Ids and names of the attached subscribers
+  std::vector<int>         getIds();
+  std::string              getName(int id);
+
+private:
+  typedef std::vector<PacketSubscriberPtr> List;
+
+  struct Entry
+  {
+    int                       id;
+    std::string               name;
+    PacketSubscriberPtr       sub;
+    bool                      threaded;
+    std::size_t               reader;     // Buffer reader index, threaded only
+    std::atomic<bool>         run;        // Cleared to stop the thread
+    std::thread               thread;
+  };
+
+  // Thread body of threaded subscribers
+  void loop(Entry *e);
+
+  // Rebuild the inline snapshot. Called with 'mut' held.
+  void updateInline();
+
+  // Entry of subscriber 'id', throws if unknown. Called with 'mut' held.
+  std::vector<std::unique_ptr<Entry>>::iterator find(int id);
+
+  DataBuffer                          &buffer;
+  std::vector<std::unique_ptr<Entry>>  entries;
+  std::shared_ptr<const List>          inlineSubs;  // Snapshot read by publish()
+  int                                  nextId;
+  std::mutex                           mut;
+};
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef _SAMPLE_CODEC_H_
+#define _SAMPLE_CODEC_H_
+
+#include <stdint.h>
+#include <cstddef>
+#include "smurf2mce.h"
+
+// Lossless codec for a column of filtered samples (one channel over consecutive frames).
+// Each sample is predicted by the previous one; the differences are zigzag mapped (so small
+// negative and positive values are both small) and bit packed in blocks of 256, with the width
+// of the largest value of the block. An encoded column is:
+//
+//   int32 first sample
+//   for each block of 256 samples: 1 byte width b (0..32), then 32 * b bytes
+//
+// The last block is padded with zero differences. Inside a block, the values are packed in 8
+// interleaved lanes: value i goes to lane i % 8, and 32-bit word k of lane l is word k * 8 + l,
+// so 8 values are packed or unpacked per vector instruction. All numbers are little endian.
+//
+// All kernels produce the same bytes. The fastest one supported by the CPU is selected at run time.
+
+static const std::size_t SampleCodecBlock = 256;
+
+// Encode one block: SampleCodecBlock samples, following 'prev'. Returns the bytes written.
+typedef std::size_t (*sample_encode_kernel_t)(const avgdata_t *in, avgdata_t prev, uint8_t *out);
+
+// Decode one block, of width in[0] (at most 32), following 'prev'.
+typedef void (*sample_decode_kernel_t)(const uint8_t *in, avgdata_t prev, avgdata_t *out);
+
+std::size_t sample_encode_scalar(const avgdata_t *in, avgdata_t prev, uint8_t *out);
+std::size_t sample_encode_avx2(const avgdata_t *in, avgdata_t prev, uint8_t *out);
+void        sample_decode_scalar(const uint8_t *in, avgdata_t prev, avgdata_t *out);
+void        sample_decode_avx2(const uint8_t *in, avgdata_t prev, avgdata_t *out);
+
+// Largest encoded size of n samples
+std::size_t sample_codec_bound(std::size_t n);
+
+// Encode n samples to 'out', which holds at least sample_codec_bound(n) bytes. Returns the
+// encoded length.
+std::size_t encode_samples(const avgdata_t *in, std::size_t n, uint8_t *out);
+
+// Decode n samples from the 'length' bytes at 'in'. Returns false if the data is not a valid
+// encoding of n samples.
+bool decode_samples(const uint8_t *in, std::size_t length, std::size_t n, avgdata_t *out);
+
+// Name of the kernels in use, for diagnostic printouts
+const char *sample_codec_kernel_name(void);
+
+#endif
@@ -27,6 +27,7 @@ typedef int32_t avgdata_t;  // data type for averaged data was int but needs int
 // typedef uint32_t MCE_t;  // data type used in mce system
 typedef int32_t wrap_t; // data type for wrap counter
 typedef double filter_t;  // data type for filtering data
+typedef float sos_t;  // data type for the second order sections filter state
 
 const uint slow_divider = 200; // sets divisiion ration from mce rate to display rate
 
@@ -34,7 +35,9 @@ const uint tcpreclen = 0x80000;  // allow for multiple  reads in one frame proab
 const size_t pyrogue_buffer_length = 0x8000; // not sure what the maximum size could be
 const uint smurf_raw_samples = 4096; // samples before masking.  this is from the smurf to transmitter
 const uint smurfsamples = 528;  // number of SMuRF samples in a frame was 528 (av
+const uint smurf_max_channels = smurf_raw_samples; // upper limit of the run time channel count, buffers are sized for it
 const uint smurfheaderlength =128; // number of bytes in smurf header
+const uint filter_max_sections = 8; // maximum number of second order sections (biquads)
 
 // const uint tcp_header_size = 8; // number of bytes in tcp header for data checking
 
@@ -0,0 +1,111 @@
+#ifndef __SMURF_FILE_READER_H__
+#define __SMURF_FILE_READER_H__
+
+#include <stdint.h>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "smurf_packet.h"
+#include "columnar_format.h"
+
+// Read-only memory mapping of a whole file, unmapped with the last reference
+class SmurfFileMap
+{
+public:
+  SmurfFileMap(const std::string &name);
+  ~SmurfFileMap();
+
+  const uint8_t *data()   const { return addr;   };
+  std::size_t    length() const { return size;   };
+
+private:
+  SmurfFileMap(const SmurfFileMap&);
+  SmurfFileMap& operator=(const SmurfFileMap&);
+
+  const uint8_t *addr;
+  std::size_t    size;
+};
+
+typedef std::shared_ptr<const SmurfFileMap> SmurfFileMapPtr;
+
+// Reads a data file written by SmurfDataFile (a .part_NNNNN file), in the raw format (the
+// packets one after the other) or in the columnar format (columnar_format.h). The file is
+// memory mapped:
+// - the packets of a raw file are handed out as ISmurfPacket_RO objects over the mapped memory,
+//   without any copy; those of a columnar file are put back together from the columns.
+// - readChannel() and readHeaderField() extract one channel, or one header field, over a range
+//   of frames. With a columnar file, only the columns asked for are read from the disk.
+// A file still being written can be read: the frames written so far are indexed, up to the
+// last complete packet (raw format) or chunk (columnar format).
+// The read methods can be called from several threads.
+class SmurfFileReader
+{
+public:
+  // Opens and indexes the file. Throws std::runtime_error if it can't be read.
+  SmurfFileReader(const std::string &name);
+
+  bool        isColumnar()                     const { return columnar;          };
+  uint32_t    getCodec()                       const { return codec;             }; // ColumnarCodec, of a columnar file
+  std::size_t getNumFrames()                   const { return numFrames;         };
+  std::size_t getMaxChannels()                 const { return maxChannels;       }; // Largest number of channels of a frame
+  std::size_t getNumChannels(std::size_t frame) const;                              // Number of channels of a frame
+
+  // Packet of frame 'frame'. For a raw file it shares the mapping, and stays valid after the
+  // reader is destroyed.
+  SmurfPacket_RO getPacket(std::size_t frame) const;
+
+  // Copy channel 'channel' of frames [first, first + count) to 'out'. Frames with fewer
+  // channels give 0. Returns the number of frames copied (less than 'count' at the end of the file).
+  std::size_t readChannel(std::size_t channel, std::size_t first, std::size_t count, avgdata_t *out) const;
+
+  // Same, for a header field of up to 8 bytes (unix time, frame counter...), zero extended
+  std::size_t readHeaderField(SmurfHeaderField field, std::size_t first, std::size_t count, uint64_t *out) const;
+
+  // First frame with a unix time (ns) at or after 't', getNumFrames() if none. The unix time
+  // of the frames is assumed to increase.
+  std::size_t findUnixTime(uint64_t t) const;
+
+private:
+  // A packet of a raw file, or the columns of a chunk of a columnar file
+  struct Entry
+  {
+    uint64_t  offset;         // File offset
+    uint32_t  numFrames;      // Frames in a chunk, 1 for a packet
+    uint32_t  numChannels;
+    uint64_t  firstFrame;     // Index of the first frame in the file
+    uint32_t  payloadOffset;  // From 'offset', to the payload columns of a chunk
+  };
+
+  // Index the packets of a raw file
+  void indexRaw();
+
+  // Index the chunks of a columnar file, from its index, or by walking the chunks
+  void indexColumnar();
+
+  // Entry holding frame 'frame'
+  const Entry &find(std::size_t frame) const;
+
+  // Payload column 'channel' of chunk 'e', decoded if needed into 'tmp'
+  const avgdata_t *column(const Entry &e, std::size_t channel, std::vector<avgdata_t> &tmp) const;
+
+  // Header column 'field' of chunk 'e'
+  const uint8_t *headerColumn(const Entry &e, std::size_t field) const;
+
+  SmurfFileMapPtr                    map;
+  bool                               columnar;
+  uint32_t                           codec;
+  std::size_t                        numFrames;
+  std::size_t                        maxChannels;
+  std::vector<Entry>                 entries;
+  std::vector<ColumnarFieldDesc>     fields;      // Header columns of a columnar file
+  std::vector<std::size_t>           fieldStart;  // Bytes per frame of the header columns before each one
+  std::vector<int>                   fieldOf;     // Header column of each SmurfHeaderField, -1 if none
+
+  // Payload columns of the last chunk put back together by getPacket(), when compressed
+  mutable std::mutex                 cacheMutex;
+  mutable std::size_t                cacheEntry;
+  mutable std::vector<avgdata_t>     cache;
+};
+
+#endif
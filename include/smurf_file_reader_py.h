@@ -0,0 +1,56 @@
+#ifndef __SMURF_FILE_READER_PY_H__
+#define __SMURF_FILE_READER_PY_H__
+
+#include <boost/python.hpp>
+#include <memory>
+#include <string>
+#include "smurf_file_reader.h"
+
+namespace bp = boost::python;
+
+// Python interface of SmurfFileReader. The bulk reads return 'bytes' objects filled in place,
+// for numpy.frombuffer(), or fill a writable buffer given by the caller (a numpy array), with
+// the GIL released; only the per frame calls copy a packet.
+class SmurfFileReaderPy
+{
+public:
+  SmurfFileReaderPy(const std::string &name);
+
+  bool        isColumnar()                  { return reader->isColumnar();          } // Columnar (1) or raw (0) file
+  uint32_t    getCodec()                    { return reader->getCodec();            } // Payload codec of a columnar file
+  std::size_t getNumFrames()                { return reader->getNumFrames();        } // Frames in the file
+  std::size_t getMaxChannels()              { return reader->getMaxChannels();      } // Largest number of channels of a frame
+  std::size_t getNumChannels(std::size_t f) { return reader->getNumChannels(f);     } // Number of channels of a frame
+  std::size_t findUnixTime(uint64_t t)      { return reader->findUnixTime(t);       } // First frame at or after a unix time (ns)
+  bp::object  getHeader(std::size_t frame);                                          // Header of a frame, as bytes
+  bp::object  getPayload(std::size_t frame);                                         // Payload of a frame, as bytes of int32
+  bp::object  readChannel(std::size_t channel, std::size_t first, long count);       // A channel over frames, as bytes of int32 (count < 0: to the end)
+  std::size_t readChannelInto(std::size_t channel, std::size_t first, bp::object buffer); // Same, into a writable buffer of int32, returns the frames read
+  bp::object  readHeaderField(int field, std::size_t first, long count);             // A header field over frames, as bytes of uint64
+
+  // Expose methods to python
+  static void setup_python()
+  {
+    bp::class_<SmurfFileReaderPy, boost::shared_ptr<SmurfFileReaderPy>, boost::noncopyable >("SmurfFileReader", bp::init<std::string>())
+      .def("isColumnar",             &SmurfFileReaderPy::isColumnar)
+      .def("getCodec",               &SmurfFileReaderPy::getCodec)
+      .def("getNumFrames",           &SmurfFileReaderPy::getNumFrames)
+      .def("getMaxChannels",         &SmurfFileReaderPy::getMaxChannels)
+      .def("getNumChannels",         &SmurfFileReaderPy::getNumChannels)
+      .def("findUnixTime",           &SmurfFileReaderPy::findUnixTime)
+      .def("getHeader",              &SmurfFileReaderPy::getHeader)
+      .def("getPayload",             &SmurfFileReaderPy::getPayload)
+      .def("readChannel",            &SmurfFileReaderPy::readChannel,     (bp::arg("channel"), bp::arg("first") = 0, bp::arg("count") = -1))
+      .def("readChannelInto",        &SmurfFileReaderPy::readChannelInto, (bp::arg("channel"), bp::arg("first"), bp::arg("buffer")))
+      .def("readHeaderField",        &SmurfFileReaderPy::readHeaderField, (bp::arg("field"), bp::arg("first") = 0, bp::arg("count") = -1))
+    ;
+  };
+
+private:
+  // Frames from 'first', at most 'count' (all if < 0)
+  std::size_t frames(std::size_t first, long count);
+
+  std::shared_ptr<SmurfFileReader> reader;
+};
+
+#endif
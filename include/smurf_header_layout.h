@@ -0,0 +1,158 @@
+#ifndef _SMURF_HEADER_LAYOUT_H_
+#define _SMURF_HEADER_LAYOUT_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <cstddef>
+
+// Layout of the SMuRF header, shared by SmurfHeader and ISmurfPacket. Each header version has
+// a table of field descriptors (byte offset and width), indexed by SmurfHeaderField. The
+// accessors take the field as a template argument, so the offset and width are constants
+// and the access compiles to a single load or store.
+//
+// To add a header version: add its table, a SmurfHeaderLayout specialization with the
+// static checks, and a case in the version switch of getHeaderField and setHeaderField.
+// The version byte must stay at offset 0 in every version.
+
+enum SmurfHeaderField
+{
+  hfVersion,              // Protocol version
+  hfCrateID,              // ATCA crate ID
+  hfSlotNumber,           // ATCA slot number
+  hfTimingConfiguration,  // Timing configuration
+  hfNumberChannels,       // Number of channels in this packet
+  hfTESDAC,               // TES DAC values, 16x 20 bit
+  hfUnixTime,             // 64 bit unix time nanoseconds
+  hfFluxRampIncrement,    // Flux ramp increment
+  hfFluxRampOffset,       // Flux ramp offset
+  hfCounter0,             // Counter since the last 1Hz marker
+  hfCounter1,             // Counter since the last external input
+  hfCounter2,             // 64 bit timing system time: epics nanoseconds, then epics seconds
+  hfAveragingResetBits,   // Average reset bits from the timing system
+  hfFrameCounter,         // Frame counter
+  hfTESRelaySetting,      // TES and flux ramp relays
+  hfExternalTimeClock,    // 40 bit MCE sync word
+  hfControlField,         // Control bits (clear, disable stream, disable file, read config) and test mode
+  hfTestParameters,       // Test parameters
+  hfNumberRows,           // MCE number of rows
+  hfNumberRowsReported,   // MCE number of rows reported
+  hfRowLength,            // MCE row length
+  hfDataRate,             // MCE data rate
+  hfCount
+};
+
+struct SmurfHeaderFieldDesc
+{
+  std::size_t offset;  // Byte offset in the header
+  std::size_t width;   // Number of bytes
+};
+
+// Header version 1
+constexpr SmurfHeaderFieldDesc smurfHeaderLayoutV1[hfCount] =
+{
+  {   0,  1 },  // hfVersion
+  {   1,  1 },  // hfCrateID
+  {   2,  1 },  // hfSlotNumber
+  {   3,  1 },  // hfTimingConfiguration
+  {   4,  4 },  // hfNumberChannels
+  {   8, 40 },  // hfTESDAC
+  {  48,  8 },  // hfUnixTime
+  {  56,  4 },  // hfFluxRampIncrement
+  {  60,  4 },  // hfFluxRampOffset
+  {  64,  4 },  // hfCounter0
+  {  68,  4 },  // hfCounter1
+  {  72,  8 },  // hfCounter2
+  {  80,  4 },  // hfAveragingResetBits
+  {  84,  4 },  // hfFrameCounter
+  {  88,  4 },  // hfTESRelaySetting
+  {  96,  5 },  // hfExternalTimeClock
+  { 104,  1 },  // hfControlField
+  { 105,  1 },  // hfTestParameters
+  { 112,  2 },  // hfNumberRows
+  { 114,  2 },  // hfNumberRowsReported
+  { 120,  2 },  // hfRowLength
+  { 122,  2 },  // hfDataRate
+};
+
+// Static checks of a table: the fields are inside the header, and don't overlap
+constexpr bool smurfHeaderFieldsInside(const SmurfHeaderFieldDesc *t, std::size_t n, std::size_t length)
+{
+  return (n == 0) || ( (t[n - 1].offset + t[n - 1].width <= length) && smurfHeaderFieldsInside(t, n - 1, length) );
+}
+
+constexpr bool smurfHeaderFieldsApart(const SmurfHeaderFieldDesc &a, const SmurfHeaderFieldDesc &b)
+{
+  return (a.offset + a.width <= b.offset) || (b.offset + b.width <= a.offset);
+}
+
+// Field i doesn't overlap fields j..n-1
+constexpr bool smurfHeaderFieldApartFrom(const SmurfHeaderFieldDesc *t, std::size_t n, std::size_t i, std::size_t j)
+{
+  return (j >= n) || ( smurfHeaderFieldsApart(t[i], t[j]) && smurfHeaderFieldApartFrom(t, n, i, j + 1) );
+}
+
+// Fields i..n-1 don't overlap each other
+constexpr bool smurfHeaderFieldsDisjoint(const SmurfHeaderFieldDesc *t, std::size_t n, std::size_t i = 0)
+{
+  return (i >= n) || ( smurfHeaderFieldApartFrom(t, n, i, i + 1) && smurfHeaderFieldsDisjoint(t, n, i + 1) );
+}
+
+template <unsigned V>
+struct SmurfHeaderLayout;
+
+template <>
+struct SmurfHeaderLayout<1>
+{
+  static constexpr SmurfHeaderFieldDesc field(SmurfHeaderField f) { return smurfHeaderLayoutV1[f]; }
+};
+
+static_assert(smurfHeaderFieldsInside(smurfHeaderLayoutV1, hfCount, 128), "SMuRF header v1 field out of the header");
+static_assert(smurfHeaderFieldsDisjoint(smurfHeaderLayoutV1, hfCount), "SMuRF header v1 fields overlap");
+static_assert(smurfHeaderLayoutV1[hfVersion].offset == 0, "The version byte must be at offset 0");
+
+// Latest header version, used for headers with an unknown version number
+const unsigned smurfHeaderLatestVersion = 1;
+
+// Read field F of a version V header. Fields narrower than T are zero extended.
+template <unsigned V, SmurfHeaderField F, typename T>
+inline T getHeaderField(const uint8_t *h)
+{
+  static_assert(SmurfHeaderLayout<V>::field(F).width <= sizeof(T), "SMuRF header field wider than its type");
+
+  T v = 0;
+  memcpy(&v, h + SmurfHeaderLayout<V>::field(F).offset, SmurfHeaderLayout<V>::field(F).width);
+  return v;
+}
+
+// Write field F of a version V header. Only the field's bytes are written.
+template <unsigned V, SmurfHeaderField F, typename T>
+inline void setHeaderField(uint8_t *h, const T &v)
+{
+  static_assert(SmurfHeaderLayout<V>::field(F).width <= sizeof(T), "SMuRF header field wider than its type");
+
+  memcpy(h + SmurfHeaderLayout<V>::field(F).offset, &v, SmurfHeaderLayout<V>::field(F).width);
+}
+
+// Read field F, with the layout of the header's version
+template <SmurfHeaderField F, typename T>
+inline T getHeaderField(const uint8_t *h)
+{
+  switch (h[0])
+  {
+    default:
+      return getHeaderField<smurfHeaderLatestVersion, F, T>(h);
+  }
+}
+
+// Write field F, with the layout of the header's version
+template <SmurfHeaderField F, typename T>
+inline void setHeaderField(uint8_t *h, const T &v)
+{
+  switch (h[0])
+  {
+    default:
+      setHeaderField<smurfHeaderLatestVersion, F, T>(h, v);
+  }
+}
+
+#endif
@@ -6,7 +6,6 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <string.h>
-#include <sys/timeb.h>
 #include <vector>
 #include <stdexcept>
 #include <memory>
@@ -15,36 +14,37 @@
 #include "tes_bias_array.h"
 
 #include "smurf2mce.h"
+#include "smurf_header_layout.h"
 
 uint64_t pull_bit_field(uint8_t *ptr, uint offset, uint width);
 
-// smurf header byte offsets
-const int h_version_offset = 0; // offset of version word
-const int h_version_width = 1; // bytes of version word
-const int h_num_channels_offset = 4; // normally 528 channels
-const int h_num_channels_width = 4;  // 32 bit number
+// smurf header byte offsets, from the header layout table
+const int h_version_offset = smurfHeaderLayoutV1[hfVersion].offset; // offset of version word
+const int h_version_width = smurfHeaderLayoutV1[hfVersion].width; // bytes of version word
+const int h_num_channels_offset = smurfHeaderLayoutV1[hfNumberChannels].offset; // normally 528 channels
+const int h_num_channels_width = smurfHeaderLayoutV1[hfNumberChannels].width;  // 32 bit number
 
-const int h_tes_dac_offset = 8; // TES DAC 0-15
-const int h_tes_dac_width = 40; // 16x 20-bit
+const int h_tes_dac_offset = smurfHeaderLayoutV1[hfTESDAC].offset; // TES DAC 0-15
+const int h_tes_dac_width = smurfHeaderLayoutV1[hfTESDAC].width; // 16x 20-bit
 
-const int h_unix_time_offset = 48; // offset to 64 bit unix time
-const int h_unix_time_width = 8;   // 64 bit timing word
+const int h_unix_time_offset = smurfHeaderLayoutV1[hfUnixTime].offset; // offset to 64 bit unix time
+const int h_unix_time_width = smurfHeaderLayoutV1[hfUnixTime].width;   // 64 bit timing word
 
-const int h_1hz_counter_offset = 64;  // resets with next MCE word
-const int h_1hz_counter_width = 4; // width
-const int h_ext_counter_offset = 68;  // resets with next MCE word
-const int h_ext_counter_width = 4; // width
-const int h_epics_ns_offset = 72;  // from timing system, epics time nanoseconds
+const int h_1hz_counter_offset = smurfHeaderLayoutV1[hfCounter0].offset;  // resets with next MCE word
+const int h_1hz_counter_width = smurfHeaderLayoutV1[hfCounter0].width; // width
+const int h_ext_counter_offset = smurfHeaderLayoutV1[hfCounter1].offset;  // resets with next MCE word
+const int h_ext_counter_width = smurfHeaderLayoutV1[hfCounter1].width; // width
+const int h_epics_ns_offset = smurfHeaderLayoutV1[hfCounter2].offset;  // from timing system, epics time nanoseconds (low half of counter 2)
 const int h_epics_ns_width = 4;
-const int h_epics_s_offset = 76;  // timing system epics time seconds
+const int h_epics_s_offset = smurfHeaderLayoutV1[hfCounter2].offset + 4;  // timing system epics time seconds (high half of counter 2)
 const int h_epics_s_width = 4;
-const int h_frame_counter_offset = 84;  // raw frame counter.
-const int h_frame_counter_width = 4;
-const int h_mce_syncword_offset = 96;  // 20 bit MCE sync workd
-const int h_mce_syncword_width = 5;  // yes 40 bits, bletch.
+const int h_frame_counter_offset = smurfHeaderLayoutV1[hfFrameCounter].offset;  // raw frame counter.
+const int h_frame_counter_width = smurfHeaderLayoutV1[hfFrameCounter].width;
+const int h_mce_syncword_offset = smurfHeaderLayoutV1[hfExternalTimeClock].offset;  // 20 bit MCE sync workd
+const int h_mce_syncword_width = smurfHeaderLayoutV1[hfExternalTimeClock].width;  // yes 40 bits, bletch.
 
-const int h_user0a_ctrl_offset = 104; // first byte first user word, control smurfd
-const int h_user0a_ctrl_width = 2;
+const int h_user0a_ctrl_offset = smurfHeaderLayoutV1[hfControlField].offset; // first byte first user word, control smurfd
+const int h_user0a_ctrl_width = smurfHeaderLayoutV1[hfControlField].width;
 // bit fields
 const int h_ctrl_bit_clear = 0;  // 1 to clear average and unwrap
 const int h_ctrl_bit_disable_stream = 1;  // 1 to disable streming to mce
@@ -52,26 +52,54 @@ const int h_ctrl_bit_disable_file  = 2;  // 1 to disable writing to files
 const int h_ctrl_bit_read_config = 3;  // set to read config file each cycle
 const int h_ctrl_nibble_test_modes = 4; // used to enable various test modes
 
-const int h_user0b_ctrl_offset = 105;
-const int h_user0b_ctrl_width = 1;
+const int h_user0b_ctrl_offset = smurfHeaderLayoutV1[hfTestParameters].offset;
+const int h_user0b_ctrl_width = smurfHeaderLayoutV1[hfTestParameters].width;
 
-const int h_num_rows_offset = 112;
-const int h_num_rows_width = 2;
-const int h_num_rows_reported_offset = 114;
-const int h_num_rows_reported_width = 2;
-const int h_row_len_offset = 120;
-const int h_row_len_width = 2;
-const int h_data_rate_offset = 122;
-const int h_data_rate_width = 2;
+const int h_num_rows_offset = smurfHeaderLayoutV1[hfNumberRows].offset;
+const int h_num_rows_width = smurfHeaderLayoutV1[hfNumberRows].width;
+const int h_num_rows_reported_offset = smurfHeaderLayoutV1[hfNumberRowsReported].offset;
+const int h_num_rows_reported_width = smurfHeaderLayoutV1[hfNumberRowsReported].width;
+const int h_row_len_offset = smurfHeaderLayoutV1[hfRowLength].offset;
+const int h_row_len_width = smurfHeaderLayoutV1[hfRowLength].width;
+const int h_data_rate_offset = smurfHeaderLayoutV1[hfDataRate].offset;
+const int h_data_rate_width = smurfHeaderLayoutV1[hfDataRate].width;
 
 
+// Header fields, decoded once per frame by SmurfHeader::copy_header(), at the offsets and widths
+// above. Ordered by size, so there is no padding.
+struct SmurfHeaderFields
+{
+  uint64_t unix_time;          // 64 bit unix time
+  uint64_t syncword;           // 40 bit MCE sync word
+  uint32_t num_channels;
+  uint32_t counter_1hz;        // counter since the last 1Hz marker
+  uint32_t ext_counter;        // counter since the last external input
+  uint32_t epics_nanoseconds;
+  uint32_t epics_seconds;
+  uint32_t frame_counter;
+  uint16_t num_rows;
+  uint16_t num_rows_reported;
+  uint16_t row_len;
+  uint16_t data_rate;
+  uint8_t  ctrl;               // control field (user word 0a)
+  uint8_t  version;
+  uint8_t  test_parameter;
+  uint8_t  test_mode;          // control field bits 4-7
+  bool     clear_bit;          // control field bits 0-3
+  bool     disable_stream;
+  bool     disable_file_write;
+  bool     read_config_file;
+};
+
 // SmurfHeader class
 // This class contains methods to access the different elements
-// in the SmurfHeader.
+// in the SmurfHeader. The fields are decoded once, when a new header is set with
+// copy_header(), and kept in sync by put_field(). The getters read the decoded fields.
 class SmurfHeader //generates and decodes SMURF data header
 {
 public:
   uint8_t *header; // full header bytes
+  SmurfHeaderFields f; // decoded fields of 'header'
   uint last_frame_count;
   bool first_cycle;
   bool data_ok; // set to indicate taht data has passed internal checks.
@@ -89,30 +117,31 @@ public:
   SmurfHeader(void); // creates header with num samples
   SmurfHeader(uint8_t *buffer); // creates header and set pointer
 
-  void copy_header(uint8_t *buffer);
-  uint get_version(void);
-  uint get_ext_counter(void);
-  uint get_1hz_counter(void);
-  uint get_frame_counter(void);
+  void copy_header(uint8_t *buffer); // sets the header pointer and decodes the fields
+  void decode(void); // decodes the fields of 'header' into 'f'
+  uint get_version(void) { return(f.version); };
+  uint get_ext_counter(void) { return(f.ext_counter); };
+  uint get_1hz_counter(void) { return(f.counter_1hz); };
+  uint get_frame_counter(void) { return(f.frame_counter); };
   uint get_average_bit(void) { return(0);}; // place holder
-  uint get_syncword(void); // returns 20 bit MCE sync word
-  uint get_epics_nanoseconds(void);
-  uint get_epics_seconds(void);
-  uint get_clear_bit(void);  // 1 means clear averaging and unwrap
-  uint disable_file_write(void); // 1 means don't write a local output file
-  uint disable_stream(void); // 1 means don't stream to MCE
-  uint read_config_file(void); // 1 means read config file
-  uint average_control(int num); // num=0 means use external average,
-  uint get_num_rows(void);  // num rows from header
-  uint get_num_rows_reported(void);
-  uint get_row_len(void);
-  uint get_data_rate(void);
-  uint get_test_parameter(void);
-  uint get_test_mode(void); //  0 = normal, 1 -> all zeros, 2 -> by channnel
+  uint get_syncword(void) { return(f.syncword & 0xFFFFFFFF); }; // returns 20 bit MCE sync word
+  uint get_epics_nanoseconds(void) { return(f.epics_nanoseconds); };
+  uint get_epics_seconds(void) { return(f.epics_seconds); };
+  uint get_clear_bit(void) { return(f.clear_bit); };  // 1 means clear averaging and unwrap
+  uint disable_file_write(void) { return(f.disable_file_write); }; // 1 means don't write a local output file
+  uint disable_stream(void) { return(f.disable_stream); }; // 1 means don't stream to MCE
+  uint read_config_file(void) { return(f.read_config_file); }; // 1 means read config file
+  uint average_control(int num, uint64_t frame_time); // num=0 means use external average, frame_time is the frame timestamp (unix ns)
+  uint get_num_rows(void) { return(f.num_rows ? f.num_rows : 33); };  // num rows from header, not sure what to do if 0
+  uint get_num_rows_reported(void) { return(f.num_rows_reported ? f.num_rows_reported : 33); };
+  uint get_row_len(void) { return(f.row_len ? f.row_len : 60); };
+  uint get_data_rate(void) { return(f.data_rate ? f.data_rate : 140); };
+  uint get_test_parameter(void) { return(f.test_parameter); };
+  uint get_test_mode(void) { return(f.test_mode); }; //  0 = normal, 1 -> all zeros, 2 -> by channnel
   void set_num_channels(uint32_t num_ch); // Set the number of channels in the header
-  uint32_t get_num_channels();            // Get the number of channels from the header
+  uint32_t get_num_channels() { return(f.num_channels); }; // Get the number of channels from the header
 
-  void put_field(int offset, int width, void *data);  // for adding to smurf header
+  void put_field(int offset, int width, void *data);  // for adding to smurf header, keeps the decoded fields in sync
 
   void clear_average(); // clears aveage counters
 };
@@ -123,6 +152,19 @@ class ISmurfPacket;
 typedef std::shared_ptr<ISmurfPacket_RO>  SmurfPacket_RO;
 typedef std::shared_ptr<ISmurfPacket>     SmurfPacket;
 
+// Read-only view of a packet's memory. The packet is a single cache line aligned block: the
+// header, then the payload, i.e. the same image as on the wire or in a file. The view is valid
+// as long as the packet is (for a buffer reader, until doneReading()).
+struct SmurfPacketView
+{
+  const uint8_t   *data;          // Whole packet
+  std::size_t      length;        // Whole packet length (number of bytes)
+  const uint8_t   *header;        // Header, at the start of data
+  std::size_t      headerLength;  // Header length (number of bytes)
+  const avgdata_t *payload;       // Payload, right after the header
+  std::size_t      payloadLength; // Payload length (number of avgdata_t)
+};
+
 // SmurfPakcet Class
 // This class handler SMuRF packets.
 // This class gives a read-only interface
@@ -144,6 +186,9 @@ public:
   // Get a copy of the data buffer as an array of avgdata_t
   void getDataArray(avgdata_t* d) const;
 
+  // Get a view of the packet memory, to send or copy the whole packet at once
+  const SmurfPacketView getView() const;
+
   // Header functions //
   const uint8_t  getVersion()                   const;  // Get protocol version
   const uint8_t  getCrateID()                   const;  // Get ATCA crate ID
@@ -179,8 +224,9 @@ public:
   // Get a raw byte from the header, at a specified index
   const uint8_t getHeaderByte(std::size_t index) const;
 
-  // Write the packet into a file
-  void writeToFile(uint fd) const;
+  // Write the packet into a file, with a single write() unless it is cut short.
+  // Returns false on error.
+  bool writeToFile(int fd) const;
 
   // Factory method, which return a smart pointer to a SmurfPacket object
   static SmurfPacket_RO create(const SmurfPacket& sp);
@@ -191,40 +237,24 @@ protected:
   // can be used to give read only access to the data.
   ISmurfPacket_RO();
   ISmurfPacket_RO(const ISmurfPacket_RO&);
+
+  // View of a packet image held elsewhere (a mapped data file for instance): the header,
+  // followed by 'payloadLength' avgdata_t words. Nothing is copied, so the memory must outlive
+  // the packet; the derived class keeps it alive.
+  ISmurfPacket_RO(const uint8_t *packet, std::size_t payloadLength);
+
   ISmurfPacket_RO& operator=(const ISmurfPacket_RO&);
   virtual ~ISmurfPacket_RO();
 
   std::size_t            headerLength;  // Header length (number of bytes)
   std::size_t            payloadLength; // Payload size (number of avgdata_t)
+  std::size_t            payloadMaxLength; // Allocated payload size (number of avgdata_t)
   std::size_t            packetLength;  // Total packet length (number of bytes)
-  std::vector<uint8_t>   headerBuffer;  // Header buffer
-  std::vector<avgdata_t> payloadBuffer; // Payload buffer
+  uint8_t               *headerBuffer;  // Header, at the start of the packet block (from the block pool)
+  avgdata_t             *payloadBuffer; // Payload, right after the header in the same block
   SmurfHeader            header;        // Packet header object
   TesBiasArray           tba;           // Tes Bias array object
-
-  // Header word offsets (in bytes)
-  static const std::size_t headerVersionOffset              = 0;
-  static const std::size_t headerCrateIDOffset              = 1;
-  static const std::size_t headerSlotNumberOffset           = 2;
-  static const std::size_t headerTimingConfigurationOffset  = 3;
-  static const std::size_t headerNumberChannelOffset        = 4;
-  static const std::size_t headerTESDACOffset               = 8;
-  static const std::size_t headerUnixTimeOffset             = 48;
-  static const std::size_t headerFluxRampIncrementOffset    = 56;
-  static const std::size_t headerFluxRampOffsetOffset       = 60;
-  static const std::size_t headerCounter0Offset             = 64;
-  static const std::size_t headerCounter1Offset             = 68;
-  static const std::size_t headerCounter2Offset             = 72;
-  static const std::size_t headerAveragingResetBitsOffset   = 80;
-  static const std::size_t headerFrameCounterOffset         = 84;
-  static const std::size_t headerTESRelaySettingOffset      = 88;
-  static const std::size_t headerExternalTimeClockOffset    = 96;
-  static const std::size_t headerControlFieldOffset         = 104;
-  static const std::size_t headerTestParametersOffset       = 105;
-  static const std::size_t headerNumberRowsOffset           = 112;
-  static const std::size_t headerNumberRowsReportedOffset   = 114;
-  static const std::size_t headerRowLengthOffset            = 120;
-  static const std::size_t headerDataRateOffset             = 122;
+  bool                   ownsBlock;     // The packet block comes from the pool
 
   // Header's control field bit offset
   static const std::size_t clearAvergaveBitOffset           = 0;
@@ -233,9 +263,9 @@ protected:
   static const std::size_t readConfigEachCycleBitOffset     = 3;
 
 private:
-  // Get a word from the header
-  template<typename T>
-  const T getHeaderWord(std::size_t offset) const;
+  // Get a field from the header
+  template<SmurfHeaderField F, typename T>
+  const T getHeaderWord() const;
 
   // Get the bit number 'index' of the word 'byte'
   const bool getWordBit(uint8_t byte, std::size_t index) const;
@@ -265,6 +295,13 @@ public:
   // Copy an array of avgdata_t's into the payload
   void copyData(avgdata_t* d);
 
+  // Set the number of avgdata_t words in the payload. The payload buffer is allocated
+  // for smurf_max_channels words, so this doesn't allocate memory.
+  void setPayloadLength(std::size_t length);
+
+  // Get a pointer to the payload buffer, to fill it in place (smurf_max_channels words)
+  avgdata_t* getDataPtr();
+
   // Header functions //
   void setVersion(uint8_t value);                     // Get protocol version
   void setCrateID(uint8_t value);                     // Get ATCA crate ID
@@ -306,9 +343,9 @@ public:
   static SmurfPacket create(uint8_t* h, avgdata_t* d);
 
 private:
-  // Get a word from the header
-  template<typename T>
-  void setHeaderWord(std::size_t offset, const T& value);
+  // Set a field in the header
+  template<SmurfHeaderField F, typename T>
+  void setHeaderWord(const T& value);
 
   // Set bit number 'index' to 'value' in the word 'byte'
   uint8_t setWordBit(uint8_t byte, std::size_t index, bool value);
@@ -11,6 +11,7 @@
 #include <rogue/interfaces/stream/FrameIterator.h>
 #include <rogue/interfaces/stream/Buffer.h>
 #include <rogue/GilRelease.h>
+#include <rogue/ScopedGil.h>
 #include <thread>
 #include <atomic>
 #include <smurf2mce.h>
@@ -19,6 +20,11 @@
 #include "data_buffer.h"
 #include "smurf_packet.h"
 #include "tes_bias_array.h"
+#include "unwrap.h"
+#include "channel_workers.h"
+#include "packet_subscribers.h"
+#include "frame_clock.h"
+#include "downsampler.h"
 
 namespace bp = boost::python;
 namespace ris = rogue::interfaces::stream;
@@ -38,15 +44,66 @@ public:
   std::size_t getFrameOutOrderCnt() { return frameOutOrderCnt; } // Get the lost frame counter
   void        clearFrameCnt();                                   // Clear the lost frame
   void        setTesBias(std::size_t index, int32_t value);      // Receive the TesBias from pyrogue
+  void        setTesBiasArray(bp::object values);                // Receive all the TesBias values at once
+  void        setNumChannels(uint n);                            // Set the number of processed channels (0 = mask length)
+  uint        getNumChannels()         { return num_channels;    } // Get the number of processed channels
+  void        setZeroCopy(bool enable) { zeroCopy = enable;      } // Enable reading frames in place
+  bool        getZeroCopy()            { return zeroCopy;        } // Get the zero copy ingestion mode
+  std::size_t getZeroCopyCnt()         { return zeroCopyCnt;     } // Get the number of frames read in place
+  void        setFilter(int order, bp::object a, bp::object b, double gain); // Set the direct form filter (order -1 = flat average)
+  void        setFilterSOS(bp::object sos);                      // Set the biquad sections, scipy sos layout (empty = direct form)
+  void        setFilterWarmStart(bool enable);                   // Start new filters from the steady state
+  void        setFilterDecimate(bool enable);                    // Compute FIR outputs only on frames sent out
+  void        setWorkers(uint n, int first_cpu);                 // Set the number of channel partitions and the first CPU to pin to (-1 = none)
+  uint        getWorkers()             { return workers.getPartitions(); } // Get the number of channel partitions
+  uint64_t    getFilterVersion()   { return filterParams.getAckVersion(); } // Version of the filter settings in use
+  void        setBufferSize(std::size_t n);                      // Set the packet buffer depth
+  std::size_t getBufferSize()                      { return txBuffer.getSize();         } // Get the packet buffer depth
+  void        setBufferPolicy(int id, int policy, std::size_t timeout_ms); // Set a subscriber policy (0 = drop oldest, 1 = blocking, 2 = drop newest)
+  int         getBufferPolicy(int id)      { return txBuffer.getPolicy(subscribers.reader(id));     } // Get a subscriber policy
+  std::size_t getBufferLag(int id)         { return txBuffer.getLag(subscribers.reader(id));        } // Packets not read yet by a subscriber
+  std::size_t getBufferHighWater(int id)   { return txBuffer.getHighWater(subscribers.reader(id));  } // Largest lag of a subscriber
+  std::size_t getBufferOWCnt(int id)       { return txBuffer.getOWCnt(subscribers.reader(id));      } // Packets a subscriber lost
+  std::size_t getBufferTimeoutCnt(int id)  { return txBuffer.getTimeoutCnt(subscribers.reader(id)); } // Blocking waits that timed out
+  std::size_t getBufferDropCnt()                     { return txBuffer.getDropCnt();         } // New packets dropped for all readers
+  void        clearBufferCnt()                       { txBuffer.clearCnts();                 } // Clear the packet buffer counters
+  int         attachSubscriber(PacketSubscriberPtr sub, const std::string &name, bool threaded, int policy, std::size_t timeout_ms); // Attach a packet consumer, returns its id
+  void        detachSubscriber(int id);                          // Detach a packet consumer
+  int         addSubscriber(bp::object callback, const std::string &name, bool threaded, int policy, std::size_t timeout_ms); // Attach a python callback(header, data)
+  bp::list    getSubscriberIds();                                // Ids of the attached packet consumers
+  std::string getSubscriberName(int id)    { return subscribers.getName(id);               } // Name of a packet consumer
+  int         getTransmitSubscriber()      { return txSubscriber;                          } // Id of the 'transmit' consumer
+  int         getFileSubscriber()          { return fileSubscriber;                        } // Id of the file writer
+  std::size_t getFileBytes()               { return D->writer.getBytes();                  } // Bytes written to the data files
+  std::size_t getFileWriteCnt()            { return D->writer.getWriteCnt();               } // Write requests to the data files
+  std::size_t getFileShortWriteCnt()       { return D->writer.getShortWriteCnt();          } // Short writes, completed afterwards
+  std::size_t getFileErrorCnt()            { return D->writer.getErrorCnt();               } // Failed writes
+  double      getFileCodecRatio();                               // Compression ratio of the data file payload (file_codec), 0 before any
+  double      getFileCodecRate();                                // Encoding speed of the data file payload, MB/s of samples
+  int         addStream(const std::string &name, int trigger, uint32_t period, std::size_t depth); // Add an extra output stream, returns its id
+  void        removeStream(int id);                              // Remove an extra output stream
+  bp::list    getStreamIds();                                    // Ids of the extra output streams
+  std::string getStreamName(int id)        { return downsampler.get(id)->getName();                  } // Name of a stream
+  std::size_t getStreamEmitCnt(int id)     { return downsampler.get(id)->getEmitCnt();               } // Packets written to a stream
+  std::size_t getStreamDropCnt(int id)     { return downsampler.get(id)->getBuffer().getDropCnt();   } // Packets a stream dropped, its buffer was full
+  int         attachStreamSubscriber(int stream, PacketSubscriberPtr sub, const std::string &name, bool threaded, int policy, std::size_t timeout_ms); // Attach a packet consumer to a stream
+  int         addStreamSubscriber(int stream, bp::object callback, const std::string &name, bool threaded, int policy, std::size_t timeout_ms); // Attach a python callback(header, data) to a stream
+  void        removeStreamSubscriber(int stream, int id);        // Detach a packet consumer from a stream
 
   bool initialized;
   uint internal_counter, fast_internal_counter;  // first is mce frames, second is smurf frames
   uint8_t *buffer; // holds raw input from PyRogute
-  uint8_t *buffer_last; // holds last data
-  uint8_t *b[2]; // dual buffers to allow last pulse subtraction
-  int bufn;  // which buffer we are on.
+  smurf_t *last_samples; // previous raw sample of each channel, used to detect wraps
   wrap_t *wrap_counter; // byte to track phase wraps.
   uint *mask; // masks which resonators we will use.
+  uint mask_channels; // number of entries read from the mask file
+  bool mask_changed; // the mask contents changed, applied between frames by update_num_channels
+  uint num_channels; // number of processed channels, from the mask length or setNumChannels
+  std::atomic<uint> requested_channels; // set from python, 0 means follow the mask length
+  unwrap_kernel_t unwrap; // phase unwrap kernel, the fastest one for this CPU
+  std::atomic<uint> requested_workers; // number of channel partitions, set from python
+  std::atomic<int> requested_cpu; // first CPU for the worker threads, -1 to not pin them
+  smurf_t *frame_data; // raw samples of the frame being processed, read by the workers
   avgdata_t *average_samples; // holds the averaged sample data (allocated in filter module)
   // avgdata_t *average_mce_samples; // samples modified for MCE format
   avgdata_t *input_data; // with unwrap, before aveaging
@@ -72,10 +129,15 @@ public:
   SmurfProcessor();
   void acceptFrame(ris::FramePtr frame);
   void frameToBuffer(ris::FramePtr frame, uint8_t * const buffer);
+  smurf_t* ingestFrame(ris::FramePtr frame, uint8_t * const buffer); // header into buffer, returns pointer to raw samples
 
   //void acceptframe_test(char* data, size_t size); // test version for local use, just a wrapper
   void read_mask(char *filename);// reads file to create maks
-  void clear_wrap(void){memset(wrap_counter, wrap_start, smurfsamples);}; // clears wrap counter
+  void update_num_channels(void); // applies a new channel count, at a frame boundary
+  void publish_config_filter(void); // publishes the config file filter settings, if they changed
+  void update_workers(void); // applies a new number of channel partitions, at a frame boundary
+  static void process_block(void *ctx, uint first, uint count); // unwrap and filter a block of channels
+  void clear_wrap(void){memset(wrap_counter, wrap_start, num_channels * sizeof(wrap_t));}; // clears wrap counter
   virtual ~SmurfProcessor(); // destructor
 
       // Expose methods to python
@@ -92,22 +154,58 @@ public:
       .def("clearFrameCnt",          &SmurfProcessor::clearFrameCnt)
       .def("printTransmitStatistic", &SmurfProcessor::printTransmitStatistic)
       .def("setTesBias",             &SmurfProcessor::setTesBias)
+      .def("setTesBiasArray",        &SmurfProcessor::setTesBiasArray)
+      .def("setNumChannels",         &SmurfProcessor::setNumChannels)
+      .def("getNumChannels",         &SmurfProcessor::getNumChannels)
+      .def("setZeroCopy",            &SmurfProcessor::setZeroCopy)
+      .def("getZeroCopy",            &SmurfProcessor::getZeroCopy)
+      .def("getZeroCopyCnt",         &SmurfProcessor::getZeroCopyCnt)
+      .def("setFilter",              &SmurfProcessor::setFilter)
+      .def("setFilterSOS",           &SmurfProcessor::setFilterSOS)
+      .def("setFilterWarmStart",     &SmurfProcessor::setFilterWarmStart)
+      .def("setFilterDecimate",      &SmurfProcessor::setFilterDecimate)
+      .def("getFilterVersion",       &SmurfProcessor::getFilterVersion)
+      .def("setWorkers",             &SmurfProcessor::setWorkers)
+      .def("getWorkers",             &SmurfProcessor::getWorkers)
+      .def("setBufferSize",          &SmurfProcessor::setBufferSize)
+      .def("getBufferSize",          &SmurfProcessor::getBufferSize)
+      .def("setBufferPolicy",        &SmurfProcessor::setBufferPolicy)
+      .def("getBufferPolicy",        &SmurfProcessor::getBufferPolicy)
+      .def("getBufferLag",           &SmurfProcessor::getBufferLag)
+      .def("getBufferHighWater",     &SmurfProcessor::getBufferHighWater)
+      .def("getBufferOWCnt",         &SmurfProcessor::getBufferOWCnt)
+      .def("getBufferTimeoutCnt",    &SmurfProcessor::getBufferTimeoutCnt)
+      .def("getBufferDropCnt",       &SmurfProcessor::getBufferDropCnt)
+      .def("clearBufferCnt",         &SmurfProcessor::clearBufferCnt)
+      .def("addSubscriber",          &SmurfProcessor::addSubscriber)
+      .def("removeSubscriber",       &SmurfProcessor::detachSubscriber)
+      .def("getSubscriberIds",       &SmurfProcessor::getSubscriberIds)
+      .def("getSubscriberName",      &SmurfProcessor::getSubscriberName)
+      .def("getTransmitSubscriber",  &SmurfProcessor::getTransmitSubscriber)
+      .def("getFileSubscriber",      &SmurfProcessor::getFileSubscriber)
+      .def("getFileBytes",           &SmurfProcessor::getFileBytes)
+      .def("getFileWriteCnt",        &SmurfProcessor::getFileWriteCnt)
+      .def("getFileShortWriteCnt",   &SmurfProcessor::getFileShortWriteCnt)
+      .def("getFileErrorCnt",        &SmurfProcessor::getFileErrorCnt)
+      .def("getFileCodecRatio",      &SmurfProcessor::getFileCodecRatio)
+      .def("getFileCodecRate",       &SmurfProcessor::getFileCodecRate)
+      .def("addStream",              &SmurfProcessor::addStream)
+      .def("removeStream",           &SmurfProcessor::removeStream)
+      .def("getStreamIds",           &SmurfProcessor::getStreamIds)
+      .def("getStreamName",          &SmurfProcessor::getStreamName)
+      .def("getStreamEmitCnt",       &SmurfProcessor::getStreamEmitCnt)
+      .def("getStreamDropCnt",       &SmurfProcessor::getStreamDropCnt)
+      .def("addStreamSubscriber",    &SmurfProcessor::addStreamSubscriber)
+      .def("removeStreamSubscriber", &SmurfProcessor::removeStreamSubscriber)
     ;
 
     bp::implicitly_convertible<boost::shared_ptr<SmurfProcessor>, ris::SlavePtr>();
   };
 
 
-  // Transmit method. Will run in the pktTransmitterThread thread.
-  // Here is where the method 'transmit' is called.
-  void pktTansmitter();
-
-  // File writer method. Will run in the pktWriterThread thread.
-  // Here is where new SMuRF packet will be written to files.
-  void pktWriter();
-
   // This method is intended to be used to take SMuRF packet and send them to other
-  // system.
+  // system. It runs in the thread of the 'transmit' subscriber, which can be detached
+  // (removeSubscriber(getTransmitSubscriber())) if it is not used.
   // This method is called whenever a new SMuRF packet is ready, and a SmurfPacket_RO object
   // (which is a smart pointer to a read-only interface to a Smurf packer object) is passed.
   // It must be overwritten by the user application
@@ -127,18 +225,64 @@ private:
   void runThread();
 
   DataBuffer          txBuffer;             // Buffer for SMuRF packet passed to the transmit thread.
-  boost::atomic<bool> runTxThread;          // Flag to indicate the TX thread to stop its loops
-  const size_t        pktReaderIndexTx;     // Data buffer reader index for the transmitter
-  const size_t        pktReaderIndexFile;   // Data buffer reader index for the file writer
-  std::thread         pktTransmitterThread; // Thread where the SMuRF packet transmission will run
-  std::thread         pktWriterThread;      // Thread where the SMuRF packet file writer will run
+  PacketSubscribers   subscribers;          // Consumers of the SMuRF packets in txBuffer
+  int                 txSubscriber;         // Subscriber id of the 'transmit' method
+  int                 fileSubscriber;       // Subscriber id of the file writer
+  Downsampler         downsampler;          // Extra output streams, at other rates
   std::size_t         frameRxCnt;           // Received frame counter
   std::size_t         frameLossCnt;         // Lost frame counter
   std::size_t         frameOutOrderCnt;     // Counts the number of times we received an out-of-order frame
+  bool                zeroCopy;             // Read the raw samples directly from the rogue frame buffer
+  std::size_t         zeroCopyCnt;          // Number of frames whose samples were read in place
+
+  // Worker threads for the unwrap and filter steps
+  ChannelWorkers        workers;
+
+  // Frame timestamps
+  FrameClock            frameClock;
+
+  // Filter settings
+  FilterParamsPublisher filterParams;       // Settings published to the processing thread
+  FilterParams          cfgFilter;          // Last settings published from the config file
+
+  // TesBias values, copied into the header at every frame
+  TesBiasPublisher      tesBias;
+};
+
+// Calls SmurfProcessor::transmit for each packet
+class TransmitSubscriber : public PacketSubscriber
+{
+public:
+  TransmitSubscriber(SmurfProcessor *p) : proc(p) {};
+  void process(SmurfPacket_RO packet) { proc->transmit(packet); };
 
-  // TesBias values
-  std::array<uint8_t, TesBiasBufferSize> tesBias;   // Array to hold the TesBias values
-  TesBiasArray                           tba;       // Object to access the Tesbias array
+private:
+  SmurfProcessor *proc;
+};
+
+// Writes each packet to the data file
+class FileWriterSubscriber : public PacketSubscriber
+{
+public:
+  FileWriterSubscriber(SmurfDataFile *d, SmurfConfig *c) : D(d), C(c) {};
+  void process(SmurfPacket_RO packet) { D->write_file(packet, C); };
+
+private:
+  SmurfDataFile *D;
+  SmurfConfig   *C;
+};
+
+// Calls a python callable with the packet header and data, as bytes (the data are
+// avgdata_t values, one per channel)
+class PythonSubscriber : public PacketSubscriber
+{
+public:
+  PythonSubscriber(bp::object cb) : callback(cb) {};
+  ~PythonSubscriber();
+  void process(SmurfPacket_RO packet);
+
+private:
+  bp::object callback;
 };
 
 #endif
\ No newline at end of file
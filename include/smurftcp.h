@@ -5,6 +5,12 @@
 #define __SMURFTCP_H__
 
 #include "smurf_packet.h"
+#include "filter_kernels.h"
+#include "filter_params.h"
+#include "file_writer.h"
+#include "file_rotator.h"
+#include "columnar_writer.h"
+#include "channel_workers.h"
 
 void error(const char *msg); // error handler
 
@@ -55,13 +61,25 @@ class SmurfConfig  // controls smurf config, initially just reads config file, f
   char data_file_name[1024]; // name of data file including directory, but without unix time extension
   int file_name_extend; // 1 (default) is append time, 0 is no append, more in future
   int data_frames; // number of smples per output file.
+  int file_max_mb; // also start a new file when the current one reaches this size (MiB), 0 (default) is no limit
+  int file_format; // 0 (default) writes the packets as they are, 1 in the columnar format (columnar_format.h)
+  int file_chunk_frames; // number of frames per chunk of the columnar format
+  int file_codec; // columnar format payload codec: 0 (default) none, 1 delta + bit packing (sample_codec.h)
+  int file_rotate_seconds; // also start a new file every N seconds of timing system time, on multiples of N, 0 (default) is off
   int filter_order; // for low pass filter
   filter_t filter_g;
   filter_t filter_a[16]; //for filter
   filter_t filter_b[16];
+  int file_async; // 1 (default) writes the data file with io_uring when available, 0 with pwrite
+  int file_direct; // 1 writes the data file with O_DIRECT, bypassing the page cache, 0 (default) doesn't
+  int filter_warm_start; // 1 starts new filter settings from the steady state, 0 (default) from zeros
+  int filter_decimate; // 1 computes FIR outputs only on frames that are sent out, 0 (default) on every frame
+  int filter_sos_n; // number of second order sections, 0 uses the direct form filter above
+  filter_t filter_sos[filter_max_sections][5]; // b0, b1, b2, a1, a2 per section, normalized to a0 = 1
 
   SmurfConfig(void);
   bool read_config_file(void);
+  void get_filter_params(FilterParams *p); // copies the filter settings
 };
 
 class SmurfTestData // generates test data, 4096 samples
@@ -100,15 +118,25 @@ class SmurfDataFile // writes data file to disk
 {
   bool open_;
   int  part_;
+  FileRotator rotator; // opens the next file in the background
+  uint64_t file_slot; // timing system seconds / file_rotate_seconds, of the current file
+  uint64_t last_length; // length of the last file, to reserve space for the next one
+
+  bool open_file(SmurfConfig *config, std::size_t packet_length); // opens part part_, and prepares the next one
+  void next_file(void); // moves on to the next part, the file is opened with the next packet
+  void close_file(void); // closes the file, and waits until it is written
+  void make_filename(char *name, SmurfConfig *config, int part); // data file name of a part
  public:
   char *filename; // name with timestampe
   uint frame_counter; // counts  number of frames written
   uint header_length; // size of header
   uint sample_points; // sample points in frame
   uint8_t  *frame; // will hold frame data before writing
-  uint fd; // file pointer
+  FileWriter writer; // writes the packets in large batches
+  ColumnarWriter columnar; // formats the packets in columns, before the writer, if asked (after it, so it is destroyed first)
 
   SmurfDataFile(void);
+  ~SmurfDataFile(void); // writes out and closes the current file, with the columnar index and trailer
   uint write_file(SmurfPacket_RO packet, SmurfConfig *config);
   // writes to file, creates new if needded. return frames written, 0 new.
 };
@@ -152,7 +180,7 @@ class SmurfValidCheck
   uint64_t initial_timing_system;
 
   SmurfValidCheck(void);  // just initializes
-  void run(SmurfHeader *H); // gets all timer differences
+  void run(SmurfHeader *H, uint64_t frame_time); // gets all timer differences, frame_time is the frame timestamp (unix ns)
   void reset(void);
 };
 
@@ -160,23 +188,57 @@ class SmurfValidCheck
 // y(n) = (1/a(1))* b(1)*x(n) + b(2)*x(n-1) + b(nb+1)*x(n-nb) - a(2)*y(n-1) - a(nd+1)*y(n-nb)\
 // from matlab docs implmentatin of general analog filter
 // Special: if order = -1, use integrating filter, clear returns last integral /  samples
+// The integral is an exact int64 sum, divided only on frames that are sent out (emit = true).
+// The direct form step runs in one of the kernels from filter_kernels.h, picked for this CPU.
+// See there for how closely the vector kernels match the scalar one.
+// With sos_n > 0, the filter runs as a cascade of biquads instead, in single precision.
+// Decimation: when decimate is set, the filter is FIR (a[1..order] all 0) and the output of this
+// frame is not used (emit = false), only x(n) is stored. y(n) is computed on the emitted frames.
+// Settings come from a FilterParams object. When its version changes, the new settings are
+// copied at the start of the frame. If only the gain or the flags changed, the state is kept.
+// Otherwise the state is cleared, or with warm_start set to the steady state for the current input.
+// filter() runs a whole frame. To split the channels between threads, call begin_frame() once,
+// then filter_block() on disjoint channel blocks, from any threads.
+// begin_frame() can be given the buffer to write this frame's output to, usually the payload of
+// the packet that is sent out. Otherwise the output goes to an internal scratch array.
 class SmurfFilter
 {
  public:
   uint samples;  // 528 for smurf
+  uint max_samples; // allocated channels, samples can be changed up to this value
   uint records; // number of past buffers,enough for 8th order filter
+  uint stride; // channels per ring buffer record and biquad state row, see row_stride()
   filter_t *xd;  // memory block with input ring buffer (xd + records * sample) + sample
   filter_t *yd;    // array of ring buffer pointers output data from filter
+  filter_t **xr;   // records of x(n-r), r = 0..order, recomputed every frame
+  filter_t **yr;   // records of y(n-r), r = 0..order, recomputed every frame
+  iir_kernel_t iir; // direct form kernel, the fastest one for this CPU
+  sos_t *sos_state; // biquad state, [section][s1/s2][channel]
+  sos_t sos_coef[filter_max_sections * 5]; // coefficients of the running cascade, as floats
+  sos_kernel_t sos; // biquad cascade kernel, the fastest one for this CPU
+  int64_t *sum; // running sum of the flat average
+  avg_kernel_t avg; // flat average kernel, the fastest one for this CPU
+  FilterParams running; // copy of the settings in use
   int bn;  // number of most recent ring buffer pointers
   uint samples_since_clear; // internal use
-  avgdata_t *output; // output data
+  avgdata_t *output; // output data of the current frame
+  avgdata_t *scratch; // output data, when there is no buffer to write it to
   bool clear;  // true if data is already cleared
-  int order_n;
+  bool fir; // the direct form has no feedback terms
+  bool emit_n; // the output of the current frame is sent out
+  bool warm_n; // the blocks warm start before filtering, in the current frame
 
   SmurfFilter(uint num_samples, uint num_records); // allocates arrays
   void clear_filter(void);  // returns last sample, clears all arrays, resets ring buffer pointers,
+  void set_samples(uint num_samples); // change the number of channels, clears the filter
   void end_run(void);
-  avgdata_t *filter(avgdata_t *data, int order, filter_t *a, filter_t *b, filter_t g); // input channnle array, outputs filtered channel array
+  avgdata_t *filter(avgdata_t *data, const FilterParams *p, bool emit = true); // input channnle array, outputs filtered channel array
+  void begin_frame(const FilterParams *p, bool emit, avgdata_t *out = NULL); // settings, ring buffer pointers and output buffer for a new frame
+  void filter_block(const avgdata_t *data, uint first, uint count); // filters channels [first, first + count)
+
+ private:
+  void swap(const FilterParams *p); // switch to new settings, at a frame boundary
+  void warm_start(const avgdata_t *data, uint first, uint count); // fills the state as if the input had always been 'data'
 };
 
 
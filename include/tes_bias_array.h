@@ -2,7 +2,9 @@
 #define __TES_BIAS_ARRAY_H__
 
 #include <stdexcept>
+#include <atomic>
 #include <mutex>
+#include <stdint.h>
 
 static const std::size_t TesBiasCount = 16;  // 16 Tes Bias values
 static const std::size_t TesBiasBufferSize = TesBiasCount * 20 / 8; // 16x 20-bit bytes
@@ -14,9 +16,6 @@ private:
   // Pointer to the data buffer
   uint8_t *pData;
 
-  // Mutex, to safetly access the data from different threads
-  std::mutex mut;
-
   // Helper class to handler indexes of TES bias words
   // TES bias are 20-bit words = 2.5 bytes
   // 16x TES bias occupy 40 bytes, which are divided into 8 blocks of 2 words (5 bytes) each
@@ -65,9 +64,40 @@ public:
 
   // Read a TES bias value
   const int32_t getWord(const WordIndex& index) const;
+};
+
+// TES bias values, written by python and read by the processing thread at every frame.
+// The 40 bytes are published with a sequence lock: the writer makes the sequence number odd,
+// writes the 5 data words and makes it even again. The reader copies the words, and copies them
+// again if the sequence number was odd or changed meanwhile. So the reader never waits for a
+// writer (it only retries during the few ns of a write), and never sees a half written array.
+// The writers are serialized by a mutex.
+class TesBiasPublisher
+{
+public:
+  TesBiasPublisher();
+
+  // Reader side. Copy the TesBiasBufferSize bytes of the latest values to 'dst'.
+  void read(uint8_t *dst) const;
+
+  // Writer side. Set one value, or all the TesBiasCount values, in one publication.
+  void setWord(std::size_t index, int32_t value);
+  void setWords(const int32_t *values);
+
+  // Writer side. Read one value.
+  int32_t getWord(std::size_t index);
+
+private:
+  static const std::size_t NumWords = TesBiasBufferSize / sizeof(uint64_t);
+
+  // Write the staging copy to the published words. Called with the mutex held.
+  void publish();
 
-  // Method to the mutex
-  std::mutex* getMutex();
+  std::atomic<uint32_t> seq;                // Odd while the words are written
+  std::atomic<uint64_t> words[NumWords];    // Published values
+  uint8_t               staging[TesBiasBufferSize + 1]; // Writer copy (one more byte, TesBiasArray reads 4 bytes)
+  TesBiasArray          tba;                // Encodes the values in 'staging'
+  std::mutex            mut;                // Serializes the writers
 };
 
 #endif
\ No newline at end of file
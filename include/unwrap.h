@@ -0,0 +1,32 @@
+#ifndef _UNWRAP_H_
+#define _UNWRAP_H_
+
+#include "smurf2mce.h"
+
+// Phase unwrap kernels.
+// For each channel j = 0..n-1, the raw sample raw[mask[j]] is compared against the previous
+// sample of that channel (last[j]). When the sample jumps from below lower_unwrap to above
+// upper_unwrap the wrap counter is decremented by 0x10000, and incremented on the opposite jump.
+// The unwrapped value (sample + wrap counter) is written to out[j], and last[j] is updated.
+//
+// Requirements on the arguments:
+// - All mask entries must be smaller than smurf_raw_samples. The mask is validated when it is
+//   loaded, so the kernels don't check it.
+// - At least 2 bytes of readable memory must precede 'raw' (the SMuRF header always does). The
+//   vector kernels gather 32-bit words ending at each sample, so they never read past the last one.
+//
+// All kernels produce bit-exact results. The fastest one supported by the CPU is selected at
+// run time by select_unwrap_kernel(); unwrap_scalar is the fallback.
+typedef void (*unwrap_kernel_t)(const smurf_t *raw, const uint *mask, uint n, smurf_t *last, wrap_t *wrap, avgdata_t *out);
+
+void unwrap_scalar(const smurf_t *raw, const uint *mask, uint n, smurf_t *last, wrap_t *wrap, avgdata_t *out);
+void unwrap_avx2(const smurf_t *raw, const uint *mask, uint n, smurf_t *last, wrap_t *wrap, avgdata_t *out);
+void unwrap_avx512(const smurf_t *raw, const uint *mask, uint n, smurf_t *last, wrap_t *wrap, avgdata_t *out);
+
+// Returns the fastest kernel supported by this CPU
+unwrap_kernel_t select_unwrap_kernel(void);
+
+// Returns the name of a kernel, for diagnostic printouts
+const char *unwrap_kernel_name(unwrap_kernel_t kernel);
+
+#endif
@@ -0,0 +1,155 @@
+#include "channel_workers.h"
+#include <pthread.h>
+#include <sched.h>
+#include <chrono>
+
+// Spin wait limits of the workers: pause, then yield, then sleep
+static const unsigned SpinPause = 1024;
+static const unsigned SpinYield = 1024 * 64;
+
+ChannelWorkers::ChannelWorkers()
+:
+  partitions ( 1       ),
+  firstCpu   ( -1      ),
+  threads    (         ),
+  job        ( NULL    ),
+  ctx        ( NULL    ),
+  channels   ( 0       ),
+  blockSize  ( 0       ),
+  stopping   ( false   )
+{
+  generation.value = 0;
+  done.value       = 0;
+}
+
+ChannelWorkers::~ChannelWorkers()
+{
+  stop();
+}
+
+void ChannelWorkers::start(unsigned p, int cpu)
+{
+  if (!p)
+    throw std::runtime_error("Trying to start a channel worker pool with 0 partitions.");
+
+  stop();
+
+  partitions = p;
+  firstCpu   = cpu;
+
+  for (unsigned i = 1; i < partitions; ++i)
+  {
+    threads.push_back(std::thread(&ChannelWorkers::worker, this, i, generation.value.load()));
+
+    if (firstCpu >= 0)
+    {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(firstCpu + i - 1, &set);
+
+      if (pthread_setaffinity_np(threads.back().native_handle(), sizeof(set), &set))
+        printf("Could not pin channel worker %u to CPU %d\n", i, firstCpu + i - 1);
+    }
+  }
+}
+
+void ChannelWorkers::stop()
+{
+  if (threads.empty())
+  {
+    partitions = 1;
+    return;
+  }
+
+  stopping = true;
+  generation.value.fetch_add(1, std::memory_order_release);
+
+  for (std::size_t i = 0; i < threads.size(); ++i)
+    threads[i].join();
+
+  threads.clear();
+  stopping   = false;
+  partitions = 1;
+}
+
+void ChannelWorkers::block(unsigned index, unsigned &first, unsigned &count) const
+{
+  first = index * blockSize;
+
+  if (first >= channels)
+    count = 0;
+  else
+    count = (channels - first < blockSize) ? channels - first : blockSize;
+}
+
+void ChannelWorkers::run(unsigned n, Job j, void *c)
+{
+  if (partitions == 1)
+  {
+    j(c, 0, n);
+    return;
+  }
+
+  // Round the blocks up to ChannelBlockAlign channels. The last blocks can be short, or empty.
+  unsigned per = (n + partitions - 1) / partitions;
+
+  job       = j;
+  ctx       = c;
+  channels  = n;
+  blockSize = (per + ChannelBlockAlign - 1) / ChannelBlockAlign * ChannelBlockAlign;
+  done.value.store(0, std::memory_order_relaxed);
+
+  // Publishes the job to the workers
+  generation.value.fetch_add(1, std::memory_order_release);
+
+  unsigned first, count;
+  block(0, first, count);
+
+  if (count)
+    job(ctx, first, count);
+
+  // Per-frame barrier. Yields after a while, in case the workers share our CPU.
+  unsigned spins = 0;
+
+  while (done.value.load(std::memory_order_acquire) != partitions - 1)
+  {
+    if (++spins < SpinPause)
+      cpu_relax();
+    else
+      std::this_thread::yield();
+  }
+}
+
+void ChannelWorkers::worker(unsigned index, uint64_t seen)
+{
+  while (true)
+  {
+    unsigned spins = 0;
+    uint64_t g;
+
+    while ((g = generation.value.load(std::memory_order_acquire)) == seen)
+    {
+      if (spins < SpinPause)
+        cpu_relax();
+      else if (spins < SpinYield)
+        std::this_thread::yield();
+      else
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+
+      ++spins;
+    }
+
+    seen = g;
+
+    if (stopping)
+      return;
+
+    unsigned first, count;
+    block(index, first, count);
+
+    if (count)
+      job(ctx, first, count);
+
+    done.value.fetch_add(1, std::memory_order_release);
+  }
+}
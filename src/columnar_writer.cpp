@@ -0,0 +1,225 @@
+#include "columnar_writer.h"
+#include "smurf_header_layout.h"
+#include "sample_codec.h"
+#include <chrono>
+
+static std::size_t align_up(std::size_t n)
+{
+  return (n + ColumnarAlign - 1) / ColumnarAlign * ColumnarAlign;
+}
+
+ColumnarWriter::ColumnarWriter(FileWriter &w)
+:
+  writer      ( w     ),
+  active      ( false ),
+  chunkFrames ( 0     ),
+  codec       ( 0     ),
+  count       ( 0     ),
+  channels    ( 0     ),
+  headers     (       ),
+  rows        (       ),
+  out         (       ),
+  cols        (       ),
+  index       (       ),
+  codecIn     ( 0     ),
+  codecOut    ( 0     ),
+  codecNs     ( 0     )
+{
+}
+
+ColumnarWriter::~ColumnarWriter()
+{
+  end();
+}
+
+void ColumnarWriter::begin(std::size_t n, uint32_t c)
+{
+  if ((n < 1) || (n > ColumnarMaxChunk))
+    throw std::runtime_error("Trying to write a columnar file with a chunk size out of range.");
+
+  if ((c != ColumnarCodecNone) && (c != ColumnarCodecDelta))
+    throw std::runtime_error("Trying to write a columnar file with an unknown codec.");
+
+  chunkFrames = n;
+  codec       = c;
+  count       = 0;
+  channels    = 0;
+  active      = true;
+  index.clear();
+  headers.resize(chunkFrames * smurfheaderlength);
+
+  // The payload buffers are sized by the first packet of each chunk, from its number of channels.
+  // Released here, so a file with fewer channels than the last one doesn't keep their memory.
+  rows.clear();
+  rows.shrink_to_fit();
+  cols.clear();
+  cols.shrink_to_fit();
+
+  // File header and the layout of the header columns, from the latest header version
+  out.assign(align_up(sizeof(ColumnarFileHeader) + hfCount * sizeof(ColumnarFieldDesc)), 0);
+
+  ColumnarFileHeader *h = reinterpret_cast<ColumnarFileHeader*>(out.data());
+  ColumnarFieldDesc  *f = reinterpret_cast<ColumnarFieldDesc*>(h + 1);
+
+  memcpy(h->magic, "SMURFCOL", 8);
+  h->version      = ColumnarVersion;
+  h->headerLength = smurfheaderlength;
+  h->chunkFrames  = chunkFrames;
+  h->numFields    = hfCount;
+  h->codec        = codec;
+
+  for (std::size_t i = 0; i < hfCount; ++i)
+  {
+    f[i].offset = SmurfHeaderLayout<smurfHeaderLatestVersion>::field(static_cast<SmurfHeaderField>(i)).offset;
+    f[i].width  = SmurfHeaderLayout<smurfHeaderLatestVersion>::field(static_cast<SmurfHeaderField>(i)).width;
+  }
+
+  writer.write(out.data(), out.size());
+}
+
+void ColumnarWriter::append(const SmurfPacketView &v)
+{
+  if (count && (v.payloadLength != channels))
+    flush();
+
+  if (!count)
+  {
+    channels = v.payloadLength;
+    rows.resize(chunkFrames * channels);
+  }
+
+  memcpy(&headers[count * smurfheaderlength], v.header, smurfheaderlength);
+  memcpy(&rows[count * channels], v.payload, channels * sizeof(avgdata_t));
+
+  if (++count == chunkFrames)
+    flush();
+}
+
+void ColumnarWriter::end()
+{
+  if (!active)
+    return;
+
+  flush();
+
+  ColumnarTrailer t;
+  memset(&t, 0, sizeof(t));
+  t.indexOffset = writer.getLength();
+  t.numChunks   = index.size();
+  t.version     = ColumnarVersion;
+  memcpy(t.magic, "SMURFIDX", 8);
+
+  if (!index.empty())
+    writer.write(reinterpret_cast<const uint8_t*>(index.data()), index.size() * sizeof(ColumnarIndexEntry));
+
+  writer.write(reinterpret_cast<const uint8_t*>(&t), sizeof(t));
+
+  active = false;
+}
+
+void ColumnarWriter::flush()
+{
+  if (!count)
+    return;
+
+  // Header columns, one per field
+  std::size_t hlen = sizeof(ColumnarChunkHeader);
+
+  for (std::size_t f = 0; f < hfCount; ++f)
+    hlen += count * SmurfHeaderLayout<smurfHeaderLatestVersion>::field(static_cast<SmurfHeaderField>(f)).width;
+
+  std::size_t payloadOffset = align_up(hlen);
+  std::size_t length        = align_up(payloadOffset + count * channels * sizeof(avgdata_t));
+
+  if (codec == ColumnarCodecDelta)
+    length = payloadOffset + (channels + 1) * sizeof(uint32_t) + channels * sample_codec_bound(count);
+
+  out.assign(length, 0);
+
+  ColumnarChunkHeader *c = reinterpret_cast<ColumnarChunkHeader*>(out.data());
+  memcpy(c->magic, "CHNK", 4);
+  c->numFrames     = count;
+  c->numChannels   = channels;
+  c->payloadOffset = payloadOffset;
+
+  uint8_t *p = out.data() + sizeof(ColumnarChunkHeader);
+
+  for (std::size_t f = 0; f < hfCount; ++f)
+  {
+    SmurfHeaderFieldDesc d = SmurfHeaderLayout<smurfHeaderLatestVersion>::field(static_cast<SmurfHeaderField>(f));
+
+    for (std::size_t i = 0; i < count; ++i, p += d.width)
+      memcpy(p, &headers[i * smurfheaderlength + d.offset], d.width);
+  }
+
+  // Payload columns, one per channel. Transposed in blocks of channels, so each pass reads
+  // the rows sequentially and writes to a few columns only. With a codec the columns go
+  // through 'cols' first.
+  if (codec == ColumnarCodecDelta)
+    cols.resize(count * channels);
+
+  avgdata_t       *dst = (codec == ColumnarCodecDelta) ? cols.data() : reinterpret_cast<avgdata_t*>(out.data() + payloadOffset);
+  const avgdata_t *src = rows.data();
+
+  for (std::size_t c0 = 0; c0 < channels; c0 += 16)
+  {
+    std::size_t c1 = (c0 + 16 < channels) ? c0 + 16 : channels;
+
+    for (std::size_t i = 0; i < count; ++i)
+      for (std::size_t ch = c0; ch < c1; ++ch)
+        dst[ch * count + i] = src[i * channels + ch];
+  }
+
+  if (codec == ColumnarCodecDelta)
+  {
+    length = align_up(encode(cols.data(), payloadOffset));
+    out.resize(length);
+  }
+
+  c = reinterpret_cast<ColumnarChunkHeader*>(out.data());
+  c->length = length;
+
+  // Index entry, from the first and last headers
+  const uint8_t *h0 = &headers[0];
+  const uint8_t *h1 = &headers[(count - 1) * smurfheaderlength];
+
+  ColumnarIndexEntry e;
+  e.offset         = writer.getLength();
+  e.length         = length;
+  e.numFrames      = count;
+  e.numChannels    = channels;
+  e.firstFrame     = getHeaderField<hfFrameCounter, uint32_t>(h0);
+  e.lastFrame      = getHeaderField<hfFrameCounter, uint32_t>(h1);
+  e.firstUnixTime  = getHeaderField<hfUnixTime, uint64_t>(h0);
+  e.lastUnixTime   = getHeaderField<hfUnixTime, uint64_t>(h1);
+  e.firstEpicsTime = getHeaderField<hfCounter2, uint64_t>(h0);
+  e.lastEpicsTime  = getHeaderField<hfCounter2, uint64_t>(h1);
+  index.push_back(e);
+
+  writer.write(out.data(), out.size());
+  count = 0;
+}
+
+std::size_t ColumnarWriter::encode(const avgdata_t *src, std::size_t pos)
+{
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+  std::size_t base = pos;
+  uint32_t   *offs = reinterpret_cast<uint32_t*>(out.data() + pos);
+
+  pos += (channels + 1) * sizeof(uint32_t);
+
+  for (std::size_t ch = 0; ch < channels; ++ch)
+  {
+    offs[ch] = pos - base;
+    pos += encode_samples(src + ch * count, count, out.data() + pos);
+  }
+
+  offs[channels] = pos - base;
+
+  codecNs  += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+  codecIn  += count * channels * sizeof(avgdata_t);
+  codecOut += pos - base;
+
+  return(pos);
+}
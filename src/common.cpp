@@ -1,4 +1,5 @@
 #include "common.h"
+#include <stdlib.h>
 
 // Just prints errors
 void error(const char *msg)
@@ -15,4 +16,43 @@ uint64_t get_unix_time()
   clock_gettime(CLOCK_REALTIME, &tmp_t);
   tmp = 1000000000l * (uint64_t) tmp_t.tv_sec + (uint64_t) tmp_t.tv_nsec;  //  multiply to 64 uint
   return(tmp);
-}
\ No newline at end of file
+}
+
+// CPU features, checked at run time so the same library runs on any x86_64 host
+bool cpu_has_avx2()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __builtin_cpu_supports("avx2");
+#else
+  return false;
+#endif
+}
+
+bool cpu_has_avx512()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __builtin_cpu_supports("avx512f");
+#else
+  return false;
+#endif
+}
+
+bool cpu_has_fma()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __builtin_cpu_supports("fma");
+#else
+  return false;
+#endif
+}
+
+// malloc, aligned to a cache line. Free with free(). Returns NULL on failure.
+void *cache_aligned_malloc(size_t size)
+{
+  void *p;
+
+  if (posix_memalign(&p, cache_line_size, size ? size : cache_line_size))
+    return(NULL);
+
+  return(p);
+}
@@ -1,145 +1,512 @@
-
 #include "data_buffer.h"
+#include <new>
+#include <memory>
+#include <climits>
+#include <cstdint>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <chrono>
+
+// Sleep while *addr == val, for up to timeoutMs milliseconds
+static void futexWait(std::atomic<uint32_t> *addr, uint32_t val, std::size_t timeoutMs)
+{
+    timespec ts;
+    ts.tv_sec  = timeoutMs / 1000;
+    ts.tv_nsec = (timeoutMs % 1000) * 1000000;
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(addr), FUTEX_WAIT_PRIVATE, val, &ts, NULL, 0);
+}
+
+// Wake up all the threads sleeping on addr
+static void futexWakeAll(std::atomic<uint32_t> *addr)
+{
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(addr), FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+// Monotonic time in nanoseconds, for the Blocking policy deadline
+static uint64_t nowNs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
 
 DataBuffer::DataBuffer(std::size_t bufSize, std::size_t numReaders)
 :
 size          ( bufSize           ),
+requestedSize ( bufSize           ),
 numberReaders ( numReaders        ),
-full          ( numReaders, false ),
-empty         ( numReaders, true  ),
+readers       ( NULL              ),
+writeSeq      ( 0                 ),
 writeCnt      ( 0                 ),
-readCnt       ( numReaders, 0     ),
-OWCnt         ( numReaders, 0     ),
-ROFCnt        ( numReaders, 0     )
+dropCnt       ( 0                 ),
+futexWord     ( 0                 ),
+waiters       ( 0                 ),
+readWord      ( 0                 ),
+writerWaiting ( 0                 )
 {
-    for (std::size_t i(0); i < size; ++i)
+    if ( (bufSize < 1) || (bufSize > DataBufferMaxSize) )
+        throw std::runtime_error("Trying to create a DataBuffer with a size out of range");
+
+    // Readers index the vector while the writer grows it, so it must never reallocate
+    data.reserve(DataBufferMaxSize);
+
+    for (std::size_t i(0); i < bufSize; ++i)
         data.push_back(ISmurfPacket::create());
 
-    writePtr = data.begin();
+    // Each reader holds at most one packet, so one spare is always free
+    for (std::size_t i(0); i <= numReaders; ++i)
+        spares.push_back(ISmurfPacket::create());
+
+    if (!(readers = static_cast<Reader*>(cache_aligned_malloc(numberReaders * sizeof(Reader)))))
+        throw std::bad_alloc();
 
     for (std::size_t i(0); i < numberReaders; ++i)
-        readPtr.push_back(data.begin());
+    {
+        Reader *r = new (readers + i) Reader();
+        r->cursor  = 0;
+        r->readCnt = 0;
+        r->OWCnt   = 0;
+        r->ROFCnt  = 0;
+        r->highWater  = 0;
+        r->timeoutCnt = 0;
+        r->policy     = DropOldest;
+        r->timeoutMs  = 0;
+        r->behind     = false;
+        r->active     = false;
+    }
 
-    printf("DataBuffer created of size %zu, and number of readers %zu", size, numberReaders);
+    printf("DataBuffer created of size %zu, and number of reader slots %zu", size.load(), numberReaders);
     printf("DataBuffeV2.size =  %zu\n", data.size());
 };
 
 DataBuffer::~DataBuffer()
 {
+    for (std::size_t i(0); i < numberReaders; ++i)
+        readers[i].~Reader();
+
+    free(readers);
+
     printf("DataBuffer destroyed\n");
 };
 
+DataBuffer::Reader& DataBuffer::reader(std::size_t i)
+{
+    if (i >= numberReaders)
+        throw std::out_of_range("DataBuffer reader index out of range");
+
+    return readers[i];
+};
+
+const DataBuffer::Reader& DataBuffer::reader(std::size_t i) const
+{
+    if (i >= numberReaders)
+        throw std::out_of_range("DataBuffer reader index out of range");
+
+    return readers[i];
+};
+
+bool DataBuffer::full(const Reader &r, uint64_t w) const
+{
+    return ( r.active.load(std::memory_order_acquire) &&
+             ( w - (r.cursor.load(std::memory_order_acquire) >> 1) >= size.load(std::memory_order_relaxed) ) );
+}
+
+bool DataBuffer::waitForRoom(Reader &r, uint64_t w, uint64_t deadlineNs)
+{
+    for (unsigned spins(0); spins < 256; ++spins)
+    {
+        if (!full(r, w))
+            return true;
+
+        cpu_relax();
+    }
+
+    while (true)
+    {
+        ++writerWaiting;
+
+        // Read the futex word before checking again, so a doneReading in between makes the wait return
+        uint32_t v   = readWord.load(std::memory_order_seq_cst);
+        uint64_t now = nowNs();
+
+        if ( !full(r, w) || (now >= deadlineNs) )
+        {
+            --writerWaiting;
+            return !full(r, w);
+        }
+
+        std::size_t ms = (deadlineNs - now + 999999) / 1000000;
+        futexWait(&readWord, v, ms);
+        --writerWaiting;
+    }
+}
+
+void DataBuffer::applySize(uint64_t w)
+{
+    std::size_t n = requestedSize.load(std::memory_order_relaxed);
+
+    if (n == size.load(std::memory_order_relaxed))
+        return;
+
+    // Packet 'n' lives in slot n % size, so only change the size when no reader has unread packets
+    for (std::size_t i(0); i < numberReaders; ++i)
+    {
+        if ( readers[i].active.load(std::memory_order_acquire) && ( (readers[i].cursor.load(std::memory_order_acquire) >> 1) != w ) )
+            return;
+    }
+
+    while (data.size() < n)
+        data.push_back(ISmurfPacket::create());
+
+    // Readers load the size after the write sequence, so they see the new value with the next packet
+    size.store(n, std::memory_order_relaxed);
+}
+
 SmurfPacket DataBuffer::getWritePtr()
 {
+    // Only the writer changes the write sequence
+    uint64_t w = writeSeq.load(std::memory_order_relaxed);
+
+    applySize(w);
+
+    // Blocking readers get some time to make room, the shortest of their timeouts. A reader
+    // which timed out doesn't get any until it has caught up to half the buffer.
+    std::size_t timeoutMs = SIZE_MAX;
+
+    for(std::size_t i(0); i < numberReaders; ++i)
+    {
+        Reader &r = readers[i];
+
+        if (r.policy.load(std::memory_order_relaxed) != Blocking)
+            continue;
+
+        if ( r.behind.load(std::memory_order_relaxed) && ( 2 * (w - (r.cursor.load(std::memory_order_acquire) >> 1)) <= size.load(std::memory_order_relaxed) ) )
+            r.behind.store(false, std::memory_order_relaxed);
+
+        if ( !r.behind.load(std::memory_order_relaxed) && full(r, w) )
+            timeoutMs = std::min<std::size_t>(timeoutMs, r.timeoutMs.load(std::memory_order_relaxed));
+    }
+
+    if (timeoutMs != SIZE_MAX)
+    {
+        uint64_t deadline = nowNs() + 1000000 * static_cast<uint64_t>(timeoutMs);
+
+        for(std::size_t i(0); i < numberReaders; ++i)
+        {
+            Reader &r = readers[i];
+
+            if ( (r.policy.load(std::memory_order_relaxed) != Blocking) || r.behind.load(std::memory_order_relaxed) || !full(r, w) )
+                continue;
+
+            // falls back to DropOldest, until the reader catches up
+            if (!waitForRoom(r, w, deadline))
+            {
+                ++r.timeoutCnt;
+                r.behind.store(true, std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // If a full reader drops new packets, drop the new one before touching any cursor, so the
+    // other readers don't lose a packet for nothing.
+    for(std::size_t i(0); i < numberReaders; ++i)
+    {
+        if ( (readers[i].policy.load(std::memory_order_relaxed) == DropNewest) && full(readers[i], w) )
+        {
+            ++dropCnt;
+            return SmurfPacket();
+        }
+    }
 
     // If a reader's buffer is full, update its overwrite counter and move it
-    // read pointer forward
+    // read pointer forward. A reader using the packet in the slot keeps it.
+    std::size_t slot  = w % size.load(std::memory_order_relaxed);
+    bool        inUse = false;
+
     for(std::size_t i(0); i < numberReaders; ++i)
     {
-        if (full.at(i))
+        Reader   &r = readers[i];
+
+        if (!r.active.load(std::memory_order_acquire))
+            continue;
+
+        uint64_t  c = r.cursor.load(std::memory_order_acquire);
+
+        while ( w - (c >> 1) >= size.load(std::memory_order_relaxed) )
+        {
+            // The reader claimed the packet in the slot we want to write
+            if ( (c & 1) && ((c >> 1) == w - size.load(std::memory_order_relaxed)) )
+            {
+                inUse = true;
+                break;
+            }
+
+            // Fails if the reader claimed the packet or moved on meanwhile, then look again.
+            if (r.cursor.compare_exchange_weak(c, c + 2, std::memory_order_acq_rel, std::memory_order_acquire))
+            {
+                ++r.OWCnt;
+                c += 2;
+            }
+        }
+    }
+
+    // All the unclaimed cursors are off the slot now, swap it with a spare nobody holds.
+    if (inUse)
+    {
+        std::size_t k(0);
+
+        while ( (k < spares.size()) && (spares[k].use_count() != 1) )
+            ++k;
+
+        // Only if a reader keeps packets after doneReading()
+        if (k == spares.size())
         {
-            ++OWCnt.at(i);
-            ++readPtr.at(i);
+            ++dropCnt;
+            return SmurfPacket();
         }
+
+        SmurfPacket held = data[slot];
+        std::atomic_store(&data[slot], spares[k]);
+        spares[k] = held;
     }
 
-    return *writePtr;
+    return data[slot];
 };
 
 SmurfPacket_RO DataBuffer::getReadPtr(std::size_t i)
 {
-    // Verify is the buffer is empty
-    if (empty.at(i))
-    {
-        // Increase the read overflow counter and throw exception
-        ++ROFCnt.at(i);
-        throw std::runtime_error("Trying to read when the buffer is empty");
-    }
-    else
+    Reader   &r = reader(i);
+    uint64_t  c = r.cursor.load(std::memory_order_acquire);
+
+    SmurfPacket p;
+
+    // Claim the packet, so the writer doesn't reuse its slot while we read it. The packet is
+    // taken first: if the writer swaps the slot before the claim, the cursor moved and we retry.
+    do
     {
-        return *readPtr.at(i);
+        // Verify is the buffer is empty
+        if ( (c >> 1) == writeSeq.load(std::memory_order_acquire) )
+        {
+            // Increase the read overflow counter and throw exception
+            ++r.ROFCnt;
+            throw std::runtime_error("Trying to read when the buffer is empty");
+        }
+
+        p = std::atomic_load(&data[(c >> 1) % size.load(std::memory_order_relaxed)]);
     }
-};
+    while (!r.cursor.compare_exchange_weak(c, c | 1, std::memory_order_acq_rel, std::memory_order_acquire));
 
+    return p;
+};
 
 void DataBuffer::doneWriting()
 {
-    // Move the iterator forward.
-    ++writePtr;
+    uint64_t w = writeSeq.load(std::memory_order_relaxed) + 1;
 
-    // Verify is we arrived to the end of the buffer.
-    // If so, move the iterator back to the start.
-    if (writePtr == data.end())
-        writePtr = data.begin();
+    // Publish the packet
+    writeSeq.store(w, std::memory_order_release);
 
-    // Verify if the buffer is full for each reader.
+    // Track the largest lag of each reader. Only the writer updates highWater.
     for (std::size_t i(0); i < numberReaders; ++i)
     {
-        if (writePtr == readPtr.at(i))
-            full.at(i) = true;
-    }
+        if (!readers[i].active.load(std::memory_order_relaxed))
+            continue;
+
+        std::size_t lag = w - (readers[i].cursor.load(std::memory_order_relaxed) >> 1);
 
-    // The buffer is not empty after writing new data into it.
-    std::fill(empty.begin(), empty.end(), false);
+        if (lag > readers[i].highWater.load(std::memory_order_relaxed))
+            readers[i].highWater.store(lag, std::memory_order_relaxed);
+    }
 
     // Update write counter
     ++writeCnt;
 
-    // Notify listener that new data is ready to be processed.
-    std::unique_lock<std::mutex> lock(mutex);
-    dataReady.notify_all();
+    // Notify listener that new data is ready to be processed. The syscall is only
+    // made when a reader is sleeping.
+    futexWord.fetch_add(1, std::memory_order_seq_cst);
+
+    if (waiters.load(std::memory_order_seq_cst))
+        futexWakeAll(&futexWord);
 };
 
 void DataBuffer::doneReading(std::size_t i)
 {
-    // Move the iterator forward.
-    ++readPtr.at(i);
+    Reader   &r = reader(i);
+    uint64_t  c = r.cursor.load(std::memory_order_acquire);
 
-    // Verify is we arrived to the end of the buffer.
-    // If so, move the iterator back to the start.
-    if (readPtr.at(i) == data.end())
-        readPtr.at(i) = data.begin();
+    // Move the cursor forward and release the claim. A CAS, as the writer can move the cursor
+    // (past packets it overwrote while we held ours).
+    while ( !r.cursor.compare_exchange_weak(c, ((c >> 1) + 1) << 1, std::memory_order_acq_rel, std::memory_order_acquire) );
 
-    // Verify if the buffer is empty for each reader.
-    if (readPtr.at(i) == writePtr)
-        empty.at(i) = true;
+    // Update read counter
+    ++r.readCnt;
 
-    // The buffer is not full after reading data from it for that reader.
-    full.at(i) = false;
+    // Wake up the writer if it is waiting for this reader to make room
+    readWord.fetch_add(1, std::memory_order_seq_cst);
 
-    // Update read counter
-    ++readCnt.at(i);
+    if (writerWaiting.load(std::memory_order_seq_cst))
+        futexWakeAll(&readWord);
+};
+
+std::size_t DataBuffer::attachReader(Policy policy, std::size_t timeoutMs)
+{
+    std::lock_guard<std::mutex> lock(attachMutex);
+
+    for (std::size_t i(0); i < numberReaders; ++i)
+    {
+        Reader &r = readers[i];
+
+        if (r.active.load(std::memory_order_relaxed))
+            continue;
+
+        r.readCnt    = 0;
+        r.OWCnt      = 0;
+        r.ROFCnt     = 0;
+        r.highWater  = 0;
+        r.timeoutCnt = 0;
+        setPolicy(i, policy, timeoutMs);
+
+        // Start at the next packet. Only the writer moves writeSeq forward, so the slots
+        // of the packets published before are never counted as ours.
+        r.cursor.store(writeSeq.load(std::memory_order_acquire) << 1, std::memory_order_relaxed);
+        r.active.store(true, std::memory_order_release);
+
+        return i;
+    }
+
+    throw std::runtime_error("Trying to attach a reader to a DataBuffer without free reader slots");
+};
+
+void DataBuffer::detachReader(std::size_t i)
+{
+    std::lock_guard<std::mutex> lock(attachMutex);
+
+    reader(i).active.store(false, std::memory_order_release);
+
+    // Wake up the writer, in case it is waiting for this reader
+    readWord.fetch_add(1, std::memory_order_seq_cst);
+
+    if (writerWaiting.load(std::memory_order_seq_cst))
+        futexWakeAll(&readWord);
+};
+
+const bool DataBuffer::isAttached(std::size_t i) const
+{
+    return reader(i).active.load(std::memory_order_acquire);
+};
+
+bool DataBuffer::waitForData(std::size_t i, std::size_t timeoutMs)
+{
+    if (!isEmpty(i))
+        return true;
+
+    ++waiters;
+
+    // Read the futex word before checking again, so a publish in between makes the wait return
+    uint32_t v = futexWord.load(std::memory_order_seq_cst);
+
+    if (isEmpty(i))
+        futexWait(&futexWord, v, timeoutMs);
+
+    --waiters;
+
+    return !isEmpty(i);
+};
+
+void DataBuffer::wakeAll()
+{
+    futexWord.fetch_add(1, std::memory_order_seq_cst);
+    futexWakeAll(&futexWord);
+};
+
+void DataBuffer::setPolicy(std::size_t i, Policy policy, std::size_t timeoutMs)
+{
+    Reader &r = reader(i);
+
+    if ( (policy != DropOldest) && (policy != Blocking) && (policy != DropNewest) )
+        throw std::runtime_error("Trying to set an unknown DataBuffer reader policy");
+
+    r.timeoutMs = timeoutMs;
+    r.behind    = false;
+    r.policy    = policy;
+};
+
+const DataBuffer::Policy DataBuffer::getPolicy(std::size_t i) const
+{
+    return static_cast<Policy>(reader(i).policy.load());
+};
+
+void DataBuffer::setSize(std::size_t newSize)
+{
+    if ( (newSize < 1) || (newSize > DataBufferMaxSize) )
+        throw std::runtime_error("Trying to set a DataBuffer size out of range");
+
+    requestedSize = newSize;
+};
+
+const std::size_t DataBuffer::getLag(std::size_t i) const
+{
+    return ( writeSeq.load(std::memory_order_acquire) - (reader(i).cursor.load(std::memory_order_acquire) >> 1) );
+};
+
+const std::size_t DataBuffer::getHighWater(std::size_t i) const
+{
+    return reader(i).highWater;
+};
+
+const std::size_t DataBuffer::getTimeoutCnt(std::size_t i) const
+{
+    return reader(i).timeoutCnt;
 };
 
 const bool DataBuffer::isEmpty(std::size_t i) const
 {
-    return empty.at(i);
+    return ( (reader(i).cursor.load(std::memory_order_acquire) >> 1) == writeSeq.load(std::memory_order_acquire) );
 };
 
 const bool DataBuffer::isFull() const
 {
-    return ( std::find(full.begin(), full.end(), true) != full.end() );
+    uint64_t w = writeSeq.load(std::memory_order_acquire);
+
+    for (std::size_t i(0); i < numberReaders; ++i)
+    {
+        if ( full(readers[i], w) )
+            return true;
+    }
+
+    return false;
 };
 
 const std::size_t DataBuffer::getROFCnt(std::size_t i) const
 {
-    return ROFCnt.at(i);
+    return reader(i).ROFCnt;
 };
 
 const std::size_t DataBuffer::getOWCnt(std::size_t i) const
 {
-    return OWCnt.at(i);
+    return reader(i).OWCnt;
+};
+
+const std::size_t DataBuffer::getDropCnt() const
+{
+    return dropCnt;
 };
 
 void DataBuffer::clearCnts()
 {
-    std::fill(ROFCnt.begin(), ROFCnt.end(), 0);
-    std::fill(OWCnt.begin(), OWCnt.end(), 0);
+    for (std::size_t i(0); i < numberReaders; ++i)
+    {
+        readers[i].ROFCnt = 0;
+        readers[i].OWCnt  = 0;
+        readers[i].highWater  = 0;
+        readers[i].timeoutCnt = 0;
+    }
+
+    dropCnt = 0;
 };
 
 const std::size_t DataBuffer::getSize() const
 {
-    return size;
+    return size.load();
 };
 
 const std::size_t DataBuffer::getNumReaders() const
@@ -147,39 +514,29 @@ const std::size_t DataBuffer::getNumReaders() const
     return numberReaders;
 }
 
-std::mutex* DataBuffer::getMutex()
-{
-    return &mutex;
-};
-
-std::condition_variable* DataBuffer::getDataReady()
-{
-    return &dataReady;
-};
-
 void DataBuffer::printStatistic() const
 {
     std::cout << "------------------------------"                                << std::endl;
     std::cout << "Data Buffer statistics:"                                       << std::endl;
     std::cout << "------------------------------"                                << std::endl;
-    std::cout << "Buffer size                     : " << size                    << std::endl;
+    std::cout << "Buffer size                     : " << size.load()                   << std::endl;
     std::cout << "Total write operations          : " << writeCnt                << std::endl;
+    std::cout << "Total new packets dropped       : " << dropCnt                 << std::endl;
 
-    std::cout << "Total read operations           : ";
-    std::copy(readCnt.begin(), readCnt.end(), std::ostream_iterator<int>(std::cout, ", "));
-    std::cout << std::endl;
-
-    std::cout << "Total Overwrites                : ";
-    std::copy(OWCnt.begin(), OWCnt.end(), std::ostream_iterator<int>(std::cout, ", "));
-    std::cout << std::endl;
-
-    std::cout << "Total read attempts while empty : ";
-    std::copy(ROFCnt.begin(), ROFCnt.end(), std::ostream_iterator<int>(std::cout, ", "));
-    std::cout << std::endl;
-
-    std::cout << "Buffer 'empty' flag             : " << std::boolalpha;
-    std::copy(empty.begin(), empty.end(), std::ostream_iterator<bool>(std::cout, ", "));
-    std::cout << std::endl;
+    for (std::size_t i(0); i < numberReaders; ++i)
+    {
+        if (!readers[i].active)
+            continue;
+
+        std::cout << "Reader " << i                                                  << std::endl;
+        std::cout << "  Policy                        : " << readers[i].policy      << std::endl;
+        std::cout << "  Total read operations         : " << readers[i].readCnt     << std::endl;
+        std::cout << "  Total Overwrites              : " << readers[i].OWCnt       << std::endl;
+        std::cout << "  Total read attempts when empty: " << readers[i].ROFCnt      << std::endl;
+        std::cout << "  Blocking wait timeouts        : " << readers[i].timeoutCnt  << std::endl;
+        std::cout << "  Lag high water mark           : " << readers[i].highWater   << std::endl;
+        std::cout << "  Buffer 'empty' flag           : " << std::boolalpha << isEmpty(i) << std::endl;
+    }
 
     std::cout << "Buffer 'full' flag              : " << std::boolalpha << isFull()  << std::endl;
     std::cout << "------------------------------"                                    << std::endl;
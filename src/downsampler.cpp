@@ -0,0 +1,205 @@
+#include "downsampler.h"
+#include <iostream>
+
+DownsamplerStream::DownsamplerStream(int i, const std::string &n, Trigger t, uint32_t p, std::size_t depth)
+:
+  id          ( i                             ),
+  name        ( n                             ),
+  trigger     ( t                             ),
+  period      ( p                             ),
+  count       ( 0                             ),
+  last        ( 0                             ),
+  first       ( true                          ),
+  pending     ( false                         ),
+  emitCnt     ( 0                             ),
+  buffer      ( depth, PacketMaxSubscribers   ),
+  subscribers ( buffer                        )
+{
+}
+
+bool DownsamplerStream::tick(SmurfHeader *H)
+{
+  uint64_t x;
+
+  pending = false;
+
+  switch (trigger)
+  {
+    case Frames:
+      if (++count >= period)
+      {
+        count   = 0;
+        pending = true;
+      }
+      break;
+
+    case Syncword:
+      x = H->get_syncword();
+
+      if (!first && (x != last) && (++count >= period))
+      {
+        count   = 0;
+        pending = true;
+      }
+
+      last = x;
+      break;
+
+    case EpicsSeconds:
+      x = H->get_epics_seconds() / period;
+
+      if (!first && (x != last))
+        pending = true;
+
+      last = x;
+      break;
+  }
+
+  first = false;
+
+  return pending;
+}
+
+void DownsamplerStream::emit(uint8_t *header, avgdata_t *data, std::size_t numCh)
+{
+  SmurfPacket sp = buffer.getWritePtr();
+
+  if (!sp)
+    return;
+
+  sp->copyHeader(header);
+  sp->setPayloadLength(numCh);
+  sp->copyData(data);
+  buffer.doneWriting();
+
+  subscribers.publish(sp);
+  ++emitCnt;
+}
+
+Downsampler::Downsampler()
+:
+  streams ( std::make_shared<List>() ),
+  current (                          ),
+  nextId  ( 0                        ),
+  mut     (                          )
+{
+}
+
+Downsampler::~Downsampler()
+{
+  removeAll();
+}
+
+int Downsampler::add(const std::string &name, DownsamplerStream::Trigger trigger, uint32_t period, std::size_t depth)
+{
+  if (!period)
+    throw std::runtime_error("Trying to add a stream with a period of 0.");
+
+  if ((depth < 1) || (depth > DataBufferMaxSize))
+    throw std::runtime_error("Trying to add a stream with a buffer depth out of range.");
+
+  std::lock_guard<std::mutex> lock(mut);
+
+  if (streams->size() >= DownsamplerMaxStreams)
+    throw std::runtime_error("Trying to add more streams than the maximum.");
+
+  std::shared_ptr<List> l = std::make_shared<List>(*streams);
+  l->push_back(std::make_shared<DownsamplerStream>(nextId, name, trigger, period, depth));
+  std::atomic_store(&streams, std::shared_ptr<const List>(l));
+
+  std::cout << "Downsampler stream '" << name << "' added with id " << nextId << std::endl;
+
+  return nextId++;
+}
+
+void Downsampler::remove(int id)
+{
+  DownsamplerStreamPtr s;
+
+  {
+    std::lock_guard<std::mutex> lock(mut);
+
+    std::shared_ptr<List> l = std::make_shared<List>(*streams);
+
+    for (List::iterator it = l->begin(); it != l->end(); ++it)
+    {
+      if ((*it)->getId() == id)
+      {
+        s = *it;
+        l->erase(it);
+        break;
+      }
+    }
+
+    if (!s)
+      throw std::runtime_error("Unknown downsampler stream id.");
+
+    std::atomic_store(&streams, std::shared_ptr<const List>(l));
+  }
+
+  // The processing thread can still write to the stream, through an old snapshot. The snapshot
+  // holds a reference, so the stream is destroyed when it lets it go.
+  s->getSubscribers().detachAll();
+
+  std::cout << "Downsampler stream '" << s->getName() << "' removed" << std::endl;
+}
+
+void Downsampler::removeAll()
+{
+  std::vector<int> ids = getIds();
+
+  for (std::size_t i = 0; i < ids.size(); ++i)
+    remove(ids[i]);
+}
+
+bool Downsampler::tick(SmurfHeader *H)
+{
+  bool any = false;
+
+  current = std::atomic_load(&streams);
+
+  for (List::const_iterator it = current->begin(); it != current->end(); ++it)
+    any = (*it)->tick(H) || any;
+
+  return any;
+}
+
+void Downsampler::emit(uint8_t *header, avgdata_t *data, std::size_t numCh)
+{
+  for (List::const_iterator it = current->begin(); it != current->end(); ++it)
+  {
+    if (!(*it)->fired())
+      continue;
+
+    try
+    {
+      (*it)->emit(header, data, numCh);
+    }
+    catch (std::runtime_error &e)
+    {
+      std::cout << "Downsampler: Exception caught when writing stream '" << (*it)->getName() << "': " << e.what() << std::endl;
+    }
+  }
+}
+
+DownsamplerStreamPtr Downsampler::get(int id)
+{
+  std::shared_ptr<const List> l = std::atomic_load(&streams);
+
+  for (List::const_iterator it = l->begin(); it != l->end(); ++it)
+    if ((*it)->getId() == id)
+      return *it;
+
+  throw std::runtime_error("Unknown downsampler stream id.");
+}
+
+std::vector<int> Downsampler::getIds()
+{
+  std::shared_ptr<const List> l = std::atomic_load(&streams);
+  std::vector<int> ids;
+
+  for (List::const_iterator it = l->begin(); it != l->end(); ++it)
+    ids.push_back((*it)->getId());
+
+  return ids;
+}
@@ -0,0 +1,147 @@
+#include "file_rotator.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+FileRotator::FileRotator()
+:
+  name      (       ),
+  direct    ( false ),
+  gotDirect ( false ),
+  prealloc  ( 0     ),
+  fd        ( -1    ),
+  pending   ( false ),
+  stop      ( false ),
+  warned    ( false ),
+  takenCnt  ( 0     ),
+  missedCnt ( 0     ),
+  mut       (       ),
+  cond      (       ),
+  thread    ( &FileRotator::run, this )
+{
+  if ( pthread_setname_np( thread.native_handle(), "fileRotator" ) )
+    perror( "pthread_setname_np failed for the file rotator thread" );
+}
+
+FileRotator::~FileRotator()
+{
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    stop = true;
+  }
+
+  cond.notify_all();
+  thread.join();
+  discard();
+}
+
+void FileRotator::prepare(const std::string &n, bool d, uint64_t p)
+{
+  {
+    std::unique_lock<std::mutex> lock(mut);
+
+    // Wait for the file being prepared, it is dropped below
+    cond.wait(lock, [this] { return !pending; });
+
+    drop();
+    name     = n;
+    direct   = d;
+    prealloc = (p < FileRotatorMaxPrealloc) ? p : FileRotatorMaxPrealloc;
+    pending  = true;
+  }
+
+  cond.notify_all();
+}
+
+int FileRotator::take(const std::string &n, bool &d)
+{
+  std::unique_lock<std::mutex> lock(mut);
+
+  cond.wait(lock, [this] { return !pending; });
+
+  if ((fd < 0) || (n != name))
+  {
+    drop();
+    ++missedCnt;
+    return -1;
+  }
+
+  int f = fd;
+  d  = gotDirect;
+  fd = -1;
+  name.clear();
+  ++takenCnt;
+
+  return f;
+}
+
+void FileRotator::discard()
+{
+  std::unique_lock<std::mutex> lock(mut);
+
+  cond.wait(lock, [this] { return !pending; });
+  drop();
+}
+
+void FileRotator::drop()
+{
+  if (fd < 0)
+    return;
+
+  ::close(fd);
+  unlink(name.c_str());  // nothing was written to it
+  fd = -1;
+  name.clear();
+}
+
+void FileRotator::run()
+{
+  std::unique_lock<std::mutex> lock(mut);
+
+  while (true)
+  {
+    cond.wait(lock, [this] { return stop || pending; });
+
+    if (stop)
+      return;
+
+    std::string n = name;
+    bool        d = direct;
+    uint64_t    p = prealloc;
+
+    // The file system calls are done without the lock, prepare() and take() wait for 'pending'
+    lock.unlock();
+
+    int  flags = O_WRONLY | O_CREAT | O_TRUNC;
+    int  f     = -1;
+    bool fd_d  = false;
+
+    unlink(n.c_str());  // try to delete the file if it exists before creating
+
+    if (d && ((f = ::open(n.c_str(), flags | O_DIRECT, S_IRUSR | S_IWUSR)) >= 0))
+      fd_d = true;
+
+    if ((f < 0) && ((f = ::open(n.c_str(), flags, S_IRUSR | S_IWUSR)) < 0))
+      fprintf(stderr, "FileRotator: could not open %s: %s\n", n.c_str(), strerror(errno));
+
+    // Reserve the blocks now, without changing the file size. Not all file systems support it.
+    int err = ((f >= 0) && p) ? fallocate(f, FALLOC_FL_KEEP_SIZE, 0, p) : 0;
+
+    lock.lock();
+
+    if (err && !warned)
+    {
+      fprintf(stderr, "FileRotator: could not reserve space for %s: %s\n", n.c_str(), strerror(errno));
+      warned = true;
+    }
+
+    fd        = f;
+    gotDirect = fd_d;
+    pending   = false;
+    cond.notify_all();
+  }
+}
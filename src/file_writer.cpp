@@ -0,0 +1,526 @@
+#include "file_writer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+// io_uring is used through raw syscalls, so no library is needed. It is left out if the kernel
+// headers are too old to define it.
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define FILE_WRITER_IO_URING 1
+#endif
+#endif
+#endif
+
+static uint64_t monotonic_ns()
+{
+  timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return 1000000000ULL * (uint64_t) t.tv_sec + (uint64_t) t.tv_nsec;
+}
+
+#ifdef FILE_WRITER_IO_URING
+
+struct FileWriter::Ring
+{
+  int            fd;
+  void          *sqRing;
+  std::size_t    sqRingSize;
+  void          *cqRing;
+  std::size_t    cqRingSize;
+  io_uring_sqe  *sqes;
+  std::size_t    sqesSize;
+  unsigned      *sqHead;
+  unsigned      *sqTail;
+  unsigned      *sqMask;
+  unsigned      *sqArray;
+  unsigned      *cqHead;
+  unsigned      *cqTail;
+  unsigned      *cqMask;
+  io_uring_cqe  *cqes;
+  std::size_t    inFlight;   // Requests submitted and not completed
+};
+
+static int ring_enter(int fd, unsigned submit, unsigned complete, unsigned flags)
+{
+  int ret;
+
+  do
+    ret = syscall(__NR_io_uring_enter, fd, submit, complete, flags, NULL, 0);
+  while ((ret < 0) && (errno == EINTR));
+
+  return ret;
+}
+
+bool FileWriter::setupRing()
+{
+  io_uring_params p;
+  memset(&p, 0, sizeof(p));
+
+  int rfd = syscall(__NR_io_uring_setup, FileWriterNumBuffers, &p);
+
+  if (rfd < 0)
+    return false;
+
+  ring = new Ring();
+  ring->fd         = rfd;
+  ring->inFlight   = 0;
+  ring->sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  ring->cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+  ring->sqesSize   = p.sq_entries * sizeof(io_uring_sqe);
+  ring->sqRing     = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, rfd, IORING_OFF_SQ_RING);
+  ring->cqRing     = mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, rfd, IORING_OFF_CQ_RING);
+  void *sqes       = mmap(NULL, ring->sqesSize,   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, rfd, IORING_OFF_SQES);
+  ring->sqes       = (sqes == MAP_FAILED) ? NULL : static_cast<io_uring_sqe*>(sqes);
+
+  if ((ring->sqRing == MAP_FAILED) || (ring->cqRing == MAP_FAILED) || !ring->sqes)
+  {
+    closeRing();
+    return false;
+  }
+
+  uint8_t *sq = static_cast<uint8_t*>(ring->sqRing);
+  uint8_t *cq = static_cast<uint8_t*>(ring->cqRing);
+
+  ring->sqHead  = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+  ring->sqTail  = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+  ring->sqMask  = reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+  ring->sqArray = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+  ring->cqHead  = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+  ring->cqTail  = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+  ring->cqMask  = reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+  ring->cqes    = reinterpret_cast<io_uring_cqe*>(cq + p.cq_off.cqes);
+
+  return true;
+}
+
+void FileWriter::closeRing()
+{
+  if (!ring)
+    return;
+
+  if (ring->sqes)
+    munmap(ring->sqes, ring->sqesSize);
+
+  if (ring->cqRing != MAP_FAILED)
+    munmap(ring->cqRing, ring->cqRingSize);
+
+  if (ring->sqRing != MAP_FAILED)
+    munmap(ring->sqRing, ring->sqRingSize);
+
+  ::close(ring->fd);
+  delete ring;
+  ring = NULL;
+}
+
+void FileWriter::reap(bool wait)
+{
+  if (wait && ring->inFlight && (ring_enter(ring->fd, 0, 1, IORING_ENTER_GETEVENTS) < 0))
+    perror("FileWriter: io_uring_enter failed while waiting for a completion");
+
+  unsigned head = *ring->cqHead;
+  unsigned tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+
+  while (head != tail)
+  {
+    io_uring_cqe *c   = &ring->cqes[head & *ring->cqMask];
+    Buffer       &b   = buffers[c->user_data];
+    int           res = c->res;
+
+    __atomic_store_n(ring->cqHead, ++head, __ATOMIC_RELEASE);
+    --ring->inFlight;
+    b.inFlight = false;
+
+    if ((res == -EINTR) || (res == -EAGAIN))
+    {
+      writeBuffer(b);  // try again
+    }
+    else if (res <= 0)
+    {
+      fprintf(stderr, "FileWriter: write of %zu bytes failed: %s\n", b.length - b.done, res ? strerror(-res) : "nothing written");
+      ++errorCnt;
+    }
+    else if (b.done + res < b.length)
+    {
+      ++shortCnt;
+
+      if (advance(b, res))
+        writeBuffer(b);  // write the rest
+    }
+    else
+    {
+      bytes += b.used;
+    }
+  }
+}
+
+#else
+
+struct FileWriter::Ring
+{
+  std::size_t inFlight;
+};
+
+bool FileWriter::setupRing()
+{
+  return false;
+}
+
+void FileWriter::closeRing()
+{
+}
+
+void FileWriter::reap(bool)
+{
+}
+
+#endif
+
+FileWriter::FileWriter()
+:
+  fd          ( -1    ),
+  direct      ( false ),
+  trim        ( false ),
+  retired     (       ),
+  ring        ( NULL  ),
+  ringFailed  ( false ),
+  cur         ( 0     ),
+  offset      ( 0     ),
+  firstStaged ( 0     ),
+  bytes       ( 0     ),
+  writeCnt    ( 0     ),
+  shortCnt    ( 0     ),
+  errorCnt    ( 0     )
+{
+  for (std::size_t i = 0; i < FileWriterNumBuffers; ++i)
+  {
+    void *p;
+
+    if (posix_memalign(&p, FileWriterAlign, FileWriterBufferSize))
+      throw std::runtime_error("Could not allocate the file writer buffers.");
+
+    buffers[i].data     = static_cast<uint8_t*>(p);
+    buffers[i].used     = 0;
+    buffers[i].done     = 0;
+    buffers[i].length   = 0;
+    buffers[i].offset   = 0;
+    buffers[i].fd       = -1;
+    buffers[i].direct   = false;
+    buffers[i].inFlight = false;
+  }
+}
+
+FileWriter::~FileWriter()
+{
+  close();
+  closeRing();
+
+  for (std::size_t i = 0; i < FileWriterNumBuffers; ++i)
+    free(buffers[i].data);
+}
+
+bool FileWriter::open(const char *name, bool async, bool d)
+{
+  int flags = O_WRONLY | O_CREAT | O_TRUNC;
+  int f     = -1;
+
+  // Only EINVAL means the file system doesn't take O_DIRECT, other errors are reported as they are
+  if (d)
+  {
+    if ((f = ::open(name, flags | O_DIRECT, S_IRUSR | S_IWUSR)) >= 0)
+    {
+      attach(f, async, true, false);
+      return true;
+    }
+
+    if (errno != EINVAL)
+    {
+      perror("FileWriter: could not open the data file");
+      return false;
+    }
+
+    printf("O_DIRECT is not supported for %s, writing through the page cache\n", name);
+  }
+
+  if ((f = ::open(name, flags, S_IRUSR | S_IWUSR)) < 0)
+  {
+    perror("FileWriter: could not open the data file");
+    return false;
+  }
+
+  attach(f, async, false, false);
+  return true;
+}
+
+void FileWriter::attach(int f, bool async, bool d, bool t)
+{
+  detach();
+
+  if (async && !ring && !ringFailed && !setupRing())
+  {
+    printf("io_uring is not available, the data file is written with pwrite\n");
+    ringFailed = true;
+  }
+
+  if (!async && ring)
+  {
+    for (std::size_t i = 0; i < FileWriterNumBuffers; ++i)
+      waitFor(buffers[i]);
+
+    closeRetired();
+    closeRing();
+  }
+
+  fd     = f;
+  direct = d;
+  trim   = t;
+  offset = 0;
+
+  buffers[cur].offset = 0;
+}
+
+void FileWriter::detach()
+{
+  if (fd < 0)
+    return;
+
+  submit();
+
+  Retired r = { fd, offset, direct || trim };
+  retired.push_back(r);
+
+  fd     = -1;
+  offset = 0;
+
+  buffers[cur].offset = 0;
+
+  closeRetired();
+}
+
+void FileWriter::closeRetired()
+{
+  for (std::size_t i = 0; i < retired.size(); )
+  {
+    bool busy = false;
+
+    for (std::size_t j = 0; j < FileWriterNumBuffers; ++j)
+      busy = busy || (buffers[j].inFlight && (buffers[j].fd == retired[i].fd));
+
+    if (busy)
+    {
+      ++i;
+      continue;
+    }
+
+    // Remove the padding of the last O_DIRECT write, and the space reserved past the end
+    if (retired[i].trim && ftruncate(retired[i].fd, retired[i].length))
+    {
+      perror("FileWriter: could not truncate the data file");
+      ++errorCnt;
+    }
+
+    ::close(retired[i].fd);
+
+    retired[i] = retired.back();
+    retired.pop_back();
+  }
+}
+
+bool FileWriter::write(const uint8_t *data, std::size_t len)
+{
+  if (fd < 0)
+    return false;
+
+  uint64_t now = monotonic_ns();
+
+  while (len)
+  {
+    Buffer      &b = buffers[cur];
+    std::size_t  n = FileWriterBufferSize - b.used;
+
+    if (!b.used)
+      firstStaged = now;
+
+    if (n > len)
+      n = len;
+
+    memcpy(b.data + b.used, data, n);
+    b.used += n;
+    offset += n;
+    data   += n;
+    len    -= n;
+
+    if (b.used == FileWriterBufferSize)
+      submit();
+  }
+
+  // At low data rates, don't keep the data in memory for too long. With O_DIRECT, only full
+  // buffers are written, so the file offsets stay aligned.
+  if (!direct && buffers[cur].used && (now - firstStaged > FileWriterMaxDelayNs))
+    submit();
+
+  if (ring)
+    reap(false);  // free the buffers which are done
+
+  if (!retired.empty())
+    closeRetired();
+
+  return true;
+}
+
+void FileWriter::close()
+{
+  detach();
+
+  for (std::size_t i = 0; i < FileWriterNumBuffers; ++i)
+    waitFor(buffers[i]);
+
+  closeRetired();
+}
+
+const char* FileWriter::backend() const
+{
+  if (ring)
+    return direct ? "io_uring, O_DIRECT" : "io_uring";
+  else
+    return direct ? "pwrite, O_DIRECT" : "pwrite";
+}
+
+void FileWriter::submit()
+{
+  Buffer &b = buffers[cur];
+
+  if (!b.used)
+    return;
+
+  b.done   = 0;
+  b.length = b.used;
+  b.fd     = fd;
+  b.direct = direct;
+
+  // O_DIRECT lengths must be aligned. Only the last buffer of a file can be partly filled.
+  if (direct && (b.length % FileWriterAlign))
+  {
+    std::size_t pad = FileWriterAlign - b.length % FileWriterAlign;
+    memset(b.data + b.length, 0, pad);
+    b.length += pad;
+  }
+
+  writeBuffer(b);
+
+  // Move to the next buffer, once its previous write is done
+  cur = (cur + 1) % FileWriterNumBuffers;
+
+  Buffer &n = buffers[cur];
+  waitFor(n);
+  n.used   = 0;
+  n.offset = offset;
+}
+
+void FileWriter::writeBuffer(Buffer &b)
+{
+#ifdef FILE_WRITER_IO_URING
+  if (ring)
+  {
+    // Only this thread writes the submission queue tail
+    unsigned      tail = *ring->sqTail;
+    unsigned      i    = tail & *ring->sqMask;
+    io_uring_sqe *s    = &ring->sqes[i];
+
+    b.iov.iov_base = b.data + b.done;
+    b.iov.iov_len  = b.length - b.done;
+
+    memset(s, 0, sizeof(*s));
+    s->opcode    = IORING_OP_WRITEV;  // Linux 5.1, IORING_OP_WRITE needs 5.6
+    s->fd        = b.fd;
+    s->addr      = reinterpret_cast<uint64_t>(&b.iov);
+    s->len       = 1;
+    s->off       = b.offset + b.done;
+    s->user_data = &b - buffers;
+
+    ring->sqArray[i] = i;
+    __atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+
+    b.inFlight = true;
+    ++ring->inFlight;
+    ++writeCnt;
+
+    if (ring_enter(ring->fd, 1, 0, 0) > 0)
+      return;
+
+    // The kernel only takes requests from the queue in io_uring_enter(). If it didn't take this
+    // one, take it back, so the queue is empty again, and write the buffer with pwrite.
+    if (__atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) != tail)
+      return;
+
+    perror("FileWriter: io_uring_enter failed, writing with pwrite");
+    __atomic_store_n(ring->sqTail, tail, __ATOMIC_RELEASE);
+    b.inFlight = false;
+    --ring->inFlight;
+    --writeCnt;
+  }
+#endif
+
+  while (b.done < b.length)
+  {
+    ssize_t n = pwrite(b.fd, b.data + b.done, b.length - b.done, b.offset + b.done);
+    ++writeCnt;
+
+    if ((n < 0) && (errno == EINTR))
+      continue;
+
+    if (n <= 0)
+    {
+      fprintf(stderr, "FileWriter: write of %zu bytes failed: %s\n", b.length - b.done, n ? strerror(errno) : "nothing written");
+      ++errorCnt;
+      return;
+    }
+
+    if (b.done + n < b.length)
+      ++shortCnt;
+
+    if (!advance(b, n))
+      return;
+  }
+
+  bytes += b.used;
+}
+
+bool FileWriter::advance(Buffer &b, std::size_t n)
+{
+  std::size_t done = b.done + n;
+
+  // O_DIRECT writes must start on an aligned offset: after a short one, the rest is written from
+  // its last aligned byte, rewriting the bytes after it. A short write which doesn't complete a
+  // single block makes no progress, and is a failed write.
+  if (b.direct && (done < b.length))
+  {
+    done -= done % FileWriterAlign;
+
+    if (done == b.done)
+    {
+      fprintf(stderr, "FileWriter: O_DIRECT write of %zu bytes stopped within a block\n", b.length - b.done);
+      ++errorCnt;
+      return false;
+    }
+  }
+
+  b.done = done;
+  return true;
+}
+
+void FileWriter::waitFor(Buffer &b)
+{
+  while (b.inFlight)
+    reap(true);
+}
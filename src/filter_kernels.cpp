@@ -0,0 +1,491 @@
+#include "filter_kernels.h"
+#include "common.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FILTER_HAVE_X86
+#endif
+
+// Like the unwrap kernels, each filter kernel is a template on the channel count, with
+// instances for the common sizes and N = 0 for any other size.
+#define IIR_DISPATCH(kernel) \
+  switch (n) \
+  { \
+    case 528:  kernel<528>(in, x, y, a, b, g, order, n, out);  break; \
+    case 1024: kernel<1024>(in, x, y, a, b, g, order, n, out); break; \
+    case 2048: kernel<2048>(in, x, y, a, b, g, order, n, out); break; \
+    case 4096: kernel<4096>(in, x, y, a, b, g, order, n, out); break; \
+    default:   kernel<0>(in, x, y, a, b, g, order, n, out);    break; \
+  }
+
+// Same operation order as the original SmurfFilter loop, so the results are bit-exact.
+template <uint N>
+static void iir_scalar_n(const avgdata_t *in, filter_t * const *x, filter_t * const *y,
+                         const filter_t *a, const filter_t *b, filter_t g, int order, uint n, avgdata_t *out)
+{
+  const uint count = N ? N : n;
+
+  for (uint j = 0; j < count; j++)
+    x[0][j] = (filter_t) in[j];  // convert to doubles
+
+  for (uint j = 0; j < count; j++)
+  {
+    filter_t acc = b[0] * x[0][j];
+
+    for (int r = 1; r <= order; r++)
+      acc += b[r] * x[r][j] - a[r] * y[r][j];
+
+    y[0][j] = acc / a[0];  // divide final answer
+    out[j]  = (avgdata_t) (y[0][j] * g);
+  }
+}
+
+void iir_scalar(const avgdata_t *in, filter_t * const *x, filter_t * const *y,
+                const filter_t *a, const filter_t *b, filter_t g, int order, uint n, avgdata_t *out)
+{
+  IIR_DISPATCH(iir_scalar_n);
+}
+
+#define SOS_DISPATCH(kernel) \
+  switch (n) \
+  { \
+    case 528:  kernel<528>(in, state, stride, coef, sections, g, n, out);  break; \
+    case 1024: kernel<1024>(in, state, stride, coef, sections, g, n, out); break; \
+    case 2048: kernel<2048>(in, state, stride, coef, sections, g, n, out); break; \
+    case 4096: kernel<4096>(in, state, stride, coef, sections, g, n, out); break; \
+    default:   kernel<0>(in, state, stride, coef, sections, g, n, out);    break; \
+  }
+
+// Runs channels [first, count) of the cascade. 'stride' is the distance between state rows.
+static inline void sos_scalar_range(const avgdata_t *in, sos_t *state, const sos_t *coef, int sections,
+                                    sos_t g, uint first, uint count, uint stride, avgdata_t *out)
+{
+  for (uint j = first; j < count; j++)
+  {
+    sos_t v = (sos_t) in[j];
+
+    for (int k = 0; k < sections; k++)
+    {
+      const sos_t *c  = coef + 5 * k;
+      sos_t       *s1 = state + (2 * k) * stride;
+      sos_t       *s2 = s1 + stride;
+      sos_t        y  = c[0] * v + s1[j];
+
+      s1[j] = c[1] * v - c[3] * y + s2[j];
+      s2[j] = c[2] * v - c[4] * y;
+      v = y;
+    }
+
+    out[j] = (avgdata_t) (v * g);
+  }
+}
+
+template <uint N>
+static void sos_scalar_n(const avgdata_t *in, sos_t *state, uint stride, const sos_t *coef, int sections, sos_t g, uint n, avgdata_t *out)
+{
+  const uint count = N ? N : n;
+
+  sos_scalar_range(in, state, coef, sections, g, 0, count, stride, out);
+}
+
+void sos_scalar(const avgdata_t *in, sos_t *state, uint stride, const sos_t *coef, int sections, sos_t g, uint n, avgdata_t *out)
+{
+  SOS_DISPATCH(sos_scalar_n);
+}
+
+#define AVG_DISPATCH(kernel) \
+  switch (n) \
+  { \
+    case 528:  kernel<528>(in, sum, n);  break; \
+    case 1024: kernel<1024>(in, sum, n); break; \
+    case 2048: kernel<2048>(in, sum, n); break; \
+    case 4096: kernel<4096>(in, sum, n); break; \
+    default:   kernel<0>(in, sum, n);    break; \
+  }
+
+template <uint N>
+static void avg_scalar_n(const avgdata_t *in, int64_t *sum, uint n)
+{
+  const uint count = N ? N : n;
+
+  for (uint j = 0; j < count; j++)
+    sum[j] += in[j];
+}
+
+void avg_scalar(const avgdata_t *in, int64_t *sum, uint n)
+{
+  AVG_DISPATCH(avg_scalar_n);
+}
+
+void avg_divide(const int64_t *sum, int64_t count, uint n, avgdata_t *out)
+{
+  if (count <= 0)
+    return;
+
+  for (uint j = 0; j < n; j++)
+    out[j] = (avgdata_t) (sum[j] / count);
+}
+
+#ifdef FILTER_HAVE_X86
+
+// 4 channels per vector, 2 vectors per iteration to hide the FMA latency of the tap chain.
+template <uint N>
+__attribute__((target("avx2,fma")))
+static void iir_avx2_n(const avgdata_t *in, filter_t * const *x, filter_t * const *y,
+                       const filter_t *a, const filter_t *b, filter_t g, int order, uint n, avgdata_t *out)
+{
+  const uint    count = N ? N : n;
+  const __m256d a0    = _mm256_set1_pd(a[0]);
+  const __m256d b0    = _mm256_set1_pd(b[0]);
+  const __m256d gv    = _mm256_set1_pd(g);
+  uint j = 0;
+
+  for (; j + 8 <= count; j += 8)
+  {
+    __m256d x0 = _mm256_cvtepi32_pd(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + j)));
+    __m256d x1 = _mm256_cvtepi32_pd(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + j + 4)));
+    _mm256_storeu_pd(x[0] + j,     x0);
+    _mm256_storeu_pd(x[0] + j + 4, x1);
+
+    __m256d acc0 = _mm256_mul_pd(b0, x0);
+    __m256d acc1 = _mm256_mul_pd(b0, x1);
+
+    for (int r = 1; r <= order; r++)
+    {
+      const __m256d br = _mm256_set1_pd(b[r]);
+      const __m256d ar = _mm256_set1_pd(a[r]);
+      acc0 = _mm256_fmadd_pd(br, _mm256_loadu_pd(x[r] + j),     acc0);
+      acc1 = _mm256_fmadd_pd(br, _mm256_loadu_pd(x[r] + j + 4), acc1);
+      acc0 = _mm256_fnmadd_pd(ar, _mm256_loadu_pd(y[r] + j),     acc0);
+      acc1 = _mm256_fnmadd_pd(ar, _mm256_loadu_pd(y[r] + j + 4), acc1);
+    }
+
+    acc0 = _mm256_div_pd(acc0, a0);
+    acc1 = _mm256_div_pd(acc1, a0);
+    _mm256_storeu_pd(y[0] + j,     acc0);
+    _mm256_storeu_pd(y[0] + j + 4, acc1);
+
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + j),     _mm256_cvttpd_epi32(_mm256_mul_pd(acc0, gv)));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + j + 4), _mm256_cvttpd_epi32(_mm256_mul_pd(acc1, gv)));
+  }
+
+  // Remaining channels, with the same rounding as the vector loop
+  for (; j < count; j++)
+  {
+    x[0][j] = (filter_t) in[j];
+    filter_t acc = b[0] * x[0][j];
+
+    for (int r = 1; r <= order; r++)
+    {
+      acc = __builtin_fma(b[r], x[r][j], acc);
+      acc = __builtin_fma(-a[r], y[r][j], acc);
+    }
+
+    y[0][j] = acc / a[0];
+    out[j]  = (avgdata_t) (y[0][j] * g);
+  }
+}
+
+void iir_avx2(const avgdata_t *in, filter_t * const *x, filter_t * const *y,
+              const filter_t *a, const filter_t *b, filter_t g, int order, uint n, avgdata_t *out)
+{
+  IIR_DISPATCH(iir_avx2_n);
+}
+
+// 8 channels per vector, 2 vectors per iteration.
+template <uint N>
+__attribute__((target("avx512f")))
+static void iir_avx512_n(const avgdata_t *in, filter_t * const *x, filter_t * const *y,
+                         const filter_t *a, const filter_t *b, filter_t g, int order, uint n, avgdata_t *out)
+{
+  const uint    count = N ? N : n;
+  const __m512d a0    = _mm512_set1_pd(a[0]);
+  const __m512d b0    = _mm512_set1_pd(b[0]);
+  const __m512d gv    = _mm512_set1_pd(g);
+  uint j = 0;
+
+  for (; j + 16 <= count; j += 16)
+  {
+    __m512d x0 = _mm512_cvtepi32_pd(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + j)));
+    __m512d x1 = _mm512_cvtepi32_pd(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + j + 8)));
+    _mm512_storeu_pd(x[0] + j,     x0);
+    _mm512_storeu_pd(x[0] + j + 8, x1);
+
+    __m512d acc0 = _mm512_mul_pd(b0, x0);
+    __m512d acc1 = _mm512_mul_pd(b0, x1);
+
+    for (int r = 1; r <= order; r++)
+    {
+      const __m512d br = _mm512_set1_pd(b[r]);
+      const __m512d ar = _mm512_set1_pd(a[r]);
+      acc0 = _mm512_fmadd_pd(br, _mm512_loadu_pd(x[r] + j),     acc0);
+      acc1 = _mm512_fmadd_pd(br, _mm512_loadu_pd(x[r] + j + 8), acc1);
+      acc0 = _mm512_fnmadd_pd(ar, _mm512_loadu_pd(y[r] + j),     acc0);
+      acc1 = _mm512_fnmadd_pd(ar, _mm512_loadu_pd(y[r] + j + 8), acc1);
+    }
+
+    acc0 = _mm512_div_pd(acc0, a0);
+    acc1 = _mm512_div_pd(acc1, a0);
+    _mm512_storeu_pd(y[0] + j,     acc0);
+    _mm512_storeu_pd(y[0] + j + 8, acc1);
+
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + j),     _mm512_cvttpd_epi32(_mm512_mul_pd(acc0, gv)));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + j + 8), _mm512_cvttpd_epi32(_mm512_mul_pd(acc1, gv)));
+  }
+
+  for (; j < count; j++)
+  {
+    x[0][j] = (filter_t) in[j];
+    filter_t acc = b[0] * x[0][j];
+
+    for (int r = 1; r <= order; r++)
+    {
+      acc = __builtin_fma(b[r], x[r][j], acc);
+      acc = __builtin_fma(-a[r], y[r][j], acc);
+    }
+
+    y[0][j] = acc / a[0];
+    out[j]  = (avgdata_t) (y[0][j] * g);
+  }
+}
+
+void iir_avx512(const avgdata_t *in, filter_t * const *x, filter_t * const *y,
+                const filter_t *a, const filter_t *b, filter_t g, int order, uint n, avgdata_t *out)
+{
+  IIR_DISPATCH(iir_avx512_n);
+}
+
+// 8 channels per vector. The whole cascade runs on a block of channels before moving on,
+// so the signal between sections never leaves the registers.
+template <uint N>
+__attribute__((target("avx2,fma")))
+static void sos_avx2_n(const avgdata_t *in, sos_t *state, uint stride, const sos_t *coef, int sections, sos_t g, uint n, avgdata_t *out)
+{
+  const uint   count = N ? N : n;
+  const __m256 gv    = _mm256_set1_ps(g);
+  uint j = 0;
+
+  for (; j + 8 <= count; j += 8)
+  {
+    __m256 v = _mm256_cvtepi32_ps(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + j)));
+
+    for (int k = 0; k < sections; k++)
+    {
+      const sos_t *c  = coef + 5 * k;
+      sos_t       *s1 = state + (2 * k) * stride + j;
+      sos_t       *s2 = s1 + stride;
+
+      __m256 y  = _mm256_fmadd_ps(_mm256_set1_ps(c[0]), v, _mm256_loadu_ps(s1));
+      __m256 n1 = _mm256_fmadd_ps(_mm256_set1_ps(c[1]), v, _mm256_loadu_ps(s2));
+      __m256 n2 = _mm256_mul_ps(_mm256_set1_ps(c[2]), v);
+      n1 = _mm256_fnmadd_ps(_mm256_set1_ps(c[3]), y, n1);
+      n2 = _mm256_fnmadd_ps(_mm256_set1_ps(c[4]), y, n2);
+      _mm256_storeu_ps(s1, n1);
+      _mm256_storeu_ps(s2, n2);
+      v = y;
+    }
+
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + j), _mm256_cvttps_epi32(_mm256_mul_ps(v, gv)));
+  }
+
+  sos_scalar_range(in, state, coef, sections, g, j, count, stride, out);
+}
+
+void sos_avx2(const avgdata_t *in, sos_t *state, uint stride, const sos_t *coef, int sections, sos_t g, uint n, avgdata_t *out)
+{
+  SOS_DISPATCH(sos_avx2_n);
+}
+
+// 16 channels per vector
+template <uint N>
+__attribute__((target("avx512f")))
+static void sos_avx512_n(const avgdata_t *in, sos_t *state, uint stride, const sos_t *coef, int sections, sos_t g, uint n, avgdata_t *out)
+{
+  const uint   count = N ? N : n;
+  const __m512 gv    = _mm512_set1_ps(g);
+  uint j = 0;
+
+  for (; j + 16 <= count; j += 16)
+  {
+    __m512 v = _mm512_cvtepi32_ps(_mm512_loadu_si512(in + j));
+
+    for (int k = 0; k < sections; k++)
+    {
+      const sos_t *c  = coef + 5 * k;
+      sos_t       *s1 = state + (2 * k) * stride + j;
+      sos_t       *s2 = s1 + stride;
+
+      __m512 y  = _mm512_fmadd_ps(_mm512_set1_ps(c[0]), v, _mm512_loadu_ps(s1));
+      __m512 n1 = _mm512_fmadd_ps(_mm512_set1_ps(c[1]), v, _mm512_loadu_ps(s2));
+      __m512 n2 = _mm512_mul_ps(_mm512_set1_ps(c[2]), v);
+      n1 = _mm512_fnmadd_ps(_mm512_set1_ps(c[3]), y, n1);
+      n2 = _mm512_fnmadd_ps(_mm512_set1_ps(c[4]), y, n2);
+      _mm512_storeu_ps(s1, n1);
+      _mm512_storeu_ps(s2, n2);
+      v = y;
+    }
+
+    _mm512_storeu_si512(out + j, _mm512_cvttps_epi32(_mm512_mul_ps(v, gv)));
+  }
+
+  sos_scalar_range(in, state, coef, sections, g, j, count, stride, out);
+}
+
+void sos_avx512(const avgdata_t *in, sos_t *state, uint stride, const sos_t *coef, int sections, sos_t g, uint n, avgdata_t *out)
+{
+  SOS_DISPATCH(sos_avx512_n);
+}
+
+// 4 channels per vector, 2 vectors per iteration
+template <uint N>
+__attribute__((target("avx2")))
+static void avg_avx2_n(const avgdata_t *in, int64_t *sum, uint n)
+{
+  const uint count = N ? N : n;
+  uint j = 0;
+
+  for (; j + 8 <= count; j += 8)
+  {
+    __m256i x0 = _mm256_cvtepi32_epi64(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + j)));
+    __m256i x1 = _mm256_cvtepi32_epi64(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + j + 4)));
+    __m256i *s = reinterpret_cast<__m256i*>(sum + j);
+    _mm256_storeu_si256(s,     _mm256_add_epi64(_mm256_loadu_si256(s),     x0));
+    _mm256_storeu_si256(s + 1, _mm256_add_epi64(_mm256_loadu_si256(s + 1), x1));
+  }
+
+  if (j < count)
+    avg_scalar_n<0>(in + j, sum + j, count - j);
+}
+
+void avg_avx2(const avgdata_t *in, int64_t *sum, uint n)
+{
+  AVG_DISPATCH(avg_avx2_n);
+}
+
+// 8 channels per vector, 2 vectors per iteration
+template <uint N>
+__attribute__((target("avx512f")))
+static void avg_avx512_n(const avgdata_t *in, int64_t *sum, uint n)
+{
+  const uint count = N ? N : n;
+  uint j = 0;
+
+  for (; j + 16 <= count; j += 16)
+  {
+    __m512i x0 = _mm512_cvtepi32_epi64(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + j)));
+    __m512i x1 = _mm512_cvtepi32_epi64(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + j + 8)));
+    _mm512_storeu_si512(sum + j,     _mm512_add_epi64(_mm512_loadu_si512(sum + j),     x0));
+    _mm512_storeu_si512(sum + j + 8, _mm512_add_epi64(_mm512_loadu_si512(sum + j + 8), x1));
+  }
+
+  if (j < count)
+    avg_scalar_n<0>(in + j, sum + j, count - j);
+}
+
+void avg_avx512(const avgdata_t *in, int64_t *sum, uint n)
+{
+  AVG_DISPATCH(avg_avx512_n);
+}
+
+#else
+
+// Vector kernels are x86 only. Keep the symbols so callers don't need to care.
+void iir_avx2(const avgdata_t *in, filter_t * const *x, filter_t * const *y,
+              const filter_t *a, const filter_t *b, filter_t g, int order, uint n, avgdata_t *out)
+{
+  iir_scalar(in, x, y, a, b, g, order, n, out);
+}
+
+void iir_avx512(const avgdata_t *in, filter_t * const *x, filter_t * const *y,
+                const filter_t *a, const filter_t *b, filter_t g, int order, uint n, avgdata_t *out)
+{
+  iir_scalar(in, x, y, a, b, g, order, n, out);
+}
+
+void sos_avx2(const avgdata_t *in, sos_t *state, uint stride, const sos_t *coef, int sections, sos_t g, uint n, avgdata_t *out)
+{
+  sos_scalar(in, state, stride, coef, sections, g, n, out);
+}
+
+void sos_avx512(const avgdata_t *in, sos_t *state, uint stride, const sos_t *coef, int sections, sos_t g, uint n, avgdata_t *out)
+{
+  sos_scalar(in, state, stride, coef, sections, g, n, out);
+}
+
+void avg_avx2(const avgdata_t *in, int64_t *sum, uint n)
+{
+  avg_scalar(in, sum, n);
+}
+
+void avg_avx512(const avgdata_t *in, int64_t *sum, uint n)
+{
+  avg_scalar(in, sum, n);
+}
+
+#endif
+
+iir_kernel_t select_iir_kernel(void)
+{
+  if (cpu_has_avx512())
+    return(iir_avx512);
+
+  if (cpu_has_avx2() && cpu_has_fma())
+    return(iir_avx2);
+
+  return(iir_scalar);
+}
+
+sos_kernel_t select_sos_kernel(void)
+{
+  if (cpu_has_avx512())
+    return(sos_avx512);
+
+  if (cpu_has_avx2() && cpu_has_fma())
+    return(sos_avx2);
+
+  return(sos_scalar);
+}
+
+avg_kernel_t select_avg_kernel(void)
+{
+  if (cpu_has_avx512())
+    return(avg_avx512);
+
+  if (cpu_has_avx2())
+    return(avg_avx2);
+
+  return(avg_scalar);
+}
+
+const char *iir_kernel_name(iir_kernel_t kernel)
+{
+  if (kernel == iir_avx512)
+    return("avx512");
+
+  if (kernel == iir_avx2)
+    return("avx2");
+
+  return("scalar");
+}
+
+const char *sos_kernel_name(sos_kernel_t kernel)
+{
+  if (kernel == sos_avx512)
+    return("avx512");
+
+  if (kernel == sos_avx2)
+    return("avx2");
+
+  return("scalar");
+}
+
+const char *avg_kernel_name(avg_kernel_t kernel)
+{
+  if (kernel == avg_avx512)
+    return("avx512");
+
+  if (kernel == avg_avx2)
+    return("avx2");
+
+  return("scalar");
+}
@@ -0,0 +1,132 @@
+#include "filter_params.h"
+
+FilterParams::FilterParams()
+:
+  version    ( 0     ),
+  order      ( 0     ),
+  g          ( 1     ),
+  sos_n      ( 0     ),
+  decimate   ( false ),
+  warm_start ( false )
+{
+  for (std::size_t i = 0; i < 16; ++i)
+  {
+    a[i] = 0;
+    b[i] = 0;
+  }
+
+  a[0] = 1;  // pass through by default
+  b[0] = 1;
+
+  for (std::size_t k = 0; k < filter_max_sections; ++k)
+    for (std::size_t i = 0; i < 5; ++i)
+      sos[k][i] = 0;
+}
+
+bool FilterParams::sameFilter(const FilterParams& rhs) const
+{
+  if (sos_n != rhs.sos_n)
+    return false;
+
+  if (sos_n > 0)
+  {
+    for (int k = 0; k < sos_n; ++k)
+      for (std::size_t i = 0; i < 5; ++i)
+        if (sos[k][i] != rhs.sos[k][i])
+          return false;
+
+    return true;
+  }
+
+  if (order != rhs.order)
+    return false;
+
+  for (int r = 0; (r <= order) && (r < 16); ++r)
+    if ((a[r] != rhs.a[r]) || (b[r] != rhs.b[r]))
+      return false;
+
+  return true;
+}
+
+bool FilterParams::sameSettings(const FilterParams& rhs) const
+{
+  return sameFilter(rhs) && (g == rhs.g) && (decimate == rhs.decimate) && (warm_start == rhs.warm_start);
+}
+
+FilterParamsPublisher::FilterParamsPublisher()
+:
+  current     ( new FilterParams() ),
+  ack         ( 0                  ),
+  nextVersion ( 1                  ),
+  retired     (                    ),
+  mut         (                    )
+{
+}
+
+FilterParamsPublisher::~FilterParamsPublisher()
+{
+  for (std::size_t i = 0; i < retired.size(); ++i)
+    delete retired[i];
+
+  delete current.load();
+}
+
+const FilterParams* FilterParamsPublisher::read()
+{
+  // The object loaded here is the newest one, so it is never older than the acknowledged
+  // version, and the writers don't free it.
+  const FilterParams* p = current.load(std::memory_order_acquire);
+
+  if (ack.load(std::memory_order_relaxed) != p->version)
+    ack.store(p->version, std::memory_order_release);
+
+  return p;
+}
+
+uint64_t FilterParamsPublisher::publish(const FilterParams& p)
+{
+  return update([&p](FilterParams& q) { q = p; });
+}
+
+uint64_t FilterParamsPublisher::update(const std::function<void(FilterParams&)>& f)
+{
+  std::lock_guard<std::mutex> lock(mut);
+
+  FilterParams* p = new FilterParams(*current.load(std::memory_order_relaxed));
+  f(*p);
+  p->version = nextVersion++;
+
+  retired.push_back(current.exchange(p, std::memory_order_acq_rel));
+  reclaim();
+
+  return p->version;
+}
+
+FilterParams FilterParamsPublisher::latest()
+{
+  std::lock_guard<std::mutex> lock(mut);
+  return *current.load(std::memory_order_relaxed);
+}
+
+std::size_t FilterParamsPublisher::getRetiredCnt()
+{
+  std::lock_guard<std::mutex> lock(mut);
+  return retired.size();
+}
+
+void FilterParamsPublisher::reclaim()
+{
+  uint64_t v = ack.load(std::memory_order_acquire);
+
+  for (std::size_t i = 0; i < retired.size(); )
+  {
+    if (retired[i]->version < v)
+    {
+      delete retired[i];
+      retired[i] = retired.back();
+      retired.pop_back();
+    }
+    else
+      ++i;
+  }
+}
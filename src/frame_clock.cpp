@@ -0,0 +1,153 @@
+#include "frame_clock.h"
+#include <stdio.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+
+static uint64_t clock_ns(clockid_t id)
+{
+  timespec t;
+  clock_gettime(id, &t);
+  return 1000000000ULL * (uint64_t) t.tv_sec + (uint64_t) t.tv_nsec;
+}
+
+// (a * b) >> 32, for a < 2^40 ticks, without a 128 bit type
+static uint64_t mul_shift32(uint64_t a, uint64_t b)
+{
+  return (a >> 32) * b + (((a & 0xFFFFFFFF) * b) >> 32);
+}
+
+static uint64_t read_tsc()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+// The TSC runs at a constant rate in all power states (CPUID 0x80000007, EDX bit 8)
+static bool tsc_invariant()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  unsigned a, b, c, d;
+
+  if (!__get_cpuid(0x80000007, &a, &b, &c, &d))
+    return false;
+
+  return d & (1 << 8);
+#else
+  return false;
+#endif
+}
+
+FrameClock::FrameClock()
+:
+  tsc       ( tsc_invariant() ),
+  tsc0      ( 0               ),
+  mono0     ( 0               ),
+  tscBase   ( 0               ),
+  realBase  ( 0               ),
+  mult      ( 0               ),
+  syncTicks ( 0               ),
+  last      ( 0               ),
+  stepBackCnt ( 0             )
+{
+  if (tsc)
+  {
+    uint64_t real;
+
+    clock_ns(CLOCK_MONOTONIC);  // the first vDSO call can be slow
+    read(tsc0, mono0, real);
+
+    // First scale, from a 10 ms interval. The next syncs refine it, at growing intervals.
+    timespec t = { 0, 10000000 };
+    nanosleep(&t, NULL);
+
+    syncTicks = 0;
+    sync();
+
+    if (!mult)
+      tsc = false;  // the TSC didn't move
+  }
+
+  printf("Frame clock: %s\n", tsc ? "TSC, calibrated against CLOCK_MONOTONIC" : "clock_gettime(CLOCK_REALTIME)");
+
+  stamp();
+}
+
+void FrameClock::read(uint64_t &t, uint64_t &mono, uint64_t &real)
+{
+  // Keep the read with the fewest ticks between the two TSC reads, i.e. the one least
+  // likely to have been interrupted. The TSC value is the midpoint.
+  uint64_t best = ~0ULL;
+
+  for (int i = 0; i < 8; ++i)
+  {
+    uint64_t t1 = read_tsc();
+    uint64_t m  = clock_ns(CLOCK_MONOTONIC);
+    uint64_t r  = clock_ns(CLOCK_REALTIME);
+    uint64_t t2 = read_tsc();
+
+    if (t2 - t1 < best)
+    {
+      best = t2 - t1;
+      t    = t1 + (t2 - t1) / 2;
+      mono = m;
+      real = r;
+    }
+  }
+}
+
+void FrameClock::sync()
+{
+  uint64_t t, mono, real;
+
+  read(t, mono, real);
+
+  // Scale over the whole time since the first read, so it gets more precise
+  if (t > tsc0)
+    mult = (uint64_t) ((long double) (mono - mono0) * 4294967296.0L / (t - tsc0));
+
+  tscBase  = t;
+  realBase = real;
+
+  // The interval between syncs doubles from 10 ms, up to about 1 s
+  uint64_t second = mult ? (1000000000ULL << 32) / mult : 0;
+  syncTicks = syncTicks ? syncTicks * 2 : second / 100;
+
+  if (syncTicks > second)
+    syncTicks = second;
+}
+
+uint64_t FrameClock::stamp()
+{
+  if (!tsc)
+    return last = clock_ns(CLOCK_REALTIME);
+
+  uint64_t dt = read_tsc() - tscBase;
+
+  if (dt > syncTicks)
+  {
+    sync();
+    dt = read_tsc() - tscBase;
+  }
+
+  uint64_t now = realBase + mul_shift32(dt, mult);
+
+  // Each sync can move the time a little, never go back. Unless the clock was set back: then
+  // follow it, or the timestamps would be frozen for as long as the step.
+  if (now < last)
+  {
+    if (last - now <= FrameClockMaxStepBack)
+      now = last;
+    else
+    {
+      ++stepBackCnt;
+      printf("Frame clock: CLOCK_REALTIME stepped back by %.3f s, following it\n", (last - now) * 1e-9);
+    }
+  }
+
+  return last = now;
+}
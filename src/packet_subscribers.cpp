@@ -0,0 +1,180 @@
+#include "packet_subscribers.h"
+#include <iostream>
+#include <pthread.h>
+
+PacketSubscribers::PacketSubscribers(DataBuffer &b)
+:
+  buffer     ( b                          ),
+  entries    (                            ),
+  inlineSubs ( std::make_shared<List>()   ),
+  nextId     ( 0                          ),
+  mut        (                            )
+{
+}
+
+PacketSubscribers::~PacketSubscribers()
+{
+  detachAll();
+}
+
+int PacketSubscribers::attach(PacketSubscriberPtr sub, const std::string &name, bool threaded, DataBuffer::Policy policy, std::size_t timeoutMs)
+{
+  if (!sub)
+    throw std::runtime_error("Trying to attach an empty packet subscriber.");
+
+  std::lock_guard<std::mutex> lock(mut);
+
+  std::unique_ptr<Entry> e(new Entry());
+  e->id       = nextId;
+  e->name     = name;
+  e->sub      = sub;
+  e->threaded = threaded;
+  e->reader   = 0;
+  e->run      = true;
+
+  if (threaded)
+  {
+    e->reader = buffer.attachReader(policy, timeoutMs);
+    e->thread = std::thread(&PacketSubscribers::loop, this, e.get());
+
+    // Thread names are limited to 15 characters
+    if ( pthread_setname_np( e->thread.native_handle(), name.substr(0, 15).c_str() ) )
+      perror( "pthread_setname_np failed for a packet subscriber thread" );
+  }
+
+  entries.push_back(std::move(e));
+
+  if (!threaded)
+    updateInline();
+
+  std::cout << "Packet subscriber '" << name << "' attached with id " << nextId << std::endl;
+
+  return nextId++;
+}
+
+void PacketSubscribers::detach(int id)
+{
+  std::unique_ptr<Entry> e;
+
+  {
+    std::lock_guard<std::mutex> lock(mut);
+
+    std::vector<std::unique_ptr<Entry>>::iterator it = find(id);
+    e = std::move(*it);
+    entries.erase(it);
+
+    if (!e->threaded)
+      updateInline();
+  }
+
+  // The thread is joined without the lock, as process() may take a while to return
+  if (e->threaded)
+  {
+    e->run = false;
+    buffer.wakeAll();
+    e->thread.join();
+    buffer.detachReader(e->reader);
+  }
+
+  // An inline subscriber can still be in use by the writer, through an old snapshot.
+  // The snapshot holds a reference, so it is destroyed when the writer lets it go.
+  std::cout << "Packet subscriber '" << e->name << "' detached" << std::endl;
+}
+
+void PacketSubscribers::detachAll()
+{
+  std::vector<int> ids = getIds();
+
+  for (std::size_t i = 0; i < ids.size(); ++i)
+    detach(ids[i]);
+}
+
+void PacketSubscribers::publish(const SmurfPacket_RO &packet)
+{
+  std::shared_ptr<const List> subs = std::atomic_load(&inlineSubs);
+
+  for (List::const_iterator it = subs->begin(); it != subs->end(); ++it)
+  {
+    try
+    {
+      (*it)->process(packet);
+    }
+    catch (std::exception &e)
+    {
+      std::cout << "PacketSubscribers: Exception caught in an inline subscriber: " << e.what() << std::endl;
+    }
+  }
+}
+
+std::size_t PacketSubscribers::reader(int id)
+{
+  std::lock_guard<std::mutex> lock(mut);
+
+  Entry *e = find(id)->get();
+
+  if (!e->threaded)
+    throw std::runtime_error("Inline packet subscribers don't have a buffer reader.");
+
+  return e->reader;
+}
+
+std::vector<int> PacketSubscribers::getIds()
+{
+  std::lock_guard<std::mutex> lock(mut);
+  std::vector<int> ids;
+
+  for (std::size_t i = 0; i < entries.size(); ++i)
+    ids.push_back(entries[i]->id);
+
+  return ids;
+}
+
+std::string PacketSubscribers::getName(int id)
+{
+  std::lock_guard<std::mutex> lock(mut);
+  return find(id)->get()->name;
+}
+
+void PacketSubscribers::loop(Entry *e)
+{
+  while (e->run)
+  {
+    // Short timeout, so detach() doesn't wait long if the wake up is missed
+    if ( buffer.waitForData(e->reader, 100) )
+    {
+      try
+      {
+        e->sub->process(buffer.getReadPtr(e->reader));
+        buffer.doneReading(e->reader);
+      }
+      catch (std::exception &ex)
+      {
+        std::cout << "PacketSubscribers: Exception caught in subscriber '" << e->name << "': " << ex.what() << std::endl;
+
+        // Don't keep the claim on the packet, the writer could not reuse its slot
+        if (!buffer.isEmpty(e->reader))
+          buffer.doneReading(e->reader);
+      }
+    }
+  }
+}
+
+void PacketSubscribers::updateInline()
+{
+  std::shared_ptr<List> subs = std::make_shared<List>();
+
+  for (std::size_t i = 0; i < entries.size(); ++i)
+    if (!entries[i]->threaded)
+      subs->push_back(entries[i]->sub);
+
+  std::atomic_store(&inlineSubs, std::shared_ptr<const List>(subs));
+}
+
+std::vector<std::unique_ptr<PacketSubscribers::Entry>>::iterator PacketSubscribers::find(int id)
+{
+  for (std::vector<std::unique_ptr<Entry>>::iterator it = entries.begin(); it != entries.end(); ++it)
+    if ((*it)->id == id)
+      return it;
+
+  throw std::runtime_error("Unknown packet subscriber id.");
+}
@@ -0,0 +1,312 @@
+#include "sample_codec.h"
+#include "common.h"
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SAMPLE_CODEC_HAVE_X86
+#endif
+
+static const std::size_t lanes = 8;
+static const std::size_t rows  = SampleCodecBlock / lanes;  // Values per lane
+
+static inline uint32_t zigzag(avgdata_t d)
+{
+  return((static_cast<uint32_t>(d) << 1) ^ static_cast<uint32_t>(d >> 31));
+}
+
+static inline avgdata_t unzigzag(uint32_t z)
+{
+  return(static_cast<avgdata_t>((z >> 1) ^ (0u - (z & 1))));
+}
+
+static inline uint width_of(uint32_t v)
+{
+  return(v ? 32 - __builtin_clz(v) : 0);
+}
+
+std::size_t sample_encode_scalar(const avgdata_t *in, avgdata_t prev, uint8_t *out)
+{
+  uint32_t z[SampleCodecBlock];
+  uint32_t all = 0;
+
+  for (std::size_t i = 0; i < SampleCodecBlock; ++i)
+  {
+    // Wrapping difference, the decoder wraps back
+    z[i] = zigzag(static_cast<avgdata_t>(static_cast<uint32_t>(in[i]) - static_cast<uint32_t>(prev)));
+    all |= z[i];
+    prev = in[i];
+  }
+
+  uint b = width_of(all);
+  out[0] = b;
+
+  uint32_t *w = reinterpret_cast<uint32_t*>(out + 1);
+
+  for (std::size_t l = 0; l < lanes && b; ++l)
+  {
+    uint64_t    acc  = 0;
+    uint        bits = 0;
+    std::size_t k    = 0;
+
+    for (std::size_t i = 0; i < rows; ++i)
+    {
+      acc  |= static_cast<uint64_t>(z[i * lanes + l]) << bits;
+      bits += b;
+
+      if (bits >= 32)
+      {
+        uint32_t word = static_cast<uint32_t>(acc);
+        memcpy(&w[k++ * lanes + l], &word, 4);
+        acc  >>= 32;
+        bits  -= 32;
+      }
+    }
+  }
+
+  return(1 + 32 * b);
+}
+
+void sample_decode_scalar(const uint8_t *in, avgdata_t prev, avgdata_t *out)
+{
+  uint           b    = in[0];
+  uint32_t       mask = (b == 32) ? 0xffffffffu : ((1u << b) - 1);
+  const uint8_t *w    = in + 1;
+  uint32_t       z[SampleCodecBlock];
+
+  for (std::size_t l = 0; l < lanes; ++l)
+  {
+    uint64_t    acc  = 0;
+    uint        bits = 0;
+    std::size_t k    = 0;
+
+    for (std::size_t i = 0; i < rows; ++i)
+    {
+      if (bits < b)
+      {
+        uint32_t word;
+        memcpy(&word, &w[(k++ * lanes + l) * 4], 4);
+        acc  |= static_cast<uint64_t>(word) << bits;
+        bits += 32;
+      }
+
+      z[i * lanes + l] = static_cast<uint32_t>(acc) & mask;
+      acc  >>= b;
+      bits  -= b;
+    }
+  }
+
+  for (std::size_t i = 0; i < SampleCodecBlock; ++i)
+  {
+    prev   = static_cast<avgdata_t>(static_cast<uint32_t>(prev) + static_cast<uint32_t>(unzigzag(z[i])));
+    out[i] = prev;
+  }
+}
+
+#ifdef SAMPLE_CODEC_HAVE_X86
+
+// One row of 8 consecutive samples per vector. The differences of a row are taken against
+// the same row shifted by one sample; the first row gets 'prev' in its first lane.
+__attribute__((target("avx2")))
+std::size_t sample_encode_avx2(const avgdata_t *in, avgdata_t prev, uint8_t *out)
+{
+  __m256i z[rows];
+  __m256i all = _mm256_setzero_si256();
+
+  avgdata_t first[lanes];
+  first[0] = prev;
+  memcpy(first + 1, in, (lanes - 1) * sizeof(avgdata_t));
+
+  for (std::size_t i = 0; i < rows; ++i)
+  {
+    __m256i cur = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i * lanes));
+    __m256i pre = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(i ? in + i * lanes - 1 : first));
+    __m256i d   = _mm256_sub_epi32(cur, pre);
+
+    z[i] = _mm256_xor_si256(_mm256_slli_epi32(d, 1), _mm256_srai_epi32(d, 31));
+    all  = _mm256_or_si256(all, z[i]);
+  }
+
+  uint32_t r[lanes];
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(r), all);
+
+  uint b = width_of(r[0] | r[1] | r[2] | r[3] | r[4] | r[5] | r[6] | r[7]);
+  out[0] = b;
+
+  if (!b)
+    return(1);
+
+  __m256i    *w    = reinterpret_cast<__m256i*>(out + 1);
+  __m256i     acc  = _mm256_setzero_si256();
+  uint        bits = 0;
+
+  for (std::size_t i = 0; i < rows; ++i)
+  {
+    acc   = _mm256_or_si256(acc, _mm256_sll_epi32(z[i], _mm_cvtsi32_si128(bits)));
+    bits += b;
+
+    if (bits >= 32)
+    {
+      _mm256_storeu_si256(w++, acc);
+      bits -= 32;
+
+      // The high bits of this value that didn't fit. A shift by 32 or more gives 0.
+      acc = _mm256_srl_epi32(z[i], _mm_cvtsi32_si128(bits ? b - bits : 32));
+    }
+  }
+
+  return(1 + 32 * b);
+}
+
+__attribute__((target("avx2")))
+void sample_decode_avx2(const uint8_t *in, avgdata_t prev, avgdata_t *out)
+{
+  uint           b    = in[0];
+  const __m256i *w    = reinterpret_cast<const __m256i*>(in + 1);
+  const __m256i  mask = _mm256_set1_epi32((b == 32) ? 0xffffffffu : ((1u << b) - 1));
+  const __m256i  one  = _mm256_set1_epi32(1);
+  uint32_t       d[SampleCodecBlock];
+
+  for (std::size_t i = 0; i < rows; ++i)
+  {
+    __m256i v = _mm256_setzero_si256();
+
+    if (b)
+    {
+      uint bit = i * b;
+      uint k   = bit >> 5;
+      uint s   = bit & 31;
+
+      v = _mm256_srl_epi32(_mm256_loadu_si256(w + k), _mm_cvtsi32_si128(s));
+
+      if (s + b > 32)
+        v = _mm256_or_si256(v, _mm256_sll_epi32(_mm256_loadu_si256(w + k + 1), _mm_cvtsi32_si128(32 - s)));
+
+      v = _mm256_and_si256(v, mask);
+    }
+
+    // Zigzag back: (z >> 1) ^ -(z & 1)
+    v = _mm256_xor_si256(_mm256_srli_epi32(v, 1), _mm256_sub_epi32(_mm256_setzero_si256(), _mm256_and_si256(v, one)));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(d + i * lanes), v);
+  }
+
+  uint32_t acc = static_cast<uint32_t>(prev);
+
+  for (std::size_t i = 0; i < SampleCodecBlock; ++i)
+  {
+    acc   += d[i];
+    out[i] = static_cast<avgdata_t>(acc);
+  }
+}
+
+#else
+
+// Vector kernels are x86 only. Keep the symbols so callers don't need to care.
+std::size_t sample_encode_avx2(const avgdata_t *in, avgdata_t prev, uint8_t *out)
+{
+  return(sample_encode_scalar(in, prev, out));
+}
+
+void sample_decode_avx2(const uint8_t *in, avgdata_t prev, avgdata_t *out)
+{
+  sample_decode_scalar(in, prev, out);
+}
+
+#endif
+
+static sample_encode_kernel_t encode_kernel(void)
+{
+  static const sample_encode_kernel_t k = cpu_has_avx2() ? sample_encode_avx2 : sample_encode_scalar;
+  return(k);
+}
+
+static sample_decode_kernel_t decode_kernel(void)
+{
+  static const sample_decode_kernel_t k = cpu_has_avx2() ? sample_decode_avx2 : sample_decode_scalar;
+  return(k);
+}
+
+std::size_t sample_codec_bound(std::size_t n)
+{
+  return(4 + (n + SampleCodecBlock - 1) / SampleCodecBlock * (1 + 32 * 32));
+}
+
+std::size_t encode_samples(const avgdata_t *in, std::size_t n, uint8_t *out)
+{
+  sample_encode_kernel_t encode = encode_kernel();
+
+  if (!n)
+    return(0);
+
+  memcpy(out, in, 4);
+
+  std::size_t len  = 4;
+  avgdata_t   prev = in[0];
+  std::size_t i    = 0;
+
+  for (; i + SampleCodecBlock <= n; i += SampleCodecBlock)
+  {
+    len  += encode(in + i, prev, out + len);
+    prev  = in[i + SampleCodecBlock - 1];
+  }
+
+  if (i < n)
+  {
+    // Last block, padded by repeating the last sample
+    avgdata_t tail[SampleCodecBlock];
+    memcpy(tail, in + i, (n - i) * sizeof(avgdata_t));
+
+    for (std::size_t j = n - i; j < SampleCodecBlock; ++j)
+      tail[j] = in[n - 1];
+
+    len += encode(tail, prev, out + len);
+  }
+
+  return(len);
+}
+
+bool decode_samples(const uint8_t *in, std::size_t length, std::size_t n, avgdata_t *out)
+{
+  sample_decode_kernel_t decode = decode_kernel();
+
+  if (!n)
+    return(length == 0);
+
+  if (length < 4)
+    return(false);
+
+  avgdata_t prev;
+  memcpy(&prev, in, 4);
+
+  std::size_t pos = 4;
+
+  for (std::size_t i = 0; i < n; i += SampleCodecBlock)
+  {
+    if ((pos >= length) || (in[pos] > 32) || (pos + 1 + 32 * in[pos] > length))
+      return(false);
+
+    std::size_t size = 1 + 32 * in[pos];
+
+    if (i + SampleCodecBlock <= n)
+      decode(in + pos, prev, out + i);
+    else
+    {
+      avgdata_t tail[SampleCodecBlock];
+      decode(in + pos, prev, tail);
+      memcpy(out + i, tail, (n - i) * sizeof(avgdata_t));
+    }
+
+    prev  = out[(i + SampleCodecBlock <= n) ? i + SampleCodecBlock - 1 : n - 1];
+    pos  += size;
+  }
+
+  return(pos == length);
+}
+
+const char *sample_codec_kernel_name(void)
+{
+  if (encode_kernel() == sample_encode_avx2)
+    return("avx2");
+
+  return("scalar");
+}
@@ -0,0 +1,430 @@
+#include "smurf_file_reader.h"
+#include "sample_codec.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+
+SmurfFileMap::SmurfFileMap(const std::string &name)
+:
+  addr ( NULL ),
+  size ( 0    )
+{
+  int fd = ::open(name.c_str(), O_RDONLY);
+
+  if (fd < 0)
+    throw std::runtime_error("Could not open " + name + ": " + strerror(errno));
+
+  struct stat st;
+
+  if (fstat(fd, &st) < 0)
+  {
+    int err = errno;
+    ::close(fd);
+    throw std::runtime_error("Could not get the size of " + name + ": " + strerror(err));
+  }
+
+  size = st.st_size;
+
+  if (size)
+  {
+    void *p = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+
+    if (p == MAP_FAILED)
+    {
+      int err = errno;
+      ::close(fd);
+      throw std::runtime_error("Could not map " + name + ": " + strerror(err));
+    }
+
+    addr = static_cast<const uint8_t*>(p);
+  }
+
+  ::close(fd);  // the mapping stays
+}
+
+SmurfFileMap::~SmurfFileMap()
+{
+  if (addr)
+    munmap(const_cast<uint8_t*>(addr), size);
+}
+
+// Packet over memory owned by someone else: the file mapping, or a buffer the packet was put
+// back together in
+class SharedSmurfPacket : public ISmurfPacket_RO
+{
+public:
+  SharedSmurfPacket(const std::shared_ptr<const void> &o, const uint8_t *p, std::size_t n)
+  :
+    ISmurfPacket_RO ( p, n ),
+    owner           ( o    )
+  {
+  }
+
+  virtual ~SharedSmurfPacket() {};
+
+private:
+  std::shared_ptr<const void> owner;
+};
+
+SmurfFileReader::SmurfFileReader(const std::string &name)
+:
+  map         ( std::make_shared<SmurfFileMap>(name) ),
+  columnar    ( false ),
+  codec       ( ColumnarCodecNone ),
+  numFrames   ( 0     ),
+  maxChannels ( 0     ),
+  entries     (       ),
+  fields      (       ),
+  fieldStart  (       ),
+  fieldOf     ( hfCount, -1 ),
+  cacheMutex  (       ),
+  cacheEntry  ( static_cast<std::size_t>(-1) ),
+  cache       (       )
+{
+  columnar = (map->length() >= 8) && !memcmp(map->data(), "SMURFCOL", 8);
+
+  if (columnar)
+    indexColumnar();
+  else
+    indexRaw();
+}
+
+void SmurfFileReader::indexRaw()
+{
+  const uint8_t *d = map->data();
+  std::size_t    n = map->length();
+  std::size_t    o = 0;
+
+  // The packets are read in order, let the kernel read ahead
+  if (n)
+    madvise(const_cast<uint8_t*>(d), n, MADV_SEQUENTIAL);
+
+  while (o + smurfheaderlength <= n)
+  {
+    uint32_t ch = getHeaderField<hfNumberChannels, uint32_t>(d + o);
+
+    // A packet cut short, by a writer still running or stopped, ends the file
+    if ((ch > smurf_max_channels) || (o + smurfheaderlength + ch * sizeof(avgdata_t) > n))
+      break;
+
+    Entry e = { o, 1, ch, numFrames, smurfheaderlength };
+    entries.push_back(e);
+
+    maxChannels = std::max<std::size_t>(maxChannels, ch);
+    ++numFrames;
+    o += smurfheaderlength + ch * sizeof(avgdata_t);
+  }
+
+  if (n)
+    madvise(const_cast<uint8_t*>(d), n, MADV_NORMAL);
+}
+
+void SmurfFileReader::indexColumnar()
+{
+  const uint8_t *d = map->data();
+  std::size_t    n = map->length();
+
+  if (n < sizeof(ColumnarFileHeader))
+    throw std::runtime_error("Columnar file too short.");
+
+  ColumnarFileHeader h;
+  memcpy(&h, d, sizeof(h));
+
+  if (h.version != ColumnarVersion)
+    throw std::runtime_error("Columnar file of an unsupported version.");
+
+  if ((h.codec != ColumnarCodecNone) && (h.codec != ColumnarCodecDelta))
+    throw std::runtime_error("Columnar file with an unknown codec.");
+
+  std::size_t start = (sizeof(h) + h.numFields * sizeof(ColumnarFieldDesc) + ColumnarAlign - 1) / ColumnarAlign * ColumnarAlign;
+
+  if ((h.numFields > 256) || (start > n))
+    throw std::runtime_error("Columnar file header corrupted.");
+
+  codec = h.codec;
+  fields.resize(h.numFields);
+  memcpy(fields.data(), d + sizeof(h), h.numFields * sizeof(ColumnarFieldDesc));
+
+  // Match the header columns to the fields of this version's layout, by their place in the header
+  std::size_t w = 0;
+
+  for (std::size_t f = 0; f < fields.size(); ++f)
+  {
+    fieldStart.push_back(w);
+    w += fields[f].width;
+
+    for (std::size_t g = 0; g < hfCount; ++g)
+      if ((smurfHeaderLayoutV1[g].offset == fields[f].offset) && (smurfHeaderLayoutV1[g].width == fields[f].width))
+        fieldOf[g] = f;
+  }
+
+  // The chunks, from the index if the file was closed, else by walking them
+  std::vector<ColumnarIndexEntry> index;
+  ColumnarTrailer t;
+
+  if (n >= start + sizeof(t))
+    memcpy(&t, d + n - sizeof(t), sizeof(t));
+
+  if ((n >= start + sizeof(t)) && !memcmp(t.magic, "SMURFIDX", 8) && (t.indexOffset >= start) &&
+      (t.indexOffset + t.numChunks * sizeof(ColumnarIndexEntry) + sizeof(t) == n))
+  {
+    index.resize(t.numChunks);
+    memcpy(index.data(), d + t.indexOffset, t.numChunks * sizeof(ColumnarIndexEntry));
+  }
+  else
+  {
+    for (std::size_t o = start; o + sizeof(ColumnarChunkHeader) <= n; )
+    {
+      ColumnarChunkHeader c;
+      memcpy(&c, d + o, sizeof(c));
+
+      if (memcmp(c.magic, "CHNK", 4) || (c.length < sizeof(c)) || (c.length > n - o))
+        break;
+
+      ColumnarIndexEntry e;
+      memset(&e, 0, sizeof(e));
+      e.offset      = o;
+      e.length      = c.length;
+      e.numFrames   = c.numFrames;
+      e.numChannels = c.numChannels;
+      index.push_back(e);
+
+      o += c.length;
+    }
+  }
+
+  for (std::size_t i = 0; i < index.size(); ++i)
+  {
+    const ColumnarIndexEntry &x = index[i];
+    ColumnarChunkHeader c;
+
+    if ((x.offset > n) || (x.length > n - x.offset) || (x.length < sizeof(c)))
+      throw std::runtime_error("Columnar file index corrupted.");
+
+    memcpy(&c, d + x.offset, sizeof(c));
+
+    std::size_t payload = c.numChannels * sizeof(avgdata_t) * c.numFrames;
+
+    if (codec == ColumnarCodecDelta)
+      payload = (c.numChannels + 1) * sizeof(uint32_t);
+
+    if (memcmp(c.magic, "CHNK", 4) || (c.numFrames != x.numFrames) || (c.numChannels != x.numChannels) ||
+        (c.numChannels > smurf_max_channels) || (c.payloadOffset < sizeof(c) + w * c.numFrames) ||
+        (c.payloadOffset + payload > x.length))
+      throw std::runtime_error("Columnar file chunk corrupted.");
+
+    Entry e = { x.offset, c.numFrames, c.numChannels, numFrames, c.payloadOffset };
+    entries.push_back(e);
+
+    maxChannels  = std::max<std::size_t>(maxChannels, c.numChannels);
+    numFrames   += c.numFrames;
+  }
+}
+
+const SmurfFileReader::Entry &SmurfFileReader::find(std::size_t frame) const
+{
+  if (frame >= numFrames)
+    throw std::out_of_range("Trying to read a frame past the end of the file.");
+
+  if (!columnar)
+    return entries[frame];
+
+  // Last chunk starting at or before 'frame'
+  std::vector<Entry>::const_iterator it = std::upper_bound(entries.begin(), entries.end(), frame,
+    [](std::size_t f, const Entry &e) { return f < e.firstFrame; });
+
+  return *(it - 1);
+}
+
+std::size_t SmurfFileReader::getNumChannels(std::size_t frame) const
+{
+  return find(frame).numChannels;
+}
+
+const avgdata_t *SmurfFileReader::column(const Entry &e, std::size_t channel, std::vector<avgdata_t> &tmp) const
+{
+  const uint8_t *p = map->data() + e.offset + e.payloadOffset;
+
+  if (codec == ColumnarCodecNone)
+    return reinterpret_cast<const avgdata_t*>(p) + channel * e.numFrames;
+
+  uint32_t from, to;
+  memcpy(&from, p + channel * sizeof(uint32_t), 4);
+  memcpy(&to,   p + (channel + 1) * sizeof(uint32_t), 4);
+
+  tmp.resize(e.numFrames);
+
+  if ((from > to) || (e.offset + e.payloadOffset + to > map->length()) ||
+      !decode_samples(p + from, to - from, e.numFrames, tmp.data()))
+    throw std::runtime_error("Columnar file column corrupted.");
+
+  return tmp.data();
+}
+
+const uint8_t *SmurfFileReader::headerColumn(const Entry &e, std::size_t field) const
+{
+  return map->data() + e.offset + sizeof(ColumnarChunkHeader) + fieldStart[field] * e.numFrames;
+}
+
+SmurfPacket_RO SmurfFileReader::getPacket(std::size_t frame) const
+{
+  const Entry &e = find(frame);
+
+  if (!columnar)
+    return std::make_shared<SharedSmurfPacket>(map, map->data() + e.offset, e.numChannels);
+
+  // Put the packet back together: the header fields, then one value of each column
+  std::shared_ptr<std::vector<uint8_t> > b = std::make_shared<std::vector<uint8_t> >(smurfheaderlength + e.numChannels * sizeof(avgdata_t), 0);
+  std::size_t i = frame - e.firstFrame;
+
+  for (std::size_t f = 0; f < fields.size(); ++f)
+    if (fields[f].offset + fields[f].width <= smurfheaderlength)
+      memcpy(b->data() + fields[f].offset, headerColumn(e, f) + i * fields[f].width, fields[f].width);
+
+  avgdata_t *out = reinterpret_cast<avgdata_t*>(b->data() + smurfheaderlength);
+
+  if (codec == ColumnarCodecNone)
+  {
+    for (std::size_t c = 0; c < e.numChannels; ++c)
+      memcpy(out + c, map->data() + e.offset + e.payloadOffset + (c * e.numFrames + i) * sizeof(avgdata_t), sizeof(avgdata_t));
+  }
+  else
+  {
+    // Decode the whole chunk once, the next packets are most likely from it too
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    std::size_t idx = &e - entries.data();
+
+    if (cacheEntry != idx)
+    {
+      std::vector<avgdata_t> tmp;
+      cacheEntry = static_cast<std::size_t>(-1);
+      cache.resize(e.numChannels * e.numFrames);
+
+      for (std::size_t c = 0; c < e.numChannels; ++c)
+        memcpy(&cache[c * e.numFrames], column(e, c, tmp), e.numFrames * sizeof(avgdata_t));
+
+      cacheEntry = idx;
+    }
+
+    for (std::size_t c = 0; c < e.numChannels; ++c)
+      out[c] = cache[c * e.numFrames + i];
+  }
+
+  return std::make_shared<SharedSmurfPacket>(b, b->data(), e.numChannels);
+}
+
+std::size_t SmurfFileReader::readChannel(std::size_t channel, std::size_t first, std::size_t count, avgdata_t *out) const
+{
+  if (first >= numFrames)
+    return 0;
+
+  count = std::min(count, numFrames - first);
+
+  if (!columnar)
+  {
+    const uint8_t *d = map->data();
+
+    for (std::size_t i = 0; i < count; ++i)
+    {
+      const Entry &e = entries[first + i];
+
+      if (channel < e.numChannels)
+        memcpy(out + i, d + e.offset + smurfheaderlength + channel * sizeof(avgdata_t), sizeof(avgdata_t));
+      else
+        out[i] = 0;
+    }
+
+    return count;
+  }
+
+  std::vector<avgdata_t> tmp;
+  std::size_t            done = 0;
+
+  while (done < count)
+  {
+    const Entry &e    = find(first + done);
+    std::size_t  from = first + done - e.firstFrame;
+    std::size_t  n    = std::min<std::size_t>(e.numFrames - from, count - done);
+
+    if (channel < e.numChannels)
+      memcpy(out + done, column(e, channel, tmp) + from, n * sizeof(avgdata_t));
+    else
+      memset(out + done, 0, n * sizeof(avgdata_t));
+
+    done += n;
+  }
+
+  return count;
+}
+
+std::size_t SmurfFileReader::readHeaderField(SmurfHeaderField field, std::size_t first, std::size_t count, uint64_t *out) const
+{
+  if (field >= hfCount)
+    throw std::out_of_range("Trying to read an unknown header field.");
+
+  SmurfHeaderFieldDesc desc = smurfHeaderLayoutV1[field];
+
+  if (desc.width > sizeof(uint64_t))
+    throw std::runtime_error("Trying to read a header field wider than 8 bytes.");
+
+  if (first >= numFrames)
+    return 0;
+
+  count = std::min(count, numFrames - first);
+
+  if (!columnar)
+  {
+    for (std::size_t i = 0; i < count; ++i)
+    {
+      out[i] = 0;
+      memcpy(out + i, map->data() + entries[first + i].offset + desc.offset, desc.width);
+    }
+
+    return count;
+  }
+
+  std::size_t done = 0;
+
+  while (done < count)
+  {
+    const Entry &e    = find(first + done);
+    std::size_t  from = first + done - e.firstFrame;
+    std::size_t  n    = std::min<std::size_t>(e.numFrames - from, count - done);
+
+    for (std::size_t i = 0; i < n; ++i)
+    {
+      out[done + i] = 0;
+
+      if (fieldOf[field] >= 0)
+        memcpy(out + done + i, headerColumn(e, fieldOf[field]) + (from + i) * desc.width, desc.width);
+    }
+
+    done += n;
+  }
+
+  return count;
+}
+
+std::size_t SmurfFileReader::findUnixTime(uint64_t t) const
+{
+  std::size_t lo = 0;
+  std::size_t hi = numFrames;
+
+  while (lo < hi)
+  {
+    std::size_t mid = lo + (hi - lo) / 2;
+    uint64_t    v;
+
+    readHeaderField(hfUnixTime, mid, 1, &v);
+
+    if (v < t)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return lo;
+}
@@ -0,0 +1,88 @@
+#include "smurf_file_reader_py.h"
+#include <rogue/GilRelease.h>
+
+SmurfFileReaderPy::SmurfFileReaderPy(const std::string &name)
+{
+  rogue::GilRelease noGil;  // indexing reads the whole file, for a raw one
+  reader = std::make_shared<SmurfFileReader>(name);
+}
+
+std::size_t SmurfFileReaderPy::frames(std::size_t first, long count)
+{
+  std::size_t n = reader->getNumFrames();
+  std::size_t left = (first < n) ? n - first : 0;
+
+  return ((count < 0) || (static_cast<std::size_t>(count) > left)) ? left : count;
+}
+
+bp::object SmurfFileReaderPy::getHeader(std::size_t frame)
+{
+  SmurfPacket_RO  p = reader->getPacket(frame);
+  SmurfPacketView v = p->getView();
+
+  return bp::object(bp::handle<>(PyBytes_FromStringAndSize(reinterpret_cast<const char*>(v.header), v.headerLength)));
+}
+
+bp::object SmurfFileReaderPy::getPayload(std::size_t frame)
+{
+  SmurfPacket_RO  p = reader->getPacket(frame);
+  SmurfPacketView v = p->getView();
+
+  return bp::object(bp::handle<>(PyBytes_FromStringAndSize(reinterpret_cast<const char*>(v.payload), v.payloadLength * sizeof(avgdata_t))));
+}
+
+bp::object SmurfFileReaderPy::readChannel(std::size_t channel, std::size_t first, long count)
+{
+  std::size_t n = frames(first, count);
+  bp::object  b(bp::handle<>(PyBytes_FromStringAndSize(NULL, n * sizeof(avgdata_t))));
+  avgdata_t  *out = reinterpret_cast<avgdata_t*>(PyBytes_AS_STRING(b.ptr()));
+
+  {
+    // The bytes object is not shared yet, so it can be filled without the GIL
+    rogue::GilRelease noGil;
+    reader->readChannel(channel, first, n, out);
+  }
+
+  return b;
+}
+
+std::size_t SmurfFileReaderPy::readChannelInto(std::size_t channel, std::size_t first, bp::object buffer)
+{
+  Py_buffer view;
+
+  if (PyObject_GetBuffer(buffer.ptr(), &view, PyBUF_WRITABLE | PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) < 0)
+    bp::throw_error_already_set();
+
+  if ((view.itemsize != sizeof(avgdata_t)) || (view.format && strcmp(view.format, "i") && strcmp(view.format, "<i") && strcmp(view.format, "=i")))
+  {
+    PyBuffer_Release(&view);
+    throw std::runtime_error("Trying to read a channel into a buffer which is not of int32.");
+  }
+
+  std::size_t n = frames(first, view.len / sizeof(avgdata_t));
+
+  {
+    rogue::GilRelease noGil;
+    reader->readChannel(channel, first, n, static_cast<avgdata_t*>(view.buf));
+  }
+
+  PyBuffer_Release(&view);
+  return n;
+}
+
+bp::object SmurfFileReaderPy::readHeaderField(int field, std::size_t first, long count)
+{
+  if ((field < 0) || (field >= hfCount))
+    throw std::runtime_error("Trying to read an unknown header field.");
+
+  std::size_t n = frames(first, count);
+  bp::object  b(bp::handle<>(PyBytes_FromStringAndSize(NULL, n * sizeof(uint64_t))));
+  uint64_t   *out = reinterpret_cast<uint64_t*>(PyBytes_AS_STRING(b.ptr()));
+
+  {
+    rogue::GilRelease noGil;
+    reader->readHeaderField(static_cast<SmurfHeaderField>(field), first, n, out);
+  }
+
+  return b;
+}
@@ -1,4 +1,43 @@
 #include "smurf_packet.h"
+#include <errno.h>
+#include <mutex>
+
+// Size of a packet block: the header and the largest payload, rounded up to whole cache lines
+static const std::size_t packetBlockSize = (smurfheaderlength + smurf_max_channels * sizeof(avgdata_t) + cache_line_size - 1) / cache_line_size * cache_line_size;
+
+// Pool of packet blocks. Packets are created up front by the packet buffer, so this is not on the
+// frame path; the pool keeps the blocks of destroyed packets for the next ones. It is never
+// destroyed, as packets can outlive the static objects at exit.
+static std::mutex            &packetPoolMutex = *new std::mutex;
+static std::vector<uint8_t*> &packetPool      = *new std::vector<uint8_t*>;
+
+static uint8_t* packetBlockAlloc()
+{
+  {
+    std::lock_guard<std::mutex> lock(packetPoolMutex);
+
+    if (!packetPool.empty())
+    {
+      uint8_t *b = packetPool.back();
+      packetPool.pop_back();
+      return b;
+    }
+  }
+
+  uint8_t *b = static_cast<uint8_t*>(cache_aligned_malloc(packetBlockSize));
+
+  if (!b)
+    throw std::bad_alloc();
+
+  memset(b, 0, packetBlockSize);
+  return b;
+}
+
+static void packetBlockFree(uint8_t *b)
+{
+  std::lock_guard<std::mutex> lock(packetPoolMutex);
+  packetPool.push_back(b);
+}
 
 ////////////////////////////////////////
 ////// + SmurfHeader definitions ///////
@@ -7,6 +46,8 @@
 // Decodes information in the header part of the data from smurf
 SmurfHeader::SmurfHeader()
 {
+  header = NULL;
+  memset(&f, 0, sizeof(f));
 
   last_frame_count = 0;
   first_cycle = 1;
@@ -32,155 +73,60 @@ void SmurfHeader::copy_header(uint8_t *buffer)
 {
   header = buffer;  // just move the pointer
   data_ok = true;  // This is where we first get new data so star with header OK.
+  decode();  // once per frame, the getters read the decoded fields
 }
 
 
-uint SmurfHeader::get_version(void)
-{
-  return(pull_bit_field(header, h_version_offset, h_version_width));
-}
-
-
-uint SmurfHeader::get_frame_counter(void)
-{
-  return(pull_bit_field(header, h_frame_counter_offset, h_frame_counter_width));
-}
-
-uint SmurfHeader::get_1hz_counter(void)
-{
-  return(pull_bit_field(header, h_1hz_counter_offset, h_1hz_counter_width));
-}
-
-uint SmurfHeader::get_ext_counter(void)
-{
-  return(pull_bit_field(header, h_ext_counter_offset, h_ext_counter_width));
-}
-
-uint SmurfHeader::get_syncword(void)
-{
-  uint64_t x;
-  x = pull_bit_field(header, h_mce_syncword_offset, h_mce_syncword_width);
-  return(x & 0xFFFFFFFF);  // pull out the counter.
-}
-
-uint SmurfHeader::get_epics_seconds(void)
-{
-  uint64_t x;
-  x = pull_bit_field(header, h_epics_s_offset, h_epics_s_width);
-  return(x & 0xFFFFFFFF);  // pull out the counter.
-}
-
-uint SmurfHeader::get_epics_nanoseconds(void)
-{
-  uint64_t x;
-  x = pull_bit_field(header, h_epics_ns_offset, h_epics_ns_width);
-  return(x & 0xFFFFFFFF);  // pull out the counter.
-}
-
-uint SmurfHeader::get_clear_bit(void)
-{
-  uint64_t x;
-  x = pull_bit_field(header,  h_user0a_ctrl_offset, h_user0a_ctrl_width);
-  return((x & (1 << h_ctrl_bit_clear))? 1 : 0);
-}
-
-uint SmurfHeader::disable_file_write(void)
-{
-  uint64_t x;
-  x = pull_bit_field(header,  h_user0a_ctrl_offset, h_user0a_ctrl_width);
-  return((x & (1 << h_ctrl_bit_disable_file))? 1 : 0);
-}
-
-uint SmurfHeader::disable_stream(void) //
-{
-  uint64_t x;
-  x = pull_bit_field(header,  h_user0a_ctrl_offset, h_user0a_ctrl_width);
-  return((x & (1 <<  h_ctrl_bit_disable_stream))? 1 :0);
-}
-
-
-uint SmurfHeader::get_test_mode(void)
+void SmurfHeader::decode(void)
 {
-  uint x;
-  x = pull_bit_field(header, h_user0a_ctrl_offset, h_user0a_ctrl_width);
-  return((x & (0xF <<  h_ctrl_nibble_test_modes)) >>  4);
-}
-
-uint SmurfHeader::get_num_rows(void)
-{
-  uint x;
-  x = pull_bit_field(header, h_num_rows_offset, h_num_rows_width);
-  // return(x ? x: MCEheader_num_rows_value);  // if zero go to default
-  return(x ? x: 33); // Not sure what to do here.
-}
-
-uint SmurfHeader::get_num_rows_reported(void)
-{
-  uint x;
-  x = pull_bit_field(header, h_num_rows_reported_offset, h_num_rows_reported_width);
-  // return(x ? x: MCEheader_num_rows_reported_value);
-  return(x ? x: 33); // Not sure what to do here.
-
-}
-
-uint SmurfHeader::get_row_len(void)
-{
-  uint x;
-  x = pull_bit_field(header, h_row_len_offset, h_row_len_width);
-  // return(x ? x: MCEheader_row_len_value);
-  return(x ? x: 60); // Not sure what to do here.
-}
-
-uint SmurfHeader::get_data_rate(void)
-{
-  uint x;
-  x = pull_bit_field(header, h_data_rate_offset, h_data_rate_width);
-  // return(x ? x: MCEheader_data_rate_value);
-  return(x ? x: 140); // Not sure what to do here.
-}
+  uint64_t epics     = getHeaderField<hfCounter2, uint64_t>(header);
 
+  f.version           = getHeaderField<hfVersion, uint8_t>(header);
+  f.num_channels      = getHeaderField<hfNumberChannels, uint32_t>(header);
+  f.unix_time         = getHeaderField<hfUnixTime, uint64_t>(header);
+  f.counter_1hz       = getHeaderField<hfCounter0, uint32_t>(header);
+  f.ext_counter       = getHeaderField<hfCounter1, uint32_t>(header);
+  f.epics_nanoseconds = epics & 0xFFFFFFFF;
+  f.epics_seconds     = epics >> 32;
+  f.frame_counter     = getHeaderField<hfFrameCounter, uint32_t>(header);
+  f.syncword          = getHeaderField<hfExternalTimeClock, uint64_t>(header);
+  f.ctrl              = getHeaderField<hfControlField, uint8_t>(header);
+  f.test_parameter    = getHeaderField<hfTestParameters, uint8_t>(header);
+  f.num_rows          = getHeaderField<hfNumberRows, uint16_t>(header);
+  f.num_rows_reported = getHeaderField<hfNumberRowsReported, uint16_t>(header);
+  f.row_len           = getHeaderField<hfRowLength, uint16_t>(header);
+  f.data_rate         = getHeaderField<hfDataRate, uint16_t>(header);
 
-uint SmurfHeader::get_test_parameter(void)
-{
-  uint x;
-  x = pull_bit_field(header, h_user0b_ctrl_offset , h_user0b_ctrl_width);
-  return(x);
+  f.clear_bit          = f.ctrl & (1 << h_ctrl_bit_clear);
+  f.disable_stream     = f.ctrl & (1 << h_ctrl_bit_disable_stream);
+  f.disable_file_write = f.ctrl & (1 << h_ctrl_bit_disable_file);
+  f.read_config_file   = f.ctrl & (1 << h_ctrl_bit_read_config);
+  f.test_mode          = (f.ctrl >> h_ctrl_nibble_test_modes) & 0xF;
 }
 
 void SmurfHeader::set_num_channels(uint32_t num_ch)
 {
-  put_field(h_num_channels_offset, h_num_channels_offset, &num_ch);
-}
-
-uint32_t SmurfHeader::get_num_channels()
-{
-  return(pull_bit_field(header, h_num_channels_offset, h_num_channels_width));
+  put_field(h_num_channels_offset, h_num_channels_width, &num_ch);
 }
 
 void SmurfHeader::put_field(int offset, int width, void *data)
 {
   memcpy(header+offset, data, width); // not protected, proabably  a bad idea.
-}
 
-uint SmurfHeader::read_config_file(void)
-{
-  uint64_t x;
-  x = pull_bit_field(header,  h_user0a_ctrl_offset, h_user0a_ctrl_width);
-  return((x & (1 <<  h_ctrl_bit_read_config))? 1 :0);
+  // The TES biases are written every frame, and are not decoded
+  if ((offset < h_tes_dac_offset) || (offset + width > h_tes_dac_offset + h_tes_dac_width))
+    decode();
 }
 
-
 void SmurfHeader::clear_average(void)
 {
   average_counter=0;
 }
 
-uint SmurfHeader::average_control(int num_averages) // returns num averages when avearaging is done.
+uint SmurfHeader::average_control(int num_averages, uint64_t frame_time) // returns num averages when avearaging is done.
 {
   uint x=0, y;
-  timeb tm;  // wil lhold time imnformation
-  ftime(&tm); // get time
-  bigtimems = tm.millitm  + 1000 * tm.time; // make64 bit milliecond clock
+  bigtimems = frame_time / 1000000; // make64 bit milliecond clock
   unix_dtime = bigtimems - lastbigtime;
   lastbigtime = bigtimems;
 
@@ -232,11 +178,13 @@ ISmurfPacket_RO::ISmurfPacket_RO()
 :
   headerLength(smurfheaderlength),
   payloadLength(smurfsamples),
+  payloadMaxLength(smurf_max_channels),
   packetLength(smurfheaderlength + smurfsamples * sizeof(avgdata_t)),
-  headerBuffer(smurfheaderlength),
-  payloadBuffer(smurfsamples),
-  header(headerBuffer.data()),
-  tba(&headerBuffer.at(headerTESDACOffset))
+  headerBuffer(packetBlockAlloc()),
+  payloadBuffer(reinterpret_cast<avgdata_t*>(headerBuffer + smurfheaderlength)),
+  header(headerBuffer),
+  tba(headerBuffer + smurfHeaderLayoutV1[hfTESDAC].offset),
+  ownsBlock(true)
 {
   std::cout << "ISmurfPacket_RO object created:" << std::endl;
   std::cout << "Header length       = " << headerLength  << " bytes" << std::endl;
@@ -244,8 +192,28 @@ ISmurfPacket_RO::ISmurfPacket_RO()
   std::cout << "Total packet length = " << packetLength  << " bytes" << std::endl;
 }
 
+// Packet view over external memory. Only the read-only interface is available, so the header
+// and payload pointers are never written through.
+ISmurfPacket_RO::ISmurfPacket_RO(const uint8_t *packet, std::size_t length)
+:
+  headerLength(smurfheaderlength),
+  payloadLength(length),
+  payloadMaxLength(length),
+  packetLength(smurfheaderlength + length * sizeof(avgdata_t)),
+  headerBuffer(const_cast<uint8_t*>(packet)),
+  payloadBuffer(reinterpret_cast<avgdata_t*>(headerBuffer + smurfheaderlength)),
+  header(headerBuffer),
+  tba(headerBuffer + smurfHeaderLayoutV1[hfTESDAC].offset),
+  ownsBlock(false)
+{
+}
+
 ISmurfPacket_RO::~ISmurfPacket_RO()
 {
+  if (!ownsBlock)
+    return;
+
+  packetBlockFree(headerBuffer);
   std::cout << "ISmurfPacket_RO object destroyed" << std::endl;
 }
 
@@ -266,27 +234,27 @@ const std::size_t ISmurfPacket_RO::getPacketLength()  const
 
 const uint8_t ISmurfPacket_RO::getVersion() const
 {
-  return getHeaderWord<uint8_t>(headerVersionOffset);
+  return getHeaderWord<hfVersion, uint8_t>();
 }
 
 const uint8_t ISmurfPacket_RO::getCrateID() const
 {
-  return getHeaderWord<uint8_t>(headerCrateIDOffset);
+  return getHeaderWord<hfCrateID, uint8_t>();
 }
 
 const uint8_t ISmurfPacket_RO::getSlotNumber() const
 {
-  return getHeaderWord<uint8_t>(headerSlotNumberOffset);
+  return getHeaderWord<hfSlotNumber, uint8_t>();
 }
 
 const uint8_t ISmurfPacket_RO::getTimingConfiguration() const
 {
-  return getHeaderWord<uint8_t>(headerTimingConfigurationOffset);
+  return getHeaderWord<hfTimingConfiguration, uint8_t>();
 }
 
 const uint32_t ISmurfPacket_RO::getNumberChannels() const
 {
-  return getHeaderWord<uint32_t>(headerNumberChannelOffset);
+  return getHeaderWord<hfNumberChannels, uint32_t>();
 }
 
 const int32_t ISmurfPacket_RO::getTESBias(std::size_t index) const
@@ -296,113 +264,113 @@ const int32_t ISmurfPacket_RO::getTESBias(std::size_t index) const
 
 const uint64_t ISmurfPacket_RO::getUnixTime() const
 {
-  return getHeaderWord<uint64_t>(headerUnixTimeOffset);
+  return getHeaderWord<hfUnixTime, uint64_t>();
 }
 
 const uint32_t ISmurfPacket_RO::getFluxRampIncrement() const
 {
-  return getHeaderWord<uint32_t>(headerFluxRampIncrementOffset);
+  return getHeaderWord<hfFluxRampIncrement, uint32_t>();
 }
 
 const uint32_t ISmurfPacket_RO::getFluxRampOffset() const
 {
-  return getHeaderWord<uint32_t>(headerFluxRampOffsetOffset);
+  return getHeaderWord<hfFluxRampOffset, uint32_t>();
 }
 
 const uint32_t ISmurfPacket_RO::getCounter0() const
 {
-  return getHeaderWord<uint32_t>(headerCounter0Offset);
+  return getHeaderWord<hfCounter0, uint32_t>();
 }
 
 const uint32_t ISmurfPacket_RO::getCounter1() const
 {
-  return getHeaderWord<uint32_t>(headerCounter1Offset);
+  return getHeaderWord<hfCounter1, uint32_t>();
 }
 
 const uint64_t ISmurfPacket_RO::getCounter2() const
 {
-  return getHeaderWord<uint64_t>(headerCounter2Offset);
+  return getHeaderWord<hfCounter2, uint64_t>();
 }
 
 const uint32_t ISmurfPacket_RO::getAveragingResetBits() const
 {
-  return getHeaderWord<uint32_t>(headerAveragingResetBitsOffset);
+  return getHeaderWord<hfAveragingResetBits, uint32_t>();
 }
 
 const uint32_t ISmurfPacket_RO::getFrameCounter() const
 {
-  return getHeaderWord<uint32_t>(headerFrameCounterOffset);
+  return getHeaderWord<hfFrameCounter, uint32_t>();
 }
 
 const uint32_t ISmurfPacket_RO::getTESRelaySetting() const
 {
-  return getHeaderWord<uint32_t>(headerTESRelaySettingOffset);
+  return getHeaderWord<hfTESRelaySetting, uint32_t>();
 }
 
 const uint64_t ISmurfPacket_RO::getExternalTimeClock() const
 {
-  return getHeaderWord<uint64_t>(headerExternalTimeClockOffset);
+  return getHeaderWord<hfExternalTimeClock, uint64_t>();
 }
 
 const uint8_t ISmurfPacket_RO::getControlField() const
 {
-  return getHeaderWord<uint8_t>(headerControlFieldOffset);
+  return getHeaderWord<hfControlField, uint8_t>();
 }
 
 const bool ISmurfPacket_RO::getClearAverageBit() const
 {
-  return getWordBit(getHeaderWord<uint8_t>(headerControlFieldOffset), clearAvergaveBitOffset);
+  return getWordBit(getHeaderWord<hfControlField, uint8_t>(), clearAvergaveBitOffset);
 }
 
 const bool ISmurfPacket_RO::getDisableStreamBit() const
 {
-  return getWordBit(getHeaderWord<uint8_t>(headerControlFieldOffset), disableStreamBitOffset);
+  return getWordBit(getHeaderWord<hfControlField, uint8_t>(), disableStreamBitOffset);
 }
 
 const bool ISmurfPacket_RO::getDisableFileWriteBit() const
 {
-  return getWordBit(getHeaderWord<uint8_t>(headerControlFieldOffset), disableFileWriteBitOffset);
+  return getWordBit(getHeaderWord<hfControlField, uint8_t>(), disableFileWriteBitOffset);
 }
 
 const bool ISmurfPacket_RO::getReadConfigEachCycleBit() const
 {
-  return getWordBit(getHeaderWord<uint8_t>(headerControlFieldOffset), readConfigEachCycleBitOffset);
+  return getWordBit(getHeaderWord<hfControlField, uint8_t>(), readConfigEachCycleBitOffset);
 }
 
 const uint8_t ISmurfPacket_RO::getTestMode() const
 {
-  return ((getHeaderWord<uint8_t>(headerControlFieldOffset) >> 4) & 0x0f);
+  return ((getHeaderWord<hfControlField, uint8_t>() >> 4) & 0x0f);
 }
 
 const uint8_t ISmurfPacket_RO::getTestParameters() const
 {
-  return getHeaderWord<uint8_t>(headerTestParametersOffset);
+  return getHeaderWord<hfTestParameters, uint8_t>();
 }
 
 const uint16_t ISmurfPacket_RO::getNumberRows() const
 {
-  return getHeaderWord<uint16_t>(headerNumberRowsOffset);
+  return getHeaderWord<hfNumberRows, uint16_t>();
 }
 
 const uint16_t ISmurfPacket_RO::getNumberRowsReported() const
 {
-  return getHeaderWord<uint16_t>(headerNumberRowsReportedOffset);
+  return getHeaderWord<hfNumberRowsReported, uint16_t>();
 }
 
 const uint16_t ISmurfPacket_RO::getRowLength() const
 {
-  return getHeaderWord<uint16_t>(headerRowLengthOffset);
+  return getHeaderWord<hfRowLength, uint16_t>();
 }
 
 const uint16_t ISmurfPacket_RO::getDataRate() const
 {
-  return getHeaderWord<uint16_t>(headerDataRateOffset);
+  return getHeaderWord<hfDataRate, uint16_t>();
 }
 
-template <typename T>
-const T ISmurfPacket_RO::getHeaderWord(std::size_t offset) const
+template <SmurfHeaderField F, typename T>
+const T ISmurfPacket_RO::getHeaderWord() const
 {
-  return *(reinterpret_cast<const T*>(&headerBuffer.at(offset)));
+  return getHeaderField<F, T>(headerBuffer);
 }
 
 const bool ISmurfPacket_RO::getWordBit(uint8_t byte, std::size_t index) const
@@ -413,30 +381,65 @@ const bool ISmurfPacket_RO::getWordBit(uint8_t byte, std::size_t index) const
   return (byte & (0x01 << index));
 }
 
-void ISmurfPacket_RO::writeToFile(uint fd) const
+bool ISmurfPacket_RO::writeToFile(int fd) const
 {
-  write(fd, headerBuffer.data(), headerLength);
-  write(fd, payloadBuffer.data(), payloadLength * sizeof(avgdata_t));
+  // The payload follows the header, so the packet goes out in one syscall
+  const uint8_t *p = headerBuffer;
+  std::size_t    n = packetLength;
+
+  while (n)
+  {
+    ssize_t r = write(fd, p, n);
+
+    if ((r < 0) && (errno == EINTR))
+      continue;
+
+    if (r <= 0)
+      return false;
+
+    p += r;
+    n -= r;
+  }
+
+  return true;
 }
 
 const avgdata_t ISmurfPacket_RO::getValue(std::size_t index) const
 {
-  return payloadBuffer.at(index);
+  if (index >= payloadLength)
+    throw std::runtime_error("Trying to get a value out of the payload range.");
+
+  return payloadBuffer[index];
 }
 
 const uint8_t ISmurfPacket_RO::getHeaderByte(std::size_t index) const
 {
-  return headerBuffer.at(index);
+  if (index >= headerLength)
+    throw std::out_of_range("Trying to get a byte out of the header range.");
+
+  return headerBuffer[index];
 }
 
 void ISmurfPacket_RO::getHeaderArray(uint8_t* h) const
 {
-  memcpy(h, headerBuffer.data(), headerLength);
+  memcpy(h, headerBuffer, headerLength);
 }
 
 void ISmurfPacket_RO::getDataArray(avgdata_t* d) const
 {
-  memcpy(d, payloadBuffer.data(), payloadLength * sizeof(avgdata_t));
+  memcpy(d, payloadBuffer, payloadLength * sizeof(avgdata_t));
+}
+
+const SmurfPacketView ISmurfPacket_RO::getView() const
+{
+  SmurfPacketView v;
+  v.data          = headerBuffer;
+  v.length        = packetLength;
+  v.header        = headerBuffer;
+  v.headerLength  = headerLength;
+  v.payload       = payloadBuffer;
+  v.payloadLength = payloadLength;
+  return v;
 }
 
 SmurfPacket_RO ISmurfPacket_RO::create(const SmurfPacket& sp)
@@ -481,37 +484,51 @@ ISmurfPacket::~ISmurfPacket()
 
 void ISmurfPacket::copyHeader(uint8_t* h)
 {
-  memcpy(headerBuffer.data(), h, headerLength);
+  memcpy(headerBuffer, h, headerLength);
 }
 
 void ISmurfPacket::copyData(avgdata_t* d)
 {
-  memcpy(payloadBuffer.data(), d, payloadLength * sizeof(avgdata_t));
+  memcpy(payloadBuffer, d, payloadLength * sizeof(avgdata_t));
+}
+
+avgdata_t* ISmurfPacket::getDataPtr()
+{
+  return payloadBuffer;
+}
+
+void ISmurfPacket::setPayloadLength(std::size_t length)
+{
+  if (length > payloadMaxLength)
+    throw std::runtime_error("Trying to set a payload length larger than the allocated buffer.");
+
+  payloadLength = length;
+  packetLength  = headerLength + payloadLength * sizeof(avgdata_t);
 }
 
 void ISmurfPacket::setVersion(uint8_t value)
 {
-  setHeaderWord<uint8_t>(headerVersionOffset, value);
+  setHeaderWord<hfVersion, uint8_t>(value);
 }
 
 void ISmurfPacket::setCrateID(uint8_t value)
 {
-  setHeaderWord<uint8_t>(headerCrateIDOffset, value);
+  setHeaderWord<hfCrateID, uint8_t>(value);
 }
 
 void ISmurfPacket::setSlotNumber(uint8_t value)
 {
-  setHeaderWord<uint8_t>(headerSlotNumberOffset, value);
+  setHeaderWord<hfSlotNumber, uint8_t>(value);
 }
 
 void  ISmurfPacket::setTimingConfiguration(uint8_t value)
 {
-  setHeaderWord<uint8_t>(headerTimingConfigurationOffset, value);
+  setHeaderWord<hfTimingConfiguration, uint8_t>(value);
 }
 
 void ISmurfPacket::setNumberChannels(uint32_t value)
 {
-  setHeaderWord<uint32_t>(headerNumberChannelOffset, value);
+  setHeaderWord<hfNumberChannels, uint32_t>(value);
 }
 
 void  ISmurfPacket::setTESBias(std::size_t index, int32_t value)
@@ -521,80 +538,80 @@ void  ISmurfPacket::setTESBias(std::size_t index, int32_t value)
 
 void ISmurfPacket::setUnixTime(uint64_t value)
 {
-  setHeaderWord<uint64_t>(headerUnixTimeOffset, value);
+  setHeaderWord<hfUnixTime, uint64_t>(value);
 }
 
 void ISmurfPacket::setFluxRampIncrement(uint32_t value)
 {
-  setHeaderWord<uint32_t>(headerFluxRampIncrementOffset, value);
+  setHeaderWord<hfFluxRampIncrement, uint32_t>(value);
 }
 
 void ISmurfPacket::setFluxRampOffset(uint32_t value)
 {
-  setHeaderWord<uint32_t>(headerFluxRampOffsetOffset, value);
+  setHeaderWord<hfFluxRampOffset, uint32_t>(value);
 }
 
 void ISmurfPacket::setCounter0(uint32_t value)
 {
-  setHeaderWord<uint32_t>(headerCounter0Offset, value);
+  setHeaderWord<hfCounter0, uint32_t>(value);
 }
 
 void ISmurfPacket::setCounter1(uint32_t value)
 {
-  setHeaderWord<uint32_t>(headerCounter1Offset, value);
+  setHeaderWord<hfCounter1, uint32_t>(value);
 }
 
 void ISmurfPacket::setCounter2(uint64_t value)
 {
-  setHeaderWord<uint64_t>(headerCounter2Offset, value);
+  setHeaderWord<hfCounter2, uint64_t>(value);
 }
 
 void ISmurfPacket::setAveragingResetBits(uint32_t value)
 {
-  setHeaderWord<uint32_t>(headerAveragingResetBitsOffset, value);
+  setHeaderWord<hfAveragingResetBits, uint32_t>(value);
 }
 
 void ISmurfPacket::setFrameCounter(uint32_t value)
 {
-  setHeaderWord<uint32_t>(headerFrameCounterOffset, value);
+  setHeaderWord<hfFrameCounter, uint32_t>(value);
 }
 
 void ISmurfPacket::setTESRelaySetting(uint32_t value)
 {
-  setHeaderWord<uint32_t>(headerTESRelaySettingOffset, value);
+  setHeaderWord<hfTESRelaySetting, uint32_t>(value);
 }
 
 void ISmurfPacket::setExternalTimeClock(uint64_t value)
 {
-  setHeaderWord<uint64_t>(headerExternalTimeClockOffset, value);
+  setHeaderWord<hfExternalTimeClock, uint64_t>(value);
 }
 
 void ISmurfPacket::setControlField(uint8_t value)
 {
-  setHeaderWord<uint8_t>(headerControlFieldOffset, value);
+  setHeaderWord<hfControlField, uint8_t>(value);
 }
 
 void ISmurfPacket::setClearAverageBit(bool value)
 {
-  setHeaderWord<uint8_t>(headerControlFieldOffset, \
+  setHeaderWord<hfControlField, uint8_t>(\
     setWordBit(getControlField(), clearAvergaveBitOffset, value));
 }
 
 void ISmurfPacket::setDisableStreamBit(bool value)
 {
-  setHeaderWord<uint8_t>(headerControlFieldOffset, \
+  setHeaderWord<hfControlField, uint8_t>(\
     setWordBit(getControlField(), disableStreamBitOffset, value));
 }
 
 void ISmurfPacket::setDisableFileWriteBit(bool value)
 {
-  setHeaderWord<uint8_t>(headerControlFieldOffset, \
+  setHeaderWord<hfControlField, uint8_t>(\
     setWordBit(getControlField(), disableFileWriteBitOffset, value));
 }
 
 void ISmurfPacket::setReadConfigEachCycleBit(bool value)
 {
-  setHeaderWord<uint8_t>(headerControlFieldOffset, \
+  setHeaderWord<hfControlField, uint8_t>(\
     setWordBit(getControlField(), readConfigEachCycleBitOffset, value));
 }
 
@@ -605,49 +622,55 @@ void ISmurfPacket::setTestMode(uint8_t value)
   u8 &= 0x0f;
   u8 |= ( (value << 4 ) & 0xf0 );
 
-  setHeaderWord<uint8_t>(headerControlFieldOffset, u8);
+  setHeaderWord<hfControlField, uint8_t>(u8);
 }
 
 void ISmurfPacket::setTestParameters(uint8_t value)
 {
-  setHeaderWord<uint8_t>(headerTestParametersOffset, value);
+  setHeaderWord<hfTestParameters, uint8_t>(value);
 }
 
 void ISmurfPacket::setNumberRows(uint16_t value)
 {
-  setHeaderWord<uint16_t>(headerNumberRowsOffset, value);
+  setHeaderWord<hfNumberRows, uint16_t>(value);
 }
 
 void ISmurfPacket::setNumberRowsReported(uint16_t value)
 {
-  setHeaderWord<uint16_t>(headerNumberRowsReportedOffset, value);
+  setHeaderWord<hfNumberRowsReported, uint16_t>(value);
 }
 
 void ISmurfPacket::setRowLength(uint16_t value)
 {
-  setHeaderWord<uint16_t>(headerRowLengthOffset, value);
+  setHeaderWord<hfRowLength, uint16_t>(value);
 }
 
 void ISmurfPacket::setDataRate(uint16_t value)
 {
-  setHeaderWord<uint16_t>(headerDataRateOffset, value);
+  setHeaderWord<hfDataRate, uint16_t>(value);
 }
 
 
 void ISmurfPacket::setHeaderByte(std::size_t index, uint8_t value)
 {
-  headerBuffer.at(index) = value;
+  if (index >= headerLength)
+    throw std::out_of_range("Trying to set a byte out of the header range.");
+
+  headerBuffer[index] = value;
 }
 
 void ISmurfPacket::setValue(std::size_t index, avgdata_t value)
 {
-  payloadBuffer.at(index) = value;
+  if (index >= payloadLength)
+    throw std::runtime_error("Trying to set a value out of the payload range.");
+
+  payloadBuffer[index] = value;
 }
 
-template <typename T>
-void ISmurfPacket::setHeaderWord(std::size_t offset, const T& value)
+template <SmurfHeaderField F, typename T>
+void ISmurfPacket::setHeaderWord(const T& value)
 {
-  *(reinterpret_cast<T*>(&headerBuffer.at(offset))) = value;
+  setHeaderField<F, T>(headerBuffer, value);
 }
 
 uint8_t ISmurfPacket::setWordBit(uint8_t byte, std::size_t index, bool value)
@@ -691,7 +714,8 @@ uint64_t pull_bit_field(uint8_t *ptr, uint offset, uint width)
   if(width > sizeof(uint64_t))
     error("field width too big");
 
-  r = (1UL << (width*8)) -1;
+  r = (width == sizeof(uint64_t)) ? ~0UL : (1UL << (width*8)) -1;  // a shift by 64 is undefined
+  x = 0;
   memcpy(&x, ptr+offset, width); // move the bytes over
   tmp = r & (uint64_t)x;
   return(r & tmp);
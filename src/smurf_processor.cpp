@@ -17,97 +17,115 @@
 */
 
 #include "smurf_processor.h"
+#include "smurf_file_reader_py.h"
 
 SmurfProcessor::SmurfProcessor()
 : ris::Slave(),
-txBuffer             ( 10, 2                                               ),
-runTxThread          ( true                                                ),
-pktReaderIndexTx     ( 0                                                   ),
-pktReaderIndexFile   ( 1                                                   ),
-pktTransmitterThread ( std::thread( &SmurfProcessor::pktTansmitter, this ) ),
-pktWriterThread      ( std::thread( &SmurfProcessor::pktWriter, this )     ),
+txBuffer             ( 10, PacketMaxSubscribers                            ),
+subscribers          ( txBuffer                                            ),
+txSubscriber         ( -1                                                  ),
+fileSubscriber       ( -1                                                  ),
 frameLossCnt         ( 0                                                   ),
 frameRxCnt           ( 0                                                   ),
 frameOutOrderCnt     ( 0                                                   ),
-tesBias(),
-tba(tesBias.data())
+zeroCopy             ( true                                                ),
+zeroCopyCnt          ( 0                                                   ),
+tesBias              (                                                     )
 {
   rxCount = 0;
   rxBytes = 0;
   rxLast = 0; // from test program
   initialized = false;
+  thread_ = NULL; // not started if an allocation below fails
   average_counter= 1;
-  bufn = 0; // current buffer
   internal_counter = 0;
   fast_internal_counter = 0;
-  int j;
   last_syncword = 0;
   last_1hz_counter = 0;
   frame_error_counter = 0;
   last_frame_counter = 0;
   debug_ = false;
+  mask_channels = 0;
+  mask_changed = false;
+  num_channels = smurfsamples;
+  requested_channels = 0;
+  requested_workers = 1;
+  requested_cpu = -1;
+  frame_data = NULL;
 
   C = new SmurfConfig(); // will hold config info - testing for now
   // M = new MCEHeader();  // creates a MCE header class
   H = new SmurfHeader();
   D = new SmurfDataFile();  // holds output data
   V = new SmurfValidCheck();
-  F = new SmurfFilter(smurfsamples, 16);  //
+  F = new SmurfFilter(smurf_max_channels, 16);  // sized for the largest channel count
+  F->set_samples(num_channels);
+  C->get_filter_params(&cfgFilter);
+  filterParams.publish(cfgFilter);  // first settings, from the config file
   T = new SmurfTestData(smurf_raw_samples, smurfsamples);
 
   average_counter = 0; // counter used for test averaging , not  needed in real program
-  for(j = 0; j < 2; j++)
-  {  // allocate 2 buffers, so we can swap up/ back for background subtraction.
-    if(!(b[j] = (uint8_t*)malloc(pyrogue_buffer_length)))
-    {
-      error("could not allocate smurf2mce buffer");
-      return;
-    }
-
-    memset(b[j], 0, pyrogue_buffer_length); // zero to start with
+  if(!(buffer = (uint8_t*)malloc(pyrogue_buffer_length)))
+  {
+    error("could not allocate smurf2mce buffer");
+    return;
   }
 
+  memset(buffer, 0, pyrogue_buffer_length); // zero to start with
+
  // if(!(average_mce_samples = (avgdata_t*)malloc(smurfsamples * sizeof(avgdata_t))))
  //    {
  //      error("could not allocate mce data sample buffer");
  //      return;
  //    }
 
-  if(!(input_data = (avgdata_t*)malloc(smurfsamples * sizeof(avgdata_t))))
+  // per channel arrays are sized for the largest channel count, so it can change at run time.
+  // They are cache line aligned, so channel blocks processed by different threads don't share lines.
+  if(!(input_data = (avgdata_t*)cache_aligned_malloc(smurf_max_channels * sizeof(avgdata_t))))
   {
     error("could not allocate input data sample buffer");
     return;
   }
 
-  if(!(wrap_counter = (wrap_t*)malloc(smurfsamples * sizeof(wrap_t))))
+  if(!(wrap_counter = (wrap_t*)cache_aligned_malloc(smurf_max_channels * sizeof(wrap_t))))
   {
     error("could not allocate wrap_counter");
     return;
   }
 
-  if(!(mask = (uint*)malloc(smurfsamples * sizeof(uint))))
+  if(!(last_samples = (smurf_t*)cache_aligned_malloc(smurf_max_channels * sizeof(smurf_t))))
+  {
+    error("could not allocate last_samples");
+    return;
+  }
+
+  if(!(mask = (uint*)malloc(smurf_max_channels * sizeof(uint))))
   {
     error("could not allocate mask  buffer");
     return;
   }
 
-  memset(mask, 0, smurfsamples * sizeof(uint)); // set to all off to start
-  memset(input_data, 0, smurfsamples * sizeof(avgdata_t)); // set to all off to start
+  memset(mask, 0, smurf_max_channels * sizeof(uint)); // set to all off to start
+  memset(input_data, 0, smurf_max_channels * sizeof(avgdata_t)); // set to all off to start
+  memset(last_samples, 0, smurf_max_channels * sizeof(smurf_t)); // first frame is compared against zeros
+  memset(wrap_counter, wrap_start, smurf_max_channels * sizeof(wrap_t));
   read_mask(NULL);  // will use real file name later
-  memset(wrap_counter, wrap_start, smurfsamples * sizeof(wrap_t));
+  update_num_channels();
+  unwrap = select_unwrap_kernel();
+  printf("Using %s phase unwrap kernel\n", unwrap_kernel_name(unwrap));
 
   queue_.setThold(queueDepth);
 
   // thread_ = new boost::thread(boost::bind(&SmurfProcessor::runThread, this));
   thread_ = new boost::thread(&SmurfProcessor::runThread, this);
 
-  initialized = true;
+  // The default packet consumers. The file writer should not lose data, but a stuck disk must
+  // not stall processing for long: after one 100 ms wait, the buffer drops its oldest packets
+  // until it has caught up (counted by getBufferOWCnt). The transmitter only needs the newest data.
+  txSubscriber   = subscribers.attach(std::make_shared<TransmitSubscriber>(this), "pktTransmitter", true, DataBuffer::DropOldest, 0);
+  fileSubscriber = subscribers.attach(std::make_shared<FileWriterSubscriber>(D, C), "pktWriter", true, DataBuffer::Blocking, 100);
 
-  // Set thread names
-  if( pthread_setname_np( pktTransmitterThread.native_handle(), "pktTransmitter" ) )
-    perror( "pthread_setname_np failed for pktTransmitterThread" );
-  if( pthread_setname_np( pktWriterThread.native_handle(), "pktWriter" ) )
-    perror( "pthread_setname_np failed for pktWriterThread" );
+  initialized = true;
 }
 
 // This function does most of the work. Runs every smurf frame
@@ -118,11 +136,9 @@ void SmurfProcessor::runThread()
   printf("\n");
 
   ris::FramePtr frame;
-  smurf_t *d, *p;  // d is this buffer, p is last buffer;
+  smurf_t *d;  // raw samples of this frame
   char *pm;
   //avgdata_t *a; // used for averaging loop
-  uint j, k;
-  uint dctr; // counter for input data array
   // char *tcpbuf;
   uint32_t cnt;
   int tmp;
@@ -131,7 +147,7 @@ void SmurfProcessor::runThread()
   // uint32_t *bufx; // holds tcp buffer mapped to 32 bit for checksum
   uint32_t avgtmp;
   smurf_t dx; // current sample in loop
-  uint64_t tm;
+  uint64_t frame_time; // timestamp of the current frame (unix ns)
 
   // zmq::context_t context(1);
   // zmq::socket_t socket(context, ZMQ_PUSH);
@@ -151,14 +167,8 @@ void SmurfProcessor::runThread()
       // zmq::message_t message(MCE_frame_length * sizeof(MCE_t));
 
       frame = queue_.pop();
-      buffer = b[bufn]; // buffer swap
-      bufn = bufn ? 0 : 1; // swap buffer reference
-      buffer_last = b[bufn]; // now that we've swapped them
-      frameToBuffer(frame, buffer);
-
-      H->copy_header(buffer);
-      d = (smurf_t*) (buffer+smurfheaderlength); // pointer to data
-      p =  (smurf_t*) (buffer_last+smurfheaderlength);  // pointer to previous data set
+      frame_time = frameClock.stamp(); // the only clock read of this frame, used by all the stages below
+      d = ingestFrame(frame, buffer); // header is copied into buffer, data may be read in place
       // V->run(H);
 
       // Check if we are missing frames
@@ -188,44 +198,52 @@ void SmurfProcessor::runThread()
       // Update the received frame counter
       ++frameRxCnt;
 
-      // Copy TES bias data into Smurf header. Hold mutex while reading the data
+      // Copy TES bias data into Smurf header. Doesn't wait for python, see TesBiasPublisher.
       {
-        std::lock_guard<std::mutex> lock(*tba.getMutex());
-        H->put_field(h_tes_dac_offset,  h_tes_dac_width, tesBias.data());
+        uint8_t tes[TesBiasBufferSize];
+        tesBias.read(tes);
+        H->put_field(h_tes_dac_offset,  h_tes_dac_width, tes);
       }
 
       if(H->get_test_mode())
         T->gen_test_smurf_data(d, H->get_test_mode(), H->get_syncword(), H->get_test_parameter());   // are we using test data, use pointer to data
 
-      for(j = 0; j < smurfsamples; j++)
-      {
-        dctr = mask[j];
+      update_num_channels(); // pick up a new channel count between frames
+      update_workers(); // and a new number of worker threads
 
-        if((mask[j] < 0) || (mask[j] > 4095))
-        {
-          printf("bad mask %u \n", mask[j]);\
-          break;
-        }
+      cnt = H->average_control(C->num_averages, frame_time); // first, so the filter knows if this frame is sent out
+      bool extra = downsampler.tick(H); // and if an extra output stream takes it
+
+      // If this frame is sent out, take the packet slot now, so the filter writes into it.
+      // There is no slot if a full DropNewest reader drops it: then this packet is dropped
+      // (counted by the buffer), and the filter writes to its scratch array.
+      SmurfPacket sp;
 
-        if ((d[dctr] > upper_unwrap) && (p[dctr] < lower_unwrap)) // unwrap, add 1
+      if (cnt && C->data_frames)
+      {
+        try
         {
-          wrap_counter[j]-= 0x10000; // decrement wrap counter
+          sp = txBuffer.getWritePtr();
         }
-        else if((d[dctr] < lower_unwrap) && (p[dctr] > upper_unwrap))
+        catch (std::runtime_error &e)
         {
-          wrap_counter[j]+= 0x10000; // inccrement wrap counter
+          std::cout << "runThread: Exception caught when writing the data buffer: " << e.what() << std::endl;
         }
-        else; // nothing here
-
-        input_data[j] = (avgdata_t)(d[dctr]) + (avgdata_t) wrap_counter[j];
       }
 
-      average_samples = F->filter(input_data, C->filter_order, C->filter_a, C->filter_b, C->filter_g); // Low Pass Filter
-      cnt = H->average_control(C->num_averages);
+      // The filter settings are published by python or the config file reader. A new version
+      // is picked up here, between frames, without taking a lock.
+      F->begin_frame(filterParams.read(), (cnt != 0) || extra, sp ? sp->getDataPtr() : NULL);
+
+      // Unwrap and filter, split in channel blocks between the worker threads.
+      // Returns when all the blocks are done.
+      frame_data = d;
+      workers.run(num_channels, &SmurfProcessor::process_block, this);
+      average_samples = F->output; // Low Pass Filter output, in the packet payload if there is one
 
       if(H->get_clear_bit()) // clear averages and wraps
       {
-        memset(wrap_counter, wrap_start, smurfsamples * sizeof(wrap_t));  // clear wraps
+        clear_wrap();  // clear wraps
         H->clear_average();  // clears averaging
         F->clear_filter();
       }
@@ -235,12 +253,26 @@ void SmurfProcessor::runThread()
         if(!(fast_internal_counter++ % 5000))
         {
           C->read_config_file();  // checks for config changes, read immediately, then 1H
+          publish_config_filter();  // only if the filter settings in the file changed
           read_mask(NULL);  // re-read the mask file while held at zero
         }
       }
       else
         fast_internal_counter = 0;
 
+      if (cnt || extra)
+      {
+        H->put_field(h_unix_time_offset,  h_unix_time_width, &frame_time); // add time to data stream
+        H->set_num_channels(num_channels);
+      }
+
+      // test data insertion, before the output is copied to the extra streams or sent out
+      if ((cnt || extra) && H->get_test_mode())
+        T->gen_test_mce_data(average_samples, H->get_test_mode(), H->get_syncword(), H->get_test_parameter());
+
+      if (extra)
+        downsampler.emit(H->header, average_samples, num_channels); // copies of the filter output
+
       if (!cnt)
       {
         last_frame_counter = H->get_frame_counter(); // does this belont here???? not used anyway
@@ -260,10 +292,6 @@ void SmurfProcessor::runThread()
       // M->set_word( MCEheader_num_rows_offset, H->get_num_rows());
       // M->set_word( MCEheader_syncbox_offset, H->get_syncword());
 
-      // test data insertion
-      if(H->get_test_mode())
-        T->gen_test_mce_data(average_samples, H->get_test_mode(), H->get_syncword(), H->get_test_parameter());
-
       // data munging for MCE format - needs 7 bit shift left for data mode 10
       // for(j = 0;j < smurfsamples; j++)
       // {
@@ -312,28 +340,20 @@ void SmurfProcessor::runThread()
       //   // M->CC_frame_counter = 0;  // set to zero when not streaming
       // }
 
-      V->run(H);
-      tm = V->Unix_time->current;
-      H->put_field(h_unix_time_offset,  h_unix_time_width, &tm); // add time to data stream
-      H->set_num_channels(smurfsamples);
+      V->run(H, frame_time);
 
-      if(C->data_frames)
+      // Publish the SMuRF packet in the TX buffer so it can be processed by the subscribers.
+      // The data is already in the payload.
+      if (sp)
       {
-        // Add a SMuRF packet in the TX buffer so it can be processed by the transmit method
-        try
-        {
-          // Add the packet into the buffer
-          SmurfPacket sp = txBuffer.getWritePtr();  // Get write pointer to buffer area
-          sp->copyHeader(H->header);                // Write the header content
-          sp->copyData(average_samples);            // Write the data content
+        sp->copyHeader(H->header);                // Write the header content
+        sp->setPayloadLength(num_channels);       // Number of channels in this packet
 
-          // Mark the writing operation as done.
-          txBuffer.doneWriting();
-        }
-        catch (std::runtime_error &e)
-        {
-          std::cout << "runThread: Exception caught when writing the data buffer: " << e.what() << std::endl;
-        }
+        // Mark the writing operation as done.
+        txBuffer.doneWriting();
+
+        // Hand the packet to the inline subscribers, before the slot can be reused
+        subscribers.publish(sp);
       }
 
       // tcpbuf   = NULL;  // returns location to put data (8 bytes beyond tcp start)
@@ -364,19 +384,310 @@ void SmurfProcessor::read_mask(char *filename)  // ugly, hard coded file name. f
     return;
   }
 
-  for(j =0; j < smurfsamples; j++)
+  for(j =0; j < smurf_max_channels; j++)
   {
     ret = fscanf(fp,"%u", &m);  // read next line
 
     if ((ret == EOF) || (ret == 0))
       break;  // done
 
-    mask[j] = (m < smurf_raw_samples) ? m : 0;
+    if (m >= smurf_raw_samples)
+      m = 0; // the unwrap kernels rely on this check
+
+    if (mask[j] != m)
+      mask_changed = true; // a channel now follows another resonator
+
+    mask[j] = m;
   }
 
+  mask_channels = j; // the mask length sets the number of channels
   fclose(fp);
 }
 
+// Set the number of processed channels from python. 0 goes back to using the mask length.
+// The new value is applied by the processing thread at the next frame.
+void SmurfProcessor::setNumChannels(uint n)
+{
+  if (n > smurf_max_channels)
+    throw std::runtime_error("Trying to set a number of channels larger than the number of raw samples.");
+
+  requested_channels = n;
+}
+
+// Publishes the filter settings from the config file, when they changed since the last time.
+// Settings from python stay in place until the file changes.
+void SmurfProcessor::publish_config_filter(void)
+{
+  FilterParams p;
+
+  C->get_filter_params(&p);
+
+  if (p.sameSettings(cfgFilter))
+    return;
+
+  cfgFilter = p;
+  filterParams.publish(p);
+}
+
+// Set the direct form filter from python. order -1 is the flat average, and then a and b are
+// not used. Otherwise a and b must hold at least order + 1 coefficients.
+void SmurfProcessor::setFilter(int order, bp::object a, bp::object b, double gain)
+{
+  filter_t fa[16], fb[16];
+
+  if ((order < -1) || (order > 15))
+    throw std::runtime_error("Trying to set a filter order outside -1..15.");
+
+  if ((order >= 0) && ((bp::len(a) < order + 1) || (bp::len(b) < order + 1)))
+    throw std::runtime_error("Trying to set a filter with less than order + 1 coefficients.");
+
+  for (int r = 0; r < 16; r++)
+  {
+    fa[r] = (r <= order) ? (filter_t) bp::extract<filter_t>(a[r]) : 0;
+    fb[r] = (r <= order) ? (filter_t) bp::extract<filter_t>(b[r]) : 0;
+  }
+
+  if ((order >= 0) && (fa[0] == 0))
+    throw std::runtime_error("Trying to set a filter with a0 = 0.");
+
+  filterParams.update([&](FilterParams& p)
+  {
+    p.order = order;
+    p.g     = (filter_t) gain;
+    p.sos_n = 0;
+    memcpy(p.a, fa, sizeof(fa));
+    memcpy(p.b, fb, sizeof(fb));
+  });
+}
+
+// Set the biquad sections from python, as a list of [b0, b1, b2, a0, a1, a2] rows (the layout
+// of scipy.signal sos arrays). Each row is normalized by its a0. An empty list goes back to the
+// direct form filter. The gain is not changed.
+void SmurfProcessor::setFilterSOS(bp::object sos)
+{
+  filter_t coef[filter_max_sections][5];
+  int      n = bp::len(sos);
+
+  if (n > (int) filter_max_sections)
+    throw std::runtime_error("Trying to set more biquad sections than filter_max_sections.");
+
+  for (int k = 0; k < n; k++)
+  {
+    bp::object row = sos[k];
+
+    if (bp::len(row) != 6)
+      throw std::runtime_error("Each biquad section must have 6 coefficients: b0, b1, b2, a0, a1, a2.");
+
+    filter_t a0 = bp::extract<filter_t>(row[3]);
+
+    if (a0 == 0)
+      throw std::runtime_error("Biquad section with a0 = 0.");
+
+    coef[k][0] = bp::extract<filter_t>(row[0]) / a0;
+    coef[k][1] = bp::extract<filter_t>(row[1]) / a0;
+    coef[k][2] = bp::extract<filter_t>(row[2]) / a0;
+    coef[k][3] = bp::extract<filter_t>(row[4]) / a0;
+    coef[k][4] = bp::extract<filter_t>(row[5]) / a0;
+  }
+
+  filterParams.update([&](FilterParams& p)
+  {
+    p.sos_n = n;
+    memcpy(p.sos, coef, n * sizeof(coef[0]));
+  });
+}
+
+// Start new filters from the steady state for the current input, instead of from zeros
+void SmurfProcessor::setFilterWarmStart(bool enable)
+{
+  filterParams.update([enable](FilterParams& p) { p.warm_start = enable; });
+}
+
+// Compute FIR outputs only on frames that are sent out
+void SmurfProcessor::setFilterDecimate(bool enable)
+{
+  filterParams.update([enable](FilterParams& p) { p.decimate = enable; });
+}
+
+// Set the depth of the packet buffer. It is applied once all the attached readers have caught up.
+void SmurfProcessor::setBufferSize(std::size_t n)
+{
+  txBuffer.setSize(n);
+}
+
+// Set what happens when the buffer reader of threaded subscriber 'id' is full: 0 = drop its
+// oldest packet, 1 = wait up to timeout_ms for it (then drop the oldest), 2 = drop the new packet.
+void SmurfProcessor::setBufferPolicy(int id, int policy, std::size_t timeout_ms)
+{
+  if ((policy < DataBuffer::DropOldest) || (policy > DataBuffer::DropNewest))
+    throw std::runtime_error("Trying to set an unknown packet buffer policy.");
+
+  txBuffer.setPolicy(subscribers.reader(id), static_cast<DataBuffer::Policy>(policy), timeout_ms);
+}
+
+// Attach a packet consumer. Threaded consumers have their own thread and buffer reader, with the
+// given policy (see setBufferPolicy). Inline consumers are called by the processing thread.
+int SmurfProcessor::attachSubscriber(PacketSubscriberPtr sub, const std::string &name, bool threaded, int policy, std::size_t timeout_ms)
+{
+  if ((policy < DataBuffer::DropOldest) || (policy > DataBuffer::DropNewest))
+    throw std::runtime_error("Trying to set an unknown packet buffer policy.");
+
+  return subscribers.attach(sub, name, threaded, static_cast<DataBuffer::Policy>(policy), timeout_ms);
+}
+
+// Attach a python callable, called as callback(header, data) with two bytes objects
+int SmurfProcessor::addSubscriber(bp::object callback, const std::string &name, bool threaded, int policy, std::size_t timeout_ms)
+{
+  return attachSubscriber(std::make_shared<PythonSubscriber>(callback), name, threaded, policy, timeout_ms);
+}
+
+// Detach a packet consumer. The GIL is released while its thread stops, as a python
+// callback may be waiting for it.
+void SmurfProcessor::detachSubscriber(int id)
+{
+  rogue::GilRelease noGil;
+  subscribers.detach(id);
+}
+
+// Add an extra output stream, with its own packet buffer of 'depth' packets and its own
+// subscribers. trigger: 0 = every 'period' frames, 1 = every 'period' sync word changes,
+// 2 = every 'period' seconds of timing system time.
+int SmurfProcessor::addStream(const std::string &name, int trigger, uint32_t period, std::size_t depth)
+{
+  if ((trigger < DownsamplerStream::Frames) || (trigger > DownsamplerStream::EpicsSeconds))
+    throw std::runtime_error("Trying to add a stream with an unknown trigger.");
+
+  return downsampler.add(name, static_cast<DownsamplerStream::Trigger>(trigger), period, depth);
+}
+
+// Remove an extra output stream. The GIL is released while its subscribers stop.
+void SmurfProcessor::removeStream(int id)
+{
+  rogue::GilRelease noGil;
+  downsampler.remove(id);
+}
+
+bp::list SmurfProcessor::getStreamIds()
+{
+  std::vector<int> ids = downsampler.getIds();
+  bp::list l;
+
+  for (std::size_t i = 0; i < ids.size(); ++i)
+    l.append(ids[i]);
+
+  return l;
+}
+
+// Attach a packet consumer to an extra output stream, as attachSubscriber() does for the main one
+int SmurfProcessor::attachStreamSubscriber(int stream, PacketSubscriberPtr sub, const std::string &name, bool threaded, int policy, std::size_t timeout_ms)
+{
+  if ((policy < DataBuffer::DropOldest) || (policy > DataBuffer::DropNewest))
+    throw std::runtime_error("Trying to set an unknown packet buffer policy.");
+
+  return downsampler.get(stream)->getSubscribers().attach(sub, name, threaded, static_cast<DataBuffer::Policy>(policy), timeout_ms);
+}
+
+int SmurfProcessor::addStreamSubscriber(int stream, bp::object callback, const std::string &name, bool threaded, int policy, std::size_t timeout_ms)
+{
+  return attachStreamSubscriber(stream, std::make_shared<PythonSubscriber>(callback), name, threaded, policy, timeout_ms);
+}
+
+void SmurfProcessor::removeStreamSubscriber(int stream, int id)
+{
+  DownsamplerStreamPtr s = downsampler.get(stream);
+
+  rogue::GilRelease noGil;
+  s->getSubscribers().detach(id);
+}
+
+bp::list SmurfProcessor::getSubscriberIds()
+{
+  std::vector<int> ids = subscribers.getIds();
+  bp::list l;
+
+  for (std::size_t i = 0; i < ids.size(); ++i)
+    l.append(ids[i]);
+
+  return l;
+}
+
+// The codec counters are updated by the file writer thread, so the two reads may be from
+// different chunks; good enough for monitoring.
+double SmurfProcessor::getFileCodecRatio()
+{
+  uint64_t out = D->columnar.getCodecOutBytes();
+  return out ? (double) D->columnar.getCodecInBytes() / out : 0;
+}
+
+double SmurfProcessor::getFileCodecRate()
+{
+  uint64_t ns = D->columnar.getCodecTime();
+  return ns ? (double) D->columnar.getCodecInBytes() * 1e3 / ns : 0;
+}
+
+// Set the number of channel partitions, each one processed by its own thread (1 = only the
+// processing thread). If first_cpu >= 0, the worker threads are pinned to CPUs first_cpu,
+// first_cpu + 1, ... The new value is applied by the processing thread at the next frame.
+void SmurfProcessor::setWorkers(uint n, int first_cpu)
+{
+  if ((n < 1) || (n > smurf_max_channels / ChannelBlockAlign))
+    throw std::runtime_error("Trying to set a number of channel partitions out of range.");
+
+  requested_cpu     = first_cpu;
+  requested_workers = n;
+}
+
+// Starts or stops the worker threads, at a frame boundary
+void SmurfProcessor::update_workers(void)
+{
+  uint n   = requested_workers;
+  int  cpu = requested_cpu;
+
+  if ((n == workers.getPartitions()) && (cpu == workers.getFirstCpu()))
+    return;
+
+  printf("channel partitions updated from %u to %u\n", workers.getPartitions(), n);
+  workers.start(n, cpu);
+}
+
+// Gathers the masked channels [first, first + count), unwraps them and widens them into
+// input_data, then filters them. Runs on the worker threads, on disjoint channel blocks.
+void SmurfProcessor::process_block(void *ctx, uint first, uint count)
+{
+  SmurfProcessor *p = static_cast<SmurfProcessor*>(ctx);
+
+  // The mask is validated when it is read, so the kernel doesn't check it.
+  p->unwrap(p->frame_data, p->mask + first, count, p->last_samples + first, p->wrap_counter + first, p->input_data + first);
+  p->F->filter_block(p->input_data, first, count);
+}
+
+// Applies a new channel count, or new mask contents. The wrap counters, the previous samples
+// and the filter history are cleared, as the channel to array index mapping is not the same anymore.
+void SmurfProcessor::update_num_channels(void)
+{
+  uint n = requested_channels;
+
+  if (!n)
+    n = mask_channels ? mask_channels : smurfsamples; // no mask file, keep the default
+
+  if ((n == num_channels) && !mask_changed)
+    return;
+
+  if (n != num_channels)
+    printf("number of channels updated from %u to %u\n", num_channels, n);
+  else
+    printf("mask updated, %u channels\n", n);
+
+  num_channels = n;
+  mask_changed = false;
+  clear_wrap();
+  memset(last_samples, 0, smurf_max_channels * sizeof(smurf_t));
+  F->set_samples(num_channels);
+  F->clear_filter(); // set_samples only clears it when the count changes
+  T->MCE_samples = num_channels;
+  D->sample_points = num_channels;
+}
+
 
 // ###############################################################################################################
 // THIS IS CALLED BY PYROGUE FOR EACH FRAME
@@ -405,90 +716,85 @@ void SmurfProcessor::frameToBuffer( ris::FramePtr frame, uint8_t * const buffer)
   }
 }
 
-void SmurfProcessor::pktTansmitter()
+// Bring a new frame into the processing loop. The header is always copied into 'buffer', as it
+// is modified before being packetized. In zero copy mode, the raw samples are read in place from
+// the rogue buffer when the whole frame sits in a single buffer and no test mode is active (test
+// modes overwrite the samples, and the frame may be shared with other slaves). Otherwise, the full
+// frame is copied into 'buffer'. Returns a pointer to the raw samples.
+smurf_t* SmurfProcessor::ingestFrame(ris::FramePtr frame, uint8_t * const buffer)
 {
-  std::cout << "Transmitter thread started..." << std::endl;
-
-  // Infinite loop
-  for(;;)
+  if ( zeroCopy && ( frame->bufferCount() == 1 ) )
   {
-    // Check the status of the data buffer
-    if ( txBuffer.isEmpty(pktReaderIndexTx) )
-    {
-      // If the buffer is empty, wait until new data is ready, with a 10s timeout
-      std::unique_lock<std::mutex> lock(*txBuffer.getMutex());
-      txBuffer.getDataReady()->wait_for( lock, std::chrono::seconds(10) );
-    }
-    else
+    ris::BufferPtr buf = *(frame->beginBuffer());
+
+    if ( buf->getPayload() >= smurfdatalength )
     {
-      try
-      {
-        // Call processing method passing a read pointer to the buffer area
-        transmit(txBuffer.getReadPtr(pktReaderIndexTx));
-        // Tell the buffer we are done reading this packet
-        txBuffer.doneReading(pktReaderIndexTx);
-      }
-      catch (std::runtime_error &e)
+      uint8_t *src = buf->begin();
+      std::copy(src, src + smurfheaderlength, buffer);
+      H->copy_header(buffer);
+
+      if ( !H->get_test_mode() )
       {
-        std::cout << "pktTansmitter: Exception caught when reading the data buffer: " << e.what() << std::endl;
+        ++zeroCopyCnt;
+        return (smurf_t*) (src + smurfheaderlength);
       }
     }
-
-    // Check if we should stop the loop
-    if (!runTxThread)
-    {
-      std::cout << "pktTansmitter interrupted." << std::endl;
-      return;
-    }
   }
+
+  frameToBuffer(frame, buffer);
+  H->copy_header(buffer);
+  return (smurf_t*) (buffer + smurfheaderlength);
 }
 
-void SmurfProcessor::pktWriter()
+void SmurfProcessor::printTransmitStatistic() const
 {
-  std::cout << "File writer thread started..." << std::endl;
+  txBuffer.printStatistic();
+}
+
+SmurfProcessor::~SmurfProcessor() // destructor
+{
+  rogue::GilRelease noGil;
 
-  // Infinite loop
-  for(;;)
+  // Stop the processing thread, it uses the data file (the queue wait is an interruption point)
+  if (thread_)
   {
-    // Check the status of the data buffer
-    if ( txBuffer.isEmpty(pktReaderIndexFile) )
-    {
-      // If the buffer is empty, wait until new data is ready, with a 10s timeout
-      std::unique_lock<std::mutex> lock(*txBuffer.getMutex());
-      txBuffer.getDataReady()->wait_for( lock, std::chrono::seconds(10) );
-    }
-    else
-    {
-      try
-      {
-        // Write the packet to file
-        D->write_file(txBuffer.getReadPtr(pktReaderIndexFile), C);
+    thread_->interrupt();
+    thread_->join();
+    delete thread_;
+  }
 
-        // Tell the buffer we are done reading this area
-        txBuffer.doneReading(pktReaderIndexFile);
-      }
-      catch (std::runtime_error &e)
-      {
-        std::cout << "pktWriter: Exception caught when reading the data buffer: " << e.what() << std::endl;
-      }
-    }
+  // Then the consumers, 'transmit' can't be called on a destroyed object
+  subscribers.detachAll();
+  downsampler.removeAll();
 
-    // Check if we should stop the loop
-    if (!runTxThread)
-    {
-      std::cout << "pktWriter interrupted." << std::endl;
-      return;
-    }
-  }
+  // The file writer keeps data in memory, and can have writes in flight: the last file is
+  // written out and closed here
+  delete D;
 }
 
-void SmurfProcessor::printTransmitStatistic() const
+PythonSubscriber::~PythonSubscriber()
 {
-  txBuffer.printStatistic();
+  // The callback can be released by any thread
+  rogue::ScopedGil gil;
+  callback = bp::object();
 }
 
-SmurfProcessor::~SmurfProcessor() // destructor
+void PythonSubscriber::process(SmurfPacket_RO packet)
 {
+  SmurfPacketView v = packet->getView();
+
+  rogue::ScopedGil gil;
+
+  try
+  {
+    bp::object h(bp::handle<>(PyBytes_FromStringAndSize(reinterpret_cast<const char*>(v.header), v.headerLength)));
+    bp::object d(bp::handle<>(PyBytes_FromStringAndSize(reinterpret_cast<const char*>(v.payload), v.payloadLength * sizeof(avgdata_t))));
+    callback(h, d);
+  }
+  catch (bp::error_already_set&)
+  {
+    PyErr_Print();
+  }
 }
 
 
@@ -517,15 +823,28 @@ void SmurfProcessor::clearFrameCnt()
   frameLossCnt     = 0;
   frameRxCnt       = 0;
   frameOutOrderCnt = 0;
+  zeroCopyCnt      = 0;
 }
 
 // Receive the TesBias from pyrogue
 void SmurfProcessor::setTesBias(std::size_t index, int32_t value)
 {
-  // Hold the mutex while the data tesBias array is being written to.
-  std::lock_guard<std::mutex> lock(*tba.getMutex());
+  tesBias.setWord(index, value);
+}
+
+// Set the 16 TesBias values at once, from a python sequence. The processing thread sees either
+// all the old values or all the new ones.
+void SmurfProcessor::setTesBiasArray(bp::object values)
+{
+  int32_t v[TesBiasCount];
 
-  tba.setWord(index, value);
+  if (bp::len(values) != TesBiasCount)
+    throw std::runtime_error("Trying to set a number of TES bias values different from 16.");
+
+  for (std::size_t i = 0; i < TesBiasCount; ++i)
+    v[i] = bp::extract<int32_t>(values[i]);
+
+  tesBias.setWords(v);
 }
 
 // Reads and interprest the smurf.cfg file.
@@ -552,9 +871,33 @@ SmurfConfig::SmurfConfig(void)
 
   filter_a[0] = 1;  // first filter element is 1 for simple filter
   filter_b[0] = 1;
+  filter_decimate = 0; // compute every output, unless asked to
+  filter_warm_start = 0; // new filters start from zeros
+  file_async = 1; // io_uring when the kernel has it
+  file_direct = 0; // through the page cache
+  file_max_mb = 0; // no size limit
+  file_rotate_seconds = 0; // no time aligned files
+  file_format = 0; // raw packets
+  file_chunk_frames = 1000;
+  file_codec = 0; // uncompressed
+  filter_sos_n = 0; // direct form unless the config asks for sections
+  memset(filter_sos, 0, sizeof(filter_sos));
   ready = read_config_file();
 }
 
+// Copies the filter settings, to be published to the processing thread
+void SmurfConfig::get_filter_params(FilterParams *p)
+{
+  p->order      = filter_order;
+  p->g          = filter_g;
+  p->sos_n      = filter_sos_n;
+  p->decimate   = filter_decimate != 0;
+  p->warm_start = filter_warm_start != 0;
+  memcpy(p->a, filter_a, sizeof(filter_a));
+  memcpy(p->b, filter_b, sizeof(filter_b));
+  memcpy(p->sos, filter_sos, sizeof(filter_sos));
+}
+
 // reads config file.  Ugly code, should fix some day, but works.
 bool SmurfConfig::read_config_file(void)
 {
@@ -572,6 +915,9 @@ bool SmurfConfig::read_config_file(void)
 
   printf("reading config file\n");
 
+  int prev_file_format = file_format; // to warn about their combination once, when it changes
+  int prev_file_codec = file_codec;
+
   do
   {
     n = fscanf(fp, "%s", variable);  // read into buffer
@@ -676,6 +1022,158 @@ bool SmurfConfig::read_config_file(void)
       continue;
     }
 
+    if(!strcmp(variable, "filter_decimate"))
+    {
+      tmp = strtol(value, &endptr, 10);
+      if (filter_decimate != tmp)
+      {
+        printf("updated filter decimate from %d to %d\n", filter_decimate, tmp);
+        filter_decimate = tmp;
+      }
+
+      continue;
+    }
+
+    if(!strcmp(variable, "file_format"))
+    {
+      tmp = strtol(value, &endptr, 10);
+      if (file_format != tmp)
+      {
+        printf("updated file format from %d to %d, used for the next file\n", file_format, tmp);
+        file_format = tmp;
+      }
+
+      continue;
+    }
+
+    if(!strcmp(variable, "file_chunk_frames"))
+    {
+      tmp = strtol(value, &endptr, 10);
+      if ((tmp < 1) || (tmp > (int) ColumnarMaxChunk))
+        printf("file chunk frames %d out of range, ignored\n", tmp);
+      else if (file_chunk_frames != tmp)
+      {
+        printf("updated file chunk frames from %d to %d, used for the next file\n", file_chunk_frames, tmp);
+        file_chunk_frames = tmp;
+      }
+
+      continue;
+    }
+
+    if(!strcmp(variable, "file_codec"))
+    {
+      tmp = strtol(value, &endptr, 10);
+      if ((tmp != ColumnarCodecNone) && (tmp != ColumnarCodecDelta))
+        printf("file codec %d unknown, ignored\n", tmp);
+      else if (file_codec != tmp)
+      {
+        printf("updated file codec from %d to %d, used for the next file\n", file_codec, tmp);
+        file_codec = tmp;
+      }
+
+      continue;
+    }
+
+    if(!strcmp(variable, "file_max_mb"))
+    {
+      tmp = strtol(value, &endptr, 10);
+      if (file_max_mb != tmp)
+      {
+        printf("updated file max size from %d to %d MiB\n", file_max_mb, tmp);
+        file_max_mb = tmp;
+      }
+
+      continue;
+    }
+
+    if(!strcmp(variable, "file_rotate_seconds"))
+    {
+      tmp = strtol(value, &endptr, 10);
+      if (file_rotate_seconds != tmp)
+      {
+        printf("updated file rotation period from %d to %d s\n", file_rotate_seconds, tmp);
+        file_rotate_seconds = tmp;
+      }
+
+      continue;
+    }
+
+    if(!strcmp(variable, "file_async"))
+    {
+      tmp = strtol(value, &endptr, 10);
+      if (file_async != tmp)
+      {
+        printf("updated file async from %d to %d, used for the next file\n", file_async, tmp);
+        file_async = tmp;
+      }
+
+      continue;
+    }
+
+    if(!strcmp(variable, "file_direct"))
+    {
+      tmp = strtol(value, &endptr, 10);
+      if (file_direct != tmp)
+      {
+        printf("updated file direct from %d to %d, used for the next file\n", file_direct, tmp);
+        file_direct = tmp;
+      }
+
+      continue;
+    }
+
+    if(!strcmp(variable, "filter_warm_start"))
+    {
+      tmp = strtol(value, &endptr, 10);
+      if (filter_warm_start != tmp)
+      {
+        printf("updated filter warm start from %d to %d\n", filter_warm_start, tmp);
+        filter_warm_start = tmp;
+      }
+
+      continue;
+    }
+
+    if(!strcmp(variable, "filter_sos_sections"))
+    {
+      tmp = strtol(value, &endptr, 10);
+      if ((tmp < 0) || (tmp > (int) filter_max_sections))
+      {
+        printf("filter_sos_sections %d out of range, max is %u, ignored\n", tmp, filter_max_sections);
+        continue;
+      }
+
+      if (filter_sos_n != tmp)
+      {
+        printf("updated filter sections from %d to %d\n", filter_sos_n, tmp);
+        filter_sos_n = tmp;
+      }
+
+      continue;
+    }
+
+    if(!strncmp(variable, "filter_sos", 10))  // filter_sos<section>_<b0|b1|b2|a1|a2>
+    {
+      static const char *names[5] = {"b0", "b1", "b2", "a1", "a2"};
+      uint k;
+      char c[3];
+
+      if ((sscanf(variable, "filter_sos%u_%2s", &k, c) == 2) && (k < filter_max_sections))
+      {
+        for (uint i = 0; i < 5; i++)
+        {
+          if (strcmp(c, names[i]))
+            continue;
+
+          tmpf = strtod(value, &endptr);
+          printf("filter_sos%u_%s updated from %lg to %lg\n", k, names[i], filter_sos[k][i], tmpf);
+          filter_sos[k][i] = (filter_t) tmpf;
+        }
+      }
+
+      continue;
+    }
+
     for (uint n = 0; n < 16;  n++)
     {
       char tmpa[100]; // holds string
@@ -704,10 +1202,16 @@ bool SmurfConfig::read_config_file(void)
   while ((n!=0) && (n != EOF));  // end when n ==0, end of  file
 
   fclose(fp); // done with file
+
+  // Checked once both are read, they can come in any order
+  if (file_codec && (file_format != 1) && ((file_codec != prev_file_codec) || (file_format != prev_file_format)))
+    printf("file codec %d is only used with file format 1 (columnar), raw files are not compressed\n", file_codec);
+
+  return(true);
 }
 
 
-SmurfDataFile::SmurfDataFile(void) : open_(false), part_(0)
+SmurfDataFile::SmurfDataFile(void) : open_(false), part_(0), file_slot(0), last_length(0), columnar(writer)
 {
   filename = (char*) malloc(1024 * sizeof(char)); // too big for
   memset(filename, 0, 1024); // zero for now
@@ -715,22 +1219,18 @@ SmurfDataFile::SmurfDataFile(void) : open_(false), part_(0)
   header_length = smurfheaderlength; // from header file for now
   sample_points = smurfsamples;  // from header file (ugly)
   frame = (uint8_t*) malloc(60000); // just a big number for now
-  fd = 0; // shows that we don't have a pointer yet
 }
 
 uint SmurfDataFile::write_file(SmurfPacket_RO packet, SmurfConfig *config)
 {
-  time_t tx;
-  char tmp[100]; // for strings
+  SmurfPacketView v = packet->getView();
+  uint64_t slot = 0;
+
   if(packet->getDisableFileWriteBit())
   {
     part_ = 0;
-
-    if(fd)  // close file
-    {
-      close(fd);
-      fd = 0;
-    }
+    close_file();  // close file, if open
+    rotator.discard(); // and forget the next one
 
     frame_counter = 0;
 
@@ -740,54 +1240,136 @@ uint SmurfDataFile::write_file(SmurfPacket_RO packet, SmurfConfig *config)
   if ( (config->file_name_extend==0) && (0 != strcmp(config->data_file_name, filename))) // name has changed.
   {
     printf("file name has changed from %s to %s \n", filename, config->data_file_name);
-    if(fd)
-      close(fd); // close existing file if its open
+    close_file(); // close existing file if its open
+  }
+
+  // Files can start on multiples of file_rotate_seconds of timing system time, so a file never
+  // spans two periods (the names are still part numbers). Checked before the packet is written,
+  // so it is the first one of the new file.
+  if (config->file_rotate_seconds > 0)
+  {
+    slot = (packet->getCounter2() >> 32) / config->file_rotate_seconds; // epics seconds
 
-    fd = 0;
+    if (writer.isOpen() && (slot != file_slot))
+      next_file();
   }
 
-  if(!fd) // need to open a file
+  if(!writer.isOpen()) // need to open a file
   {
-    memset(filename, 0, 1024); // zero for now
-    strcat(filename, config->data_file_name); // add file name
+    if (!open_file(config, v.length))
+      return(0); // failed to open file
 
-    if (config->file_name_extend)
-    {
-      tx = time(NULL);
-      sprintf(tmp, ".part_%05u", part_);  // LAZY - need to use a real time converter.
-      strcat(filename, tmp);
-    }
-    //else strcat(filename, ".dat");  // just use base name, Dont append dat.
+    file_slot = slot;
+  }
+
+  // Write packet to file. The header and the payload are contiguous.
+  if (columnar.isActive())
+    columnar.append(v);
+  else
+    writer.write(v.data, v.length);
+
+  frame_counter++;
+
+  if ( (frame_counter >= config->data_frames) ||
+       ( (config->file_max_mb > 0) && (writer.getLength() >= ((uint64_t) config->file_max_mb << 20)) ) )
+    next_file();
+
+  return(frame_counter);
+}
 
-    printf("new filename = %s \n", filename);
+// Opens part part_. The file was usually created in the background already. Then asks for the
+// next part, with space reserved for it: data_frames packets, at most file_max_mb, or the length
+// of the last file when the files are only cut on time.
+bool SmurfDataFile::open_file(SmurfConfig *config, std::size_t packet_length)
+{
+  bool async  = config->file_async != 0;
+  bool direct = config->file_direct != 0;
+  bool prepared;
+  int  f;
+
+  make_filename(filename, config, part_);
+  printf("new filename = %s \n", filename);
+
+  if ((f = rotator.take(filename, prepared)) >= 0)
+  {
+    writer.attach(f, async, prepared, true);
+  }
+  else
+  {
     unlink(filename); // try to delete file if it exists before creating
 
-    if (!(fd = open(filename, O_WRONLY | O_CREAT | O_NONBLOCK, S_IRUSR | S_IWUSR))) // testing non blocking
-    //if (!(fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_NONBLOCK, S_IRUSR | S_IWUSR))) // testing non blocking
+    // O_NONBLOCK has no effect on regular files, the writer batches the packets instead
+    if (!writer.open(filename, async, direct))
     {
       printf("coult not open: %s \n", filename);
-      return(0); // failed to open file
+      return(false);
     }
-    else
-      printf("opened file %s  fd = %d \n", filename, fd);
   }
 
-  // Write packet to file
-  packet->writeToFile(fd);
+  printf("opened file %s (%s%s%s)\n", filename, writer.backend(), (config->file_format == 1) ? ", columnar" : "",
+         ((config->file_format == 1) && config->file_codec) ? ", delta codec" : "");
 
-  frame_counter++;
+  if (config->file_format == 1)
+    columnar.begin(config->file_chunk_frames, config->file_codec);
 
-  if(frame_counter >= config->data_frames)
+  if (config->file_name_extend) // otherwise the next file has the same name
   {
-    if(fd)
-      close(fd);
+    char next[1024];
+    uint64_t size = 0;
 
-    fd = 0;
-    frame_counter = 0;
-    part_ = (part_ + 1) % 99999;
+    if (config->data_frames > 0)
+      size = (uint64_t) config->data_frames * packet_length;
+
+    if ((config->file_max_mb > 0) && (!size || (size > ((uint64_t) config->file_max_mb << 20))))
+      size = (uint64_t) config->file_max_mb << 20;
+
+    if ((config->file_rotate_seconds > 0) && last_length && (!size || (last_length < size)))
+      size = last_length;
+
+    make_filename(next, config, (part_ + 1) % 99999);
+    rotator.prepare(next, direct, size);
   }
 
-  return(frame_counter);
+  return(true);
+}
+
+// The current file is closed once its last writes are done, without waiting for them
+void SmurfDataFile::next_file(void)
+{
+  columnar.end(); // the last chunk and the index
+  last_length = writer.getLength();
+  writer.detach();
+  frame_counter = 0;
+  part_ = (part_ + 1) % 99999;
+}
+
+SmurfDataFile::~SmurfDataFile()
+{
+  close_file();
+  rotator.discard(); // the next file was never written to
+  free(filename);
+  free(frame);
+}
+
+void SmurfDataFile::close_file(void)
+{
+  columnar.end();
+  writer.close();
+}
+
+void SmurfDataFile::make_filename(char *name, SmurfConfig *config, int part)
+{
+  char tmp[100]; // for strings
+
+  memset(name, 0, 1024); // zero for now
+  strcat(name, config->data_file_name); // add file name
+
+  if (config->file_name_extend)
+  {
+    sprintf(tmp, ".part_%05u", part);  // LAZY - need to use a real time converter.
+    strcat(name, tmp);
+  }
+  //else strcat(name, ".dat");  // just use base name, Dont append dat.
 }
 
 
@@ -850,9 +1432,8 @@ SmurfValidCheck::SmurfValidCheck() // just creates  all variables.
 }
 
 
-void SmurfValidCheck::run(SmurfHeader *H)
+void SmurfValidCheck::run(SmurfHeader *H, uint64_t frame_time)
 {
-  timespec tmp_t;  // structure seconds, nanoseconds
   uint64_t tmp;
   bool jump = false;
 
@@ -885,7 +1466,7 @@ void SmurfValidCheck::run(SmurfHeader *H)
 
   //clock_gettime(CLOCK_REALTIME, &tmp_t);  // get time s, ns,  might be expensive
   //tmp = 1000000000l * (uint64_t) tmp_t.tv_sec + (uint64_t) tmp_t.tv_nsec;  //  multiply to 64 uint
-  tmp = get_unix_time();
+  tmp = frame_time;
   Smurf2mce->update(tmp);
   jump = Unix_time->update(tmp) ? true: jump;
   jump = Syncbox->update(H->get_syncword()) ? true: jump;
@@ -933,10 +1514,28 @@ SmurfFilter::SmurfFilter(uint num_samples, uint num_records)
 {
   records = num_records;
   samples = num_samples;
+  max_samples = num_samples;
+  stride = row_stride(samples);
   clear = false;
-  xd = (filter_t*)malloc(samples * records * sizeof(filter_t));  // don't bother checking valid, only at startup, fix later
-  yd =  (filter_t*)malloc(samples * records * sizeof(filter_t));
-  output = (avgdata_t*) malloc(samples * sizeof(avgdata_t));
+  // per channel arrays are cache line aligned, and their rows too (see row_stride), so channel
+  // blocks on different threads don't share lines
+  xd = (filter_t*)cache_aligned_malloc(stride * records * sizeof(filter_t));  // don't bother checking valid, only at startup, fix later
+  yd =  (filter_t*)cache_aligned_malloc(stride * records * sizeof(filter_t));
+  scratch = (avgdata_t*) cache_aligned_malloc(samples * sizeof(avgdata_t));
+  output = scratch;
+  xr = (filter_t**) malloc(records * sizeof(filter_t*));
+  yr = (filter_t**) malloc(records * sizeof(filter_t*));
+  iir = select_iir_kernel();
+  printf("Using %s IIR filter kernel\n", iir_kernel_name(iir));
+  sos_state = (sos_t*) cache_aligned_malloc(stride * filter_max_sections * 2 * sizeof(sos_t));
+  sos = select_sos_kernel();
+  printf("Using %s SOS filter kernel\n", sos_kernel_name(sos));
+  sum = (int64_t*) cache_aligned_malloc(samples * sizeof(int64_t));
+  avg = select_avg_kernel();
+  printf("Using %s flat average kernel\n", avg_kernel_name(avg));
+  fir = true;
+  emit_n = true;
+  warm_n = false;
   bn = 0;
   clear_filter();
 }
@@ -944,65 +1543,186 @@ SmurfFilter::SmurfFilter(uint num_samples, uint num_records)
 
 void SmurfFilter::clear_filter(void)
 {
-  memset(xd, 0, records * samples * sizeof(filter_t));
-  memset(yd, 0, records * samples * sizeof(filter_t));
+  memset(xd, 0, records * stride * sizeof(filter_t));
+  memset(yd, 0, records * stride * sizeof(filter_t));
+  memset(sos_state, 0, stride * filter_max_sections * 2 * sizeof(sos_t));
+  memset(sum, 0, samples * sizeof(int64_t));
   samples_since_clear = 0;  // reset
-  order_n = -1;
   bn = 0;  // ring buffer pointers back to zero
 }
 
+void SmurfFilter::set_samples(uint num_samples)
+{
+  if (num_samples > max_samples)
+    num_samples = max_samples;
+
+  if (num_samples == samples)
+    return;
+
+  samples = num_samples;
+  stride = row_stride(samples); // ring buffer records are packed with the new stride
+  clear_filter();
+}
+
 void SmurfFilter::end_run()
 {
-  if(order_n == -1)
+  if((running.sos_n == 0) && (running.order == -1))
   {
     clear_filter();
   }
 }
 
-avgdata_t *SmurfFilter::filter(avgdata_t *data, int order, filter_t *a, filter_t *b, filter_t g)
+void SmurfFilter::swap(const FilterParams *p)
 {
-  if(order_n != order)
-  {
-    clear_filter();
-  }
+  bool same = running.sameFilter(*p);
 
-  order_n = order;  // used to clear when using the flat average filter
-  samples_since_clear++;
+  running = *p;  // the published object can be freed once we move on, keep a copy
+
+  if (running.order >= (int) records)
+    running.order = records - 1; // the ring buffer doesn't hold more history than this
+
+  if (running.order > 15)
+    running.order = 15; // size of the coefficient arrays
+
+  if (running.sos_n > (int) filter_max_sections)
+    running.sos_n = filter_max_sections;
+
+  for (int k = 0; k < running.sos_n; k++)
+    for (int i = 0; i < 5; i++)
+      sos_coef[5 * k + i] = (sos_t) running.sos[k][i];
+
+  fir = true; // y(n) only depends on x, so it is only needed when it is sent out
+
+  for (int r = 1; r <= running.order; r++)
+    fir = fir && (running.a[r] == 0);
+
+  if (same)
+    return;  // only the gain or the flags changed, keep going
+
+  clear_filter();
 
-  if (order == -1) // special case flat average filter
+  // the steady state depends on the input, so it is set by each block
+  warm_n = running.warm_start && ((running.sos_n > 0) || (running.order >= 0));
+}
+
+void SmurfFilter::warm_start(const avgdata_t *data, uint first, uint count)
+{
+  if (running.sos_n > 0)
   {
-    for(uint n = 0; n <  samples;  n++)
+    for (int k = 0; k < running.sos_n; k++)
     {
-      *(yd + bn * samples + n) += (filter_t) (*(data+n)); // just sum into first record.
-      *(output+n) = (avgdata_t) (*(yd+bn*samples + n) / (filter_t) samples_since_clear);  // convert
+      const filter_t *c = running.sos[k];
+      if (1 + c[3] + c[4] == 0)
+        return; // pole at dc, there is no steady state: stay cleared
     }
+
+    for (uint j = first; j < first + count; j++)
+    {
+      filter_t v = (filter_t) data[j];
+
+      for (int k = 0; k < running.sos_n; k++)
+      {
+        const filter_t *c = running.sos[k];
+        filter_t y = v * (c[0] + c[1] + c[2]) / (1 + c[3] + c[4]); // dc gain of the section
+
+        sos_state[(2 * k) * stride + j]     = (sos_t) (y - c[0] * v);
+        sos_state[(2 * k + 1) * stride + j] = (sos_t) (c[2] * v - c[4] * y);
+        v = y;
+      }
+    }
+
+    return;
   }
-  else
+
+  filter_t sa = 0, sb = 0;
+
+  for (int r = 0; r <= running.order; r++)
   {
-    bn = (bn + 1) % records;  // increment ring buffer pointer
+    sa += running.a[r];
+    sb += running.b[r];
+  }
+
+  if (sa == 0)
+    return; // pole at dc, there is no steady state: stay cleared
 
-    for (uint n = 0; n < samples; n++)
+  for (uint r = 0; r < records; r++) // every record, so any order sees a constant history
+  {
+    for (uint j = first; j < first + count; j++)
     {
-      *(xd + bn * samples + n) = (filter_t) (*(data+n));  // convert to doubles
+      xd[r * stride + j] = (filter_t) data[j];
+      yd[r * stride + j] = (filter_t) data[j] * sb / sa;
     }
+  }
+}
 
-    memset(yd + bn * samples, 0, samples * sizeof(filter_t)); // clear new y data
+avgdata_t *SmurfFilter::filter(avgdata_t *data, const FilterParams *p, bool emit)
+{
+  begin_frame(p, emit);
+  filter_block(data, 0, samples);
+  return(output);
+}
 
-    for (uint n = 0; n < samples; n++) // loop over channels for filter
-    {
-      *(yd + bn * samples + n) = b[0] * *(xd + bn * samples + n);
+void SmurfFilter::begin_frame(const FilterParams *p, bool emit, avgdata_t *out)
+{
+  warm_n = false;
+  output = out ? out : scratch;
 
-      for(int r = 1; r <= order; r++) // one more record than order.(eg order = 0 is record)
-      {
-        int nx = (bn - r) % records;  // should give the correct buffer reference
-        *(yd + bn * samples + n) += b[r] * *(xd + nx * samples + n) - a[r] * *(yd + nx * samples + n);
-      }
+  if (p->version != running.version) // new settings, picked up at the frame boundary
+    swap(p);
+
+  emit_n = emit;
+  samples_since_clear++;
+
+  if ((running.sos_n > 0) || (running.order == -1))
+    return;
+
+  bn = (bn + 1) % records;  // increment ring buffer pointer
+
+  // Precompute the ring buffer records of x(n-r) and y(n-r), so the kernel
+  // doesn't do any index arithmetic. One more record than order (eg order = 0 is record)
+  for (int r = 0; r <= running.order; r++)
+  {
+    uint nx = (bn + records - r) % records;
+    xr[r] = xd + nx * stride;
+    yr[r] = yd + nx * stride;
+  }
+}
+
+void SmurfFilter::filter_block(const avgdata_t *data, uint first, uint count)
+{
+  if (warm_n)
+    warm_start(data, first, count);
+
+  if (running.sos_n > 0)
+  {
+    sos(data + first, sos_state + first, stride, sos_coef, running.sos_n, (sos_t) running.g, count, output + first);
+  }
+  else if (running.order == -1) // special case flat average filter
+  {
+    avg(data + first, sum + first, count);
 
-      *(yd +bn * samples + n) = *(yd+bn * samples +n) / a[0];  // divide final answer
-      *(output+n) = (avgdata_t) ( *(yd+bn*samples + n) * (g) );
+    if (emit_n) // the average is only needed when it is sent out
+      avg_divide(sum + first, samples_since_clear, count, output + first);
+  }
+  else if (fir && running.decimate && !emit_n)
+  {
+    filter_t *x0 = xr[0] + first;
+
+    for (uint j = 0; j < count; j++)
+      x0[j] = (filter_t) data[first + j];  // just keep the input, the output is not used
+  }
+  else
+  {
+    filter_t *x[16], *y[16]; // records of this block
+
+    for (int r = 0; r <= running.order; r++)
+    {
+      x[r] = xr[r] + first;
+      y[r] = yr[r] + first;
     }
+
+    iir(data + first, x, y, running.a, running.b, running.g, running.order, count, output + first);
   }
-  return(output);
 }
 
 
@@ -1132,6 +1852,7 @@ BOOST_PYTHON_MODULE(Smurf)
   try
   {
     SmurfProcessor::setup_python();
+    SmurfFileReaderPy::setup_python();
   }
   catch (...)
   {
@@ -1,4 +1,5 @@
 #include "tes_bias_array.h"
+#include <string.h>
 
 TesBiasArray::TesBiasArray(uint8_t *p)
 :
@@ -68,7 +69,74 @@ const int32_t TesBiasArray::getWord(const WordIndex& index) const
   return S { static_cast<int>( *( reinterpret_cast<uint32_t*>( pData + 5*index.Block() + offset ) ) >> shift )  }.word;
 }
 
-std::mutex* TesBiasArray::getMutex()
+static_assert(TesBiasBufferSize % sizeof(uint64_t) == 0, "The TES bias array is published as 64 bit words");
+
+TesBiasPublisher::TesBiasPublisher()
+:
+  seq     ( 0       ),
+  staging (         ),
+  tba     ( staging ),
+  mut     (         )
+{
+  for (std::size_t i = 0; i < NumWords; ++i)
+    words[i].store(0, std::memory_order_relaxed);
+}
+
+void TesBiasPublisher::read(uint8_t *dst) const
+{
+  uint64_t w[NumWords];
+  uint32_t s;
+
+  do
+  {
+    s = seq.load(std::memory_order_acquire);
+
+    for (std::size_t i = 0; i < NumWords; ++i)
+      w[i] = words[i].load(std::memory_order_relaxed);
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+  }
+  while ((s & 1) || (s != seq.load(std::memory_order_relaxed)));
+
+  memcpy(dst, w, TesBiasBufferSize);
+}
+
+void TesBiasPublisher::setWord(std::size_t index, int32_t value)
+{
+  std::lock_guard<std::mutex> lock(mut);
+
+  tba.setWord(index, value);
+  publish();
+}
+
+void TesBiasPublisher::setWords(const int32_t *values)
+{
+  std::lock_guard<std::mutex> lock(mut);
+
+  for (std::size_t i = 0; i < TesBiasCount; ++i)
+    tba.setWord(i, values[i]);
+
+  publish();
+}
+
+int32_t TesBiasPublisher::getWord(std::size_t index)
 {
-  return &mut;
-};
\ No newline at end of file
+  std::lock_guard<std::mutex> lock(mut);
+  return tba.getWord(index);
+}
+
+void TesBiasPublisher::publish()
+{
+  uint64_t w[NumWords];
+  uint32_t s = seq.load(std::memory_order_relaxed);
+
+  memcpy(w, staging, TesBiasBufferSize);
+
+  seq.store(s + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  for (std::size_t i = 0; i < NumWords; ++i)
+    words[i].store(w[i], std::memory_order_relaxed);
+
+  seq.store(s + 2, std::memory_order_release);
+}
\ No newline at end of file
@@ -0,0 +1,165 @@
+#include "unwrap.h"
+#include "common.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define UNWRAP_HAVE_X86
+#endif
+
+// Each kernel is a template on the channel count. N = 0 is the generic version, while
+// the common sizes (528, 1024, 2048 and 4096) get their own instances with a compile
+// time trip count and no loop tail.
+#define UNWRAP_DISPATCH(kernel) \
+  switch (n) \
+  { \
+    case 528:  kernel<528>(raw, mask, n, last, wrap, out);  break; \
+    case 1024: kernel<1024>(raw, mask, n, last, wrap, out); break; \
+    case 2048: kernel<2048>(raw, mask, n, last, wrap, out); break; \
+    case 4096: kernel<4096>(raw, mask, n, last, wrap, out); break; \
+    default:   kernel<0>(raw, mask, n, last, wrap, out);    break; \
+  }
+
+template <uint N>
+static void unwrap_scalar_n(const smurf_t *raw, const uint *mask, uint n, smurf_t *last, wrap_t *wrap, avgdata_t *out)
+{
+  const uint count = N ? N : n;
+
+  for(uint j = 0; j < count; j++)
+  {
+    smurf_t dx = raw[mask[j]];
+
+    if ((dx > upper_unwrap) && (last[j] < lower_unwrap)) // unwrap, add 1
+      wrap[j] -= 0x10000; // decrement wrap counter
+    else if ((dx < lower_unwrap) && (last[j] > upper_unwrap))
+      wrap[j] += 0x10000; // increment wrap counter
+
+    last[j] = dx; // keep for the next frame
+    out[j] = (avgdata_t)(dx) + (avgdata_t) wrap[j];
+  }
+}
+
+void unwrap_scalar(const smurf_t *raw, const uint *mask, uint n, smurf_t *last, wrap_t *wrap, avgdata_t *out)
+{
+  UNWRAP_DISPATCH(unwrap_scalar_n);
+}
+
+#ifdef UNWRAP_HAVE_X86
+
+// 8 channels per iteration. The gather reads the 32-bit word holding (raw[m-1], raw[m]);
+// an arithmetic shift right by 16 leaves raw[m] sign extended.
+template <uint N>
+__attribute__((target("avx2")))
+static void unwrap_avx2_n(const smurf_t *raw, const uint *mask, uint n, smurf_t *last, wrap_t *wrap, avgdata_t *out)
+{
+  const uint count = N ? N : n;
+  const __m256i one   = _mm256_set1_epi32(1);
+  const __m256i upper = _mm256_set1_epi32(upper_unwrap);
+  const __m256i lower = _mm256_set1_epi32(lower_unwrap);
+  const __m256i step  = _mm256_set1_epi32(0x10000);
+  const int     *base = reinterpret_cast<const int*>(raw);
+  uint j = 0;
+
+  for (; j + 8 <= count; j += 8)
+  {
+    __m256i idx  = _mm256_sub_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(mask + j)), one);
+    __m256i cur  = _mm256_srai_epi32(_mm256_i32gather_epi32(base, idx, 2), 16);
+    __m256i prev = _mm256_cvtepi16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(last + j)));
+    __m256i w    = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(wrap + j));
+
+    __m256i dec  = _mm256_and_si256(_mm256_cmpgt_epi32(cur, upper), _mm256_cmpgt_epi32(lower, prev));
+    __m256i inc  = _mm256_and_si256(_mm256_cmpgt_epi32(lower, cur), _mm256_cmpgt_epi32(prev, upper));
+    w = _mm256_sub_epi32(w, _mm256_and_si256(dec, step));
+    w = _mm256_add_epi32(w, _mm256_and_si256(inc, step));
+
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(wrap + j), w);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + j), _mm256_add_epi32(cur, w));
+
+    // Narrow back to 16 bits. The values came from 16-bit samples, so nothing saturates.
+    __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(cur, cur), 0x08);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(last + j), _mm256_castsi256_si128(packed));
+  }
+
+  if (j < count)
+    unwrap_scalar_n<0>(raw, mask + j, count - j, last + j, wrap + j, out + j);
+}
+
+void unwrap_avx2(const smurf_t *raw, const uint *mask, uint n, smurf_t *last, wrap_t *wrap, avgdata_t *out)
+{
+  UNWRAP_DISPATCH(unwrap_avx2_n);
+}
+
+// 16 channels per iteration, same gather trick as the AVX2 kernel, with the wrap
+// counter update done as masked add/sub.
+template <uint N>
+__attribute__((target("avx512f")))
+static void unwrap_avx512_n(const smurf_t *raw, const uint *mask, uint n, smurf_t *last, wrap_t *wrap, avgdata_t *out)
+{
+  const uint count = N ? N : n;
+  const __m512i one   = _mm512_set1_epi32(1);
+  const __m512i upper = _mm512_set1_epi32(upper_unwrap);
+  const __m512i lower = _mm512_set1_epi32(lower_unwrap);
+  const __m512i step  = _mm512_set1_epi32(0x10000);
+  uint j = 0;
+
+  for (; j + 16 <= count; j += 16)
+  {
+    __m512i idx  = _mm512_sub_epi32(_mm512_loadu_si512(mask + j), one);
+    __m512i cur  = _mm512_srai_epi32(_mm512_i32gather_epi32(idx, raw, 2), 16);
+    __m512i prev = _mm512_cvtepi16_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(last + j)));
+    __m512i w    = _mm512_loadu_si512(wrap + j);
+
+    __mmask16 dec = _mm512_cmpgt_epi32_mask(cur, upper) & _mm512_cmplt_epi32_mask(prev, lower);
+    __mmask16 inc = _mm512_cmplt_epi32_mask(cur, lower) & _mm512_cmpgt_epi32_mask(prev, upper);
+    w = _mm512_mask_sub_epi32(w, dec, w, step);
+    w = _mm512_mask_add_epi32(w, inc, w, step);
+
+    _mm512_storeu_si512(wrap + j, w);
+    _mm512_storeu_si512(out + j, _mm512_add_epi32(cur, w));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(last + j), _mm512_cvtepi32_epi16(cur));
+  }
+
+  if (j < count)
+    unwrap_scalar_n<0>(raw, mask + j, count - j, last + j, wrap + j, out + j);
+}
+
+void unwrap_avx512(const smurf_t *raw, const uint *mask, uint n, smurf_t *last, wrap_t *wrap, avgdata_t *out)
+{
+  UNWRAP_DISPATCH(unwrap_avx512_n);
+}
+
+#else
+
+// Vector kernels are x86 only. Keep the symbols so callers don't need to care.
+void unwrap_avx2(const smurf_t *raw, const uint *mask, uint n, smurf_t *last, wrap_t *wrap, avgdata_t *out)
+{
+  unwrap_scalar(raw, mask, n, last, wrap, out);
+}
+
+void unwrap_avx512(const smurf_t *raw, const uint *mask, uint n, smurf_t *last, wrap_t *wrap, avgdata_t *out)
+{
+  unwrap_scalar(raw, mask, n, last, wrap, out);
+}
+
+#endif
+
+unwrap_kernel_t select_unwrap_kernel(void)
+{
+  if (cpu_has_avx512())
+    return(unwrap_avx512);
+
+  if (cpu_has_avx2())
+    return(unwrap_avx2);
+
+  return(unwrap_scalar);
+}
+
+const char *unwrap_kernel_name(unwrap_kernel_t kernel)
+{
+  if (kernel == unwrap_avx512)
+    return("avx512");
+
+  if (kernel == unwrap_avx2)
+    return("avx2");
+
+  return("scalar");
+}
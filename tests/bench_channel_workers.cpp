@@ -0,0 +1,144 @@
+// Scaling of the per frame work (unwrap, then the 4th order IIR filter) over the channel worker
+// threads, as SmurfProcessor::process_block runs it. The filter history records are laid out
+// with row_stride() channels, as in SmurfFilter, or packed (stride = number of channels), which
+// makes the blocks of neighbouring threads share the cache lines at the record boundaries.
+//
+//   bench_channel_workers [channels [max_partitions [first_cpu]]]
+
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "channel_workers.h"
+#include "filter_kernels.h"
+#include "unwrap.h"
+
+static const unsigned records = 16;
+static const int      order   = 4;
+
+static const filter_t butterA[5] = { 1.0, -3.741497676422641, 5.25738179278082, -3.2878720008343643, 0.7720723746179725 };
+static const filter_t butterB[5] = { 5.280633861680253e-06, 2.112253544672101e-05, 3.168380317008152e-05, 2.112253544672101e-05, 5.280633861680253e-06 };
+
+struct Frame
+{
+  unsigned        n;
+  unsigned        stride;
+  int             bn;
+  const smurf_t  *raw;
+  uint           *mask;
+  smurf_t        *last;
+  wrap_t         *wrap;
+  avgdata_t      *in;
+  avgdata_t      *out;
+  filter_t       *xd;
+  filter_t       *yd;
+  filter_t       *xr[records];
+  filter_t       *yr[records];
+  unwrap_kernel_t unwrap;
+  iir_kernel_t    iir;
+
+  Frame(unsigned channels, unsigned rowStride, const smurf_t *samples)
+  : n(channels), stride(rowStride), bn(0), raw(samples),
+    mask((uint*) cache_aligned_malloc(channels * sizeof(uint))),
+    last((smurf_t*) cache_aligned_malloc(channels * sizeof(smurf_t))),
+    wrap((wrap_t*) cache_aligned_malloc(channels * sizeof(wrap_t))),
+    in((avgdata_t*) cache_aligned_malloc(channels * sizeof(avgdata_t))),
+    out((avgdata_t*) cache_aligned_malloc(channels * sizeof(avgdata_t))),
+    xd((filter_t*) cache_aligned_malloc(rowStride * records * sizeof(filter_t))),
+    yd((filter_t*) cache_aligned_malloc(rowStride * records * sizeof(filter_t))),
+    unwrap(select_unwrap_kernel()), iir(select_iir_kernel())
+  {
+    for (unsigned j = 0; j < n; ++j)
+      mask[j] = j % smurf_raw_samples;
+
+    memset(last, 0, n * sizeof(smurf_t));
+    memset(wrap, 0, n * sizeof(wrap_t));
+    memset(xd, 0, stride * records * sizeof(filter_t));
+    memset(yd, 0, stride * records * sizeof(filter_t));
+  };
+
+  ~Frame()
+  {
+    free(mask);
+    free(last);
+    free(wrap);
+    free(in);
+    free(out);
+    free(xd);
+    free(yd);
+  };
+
+  // SmurfFilter::begin_frame
+  void begin()
+  {
+    bn = (bn + 1) % records;
+
+    for (int r = 0; r <= order; ++r)
+    {
+      unsigned nx = (bn + records - r) % records;
+      xr[r] = xd + nx * stride;
+      yr[r] = yd + nx * stride;
+    }
+  };
+
+  // SmurfProcessor::process_block
+  static void block(void *ctx, unsigned first, unsigned count)
+  {
+    Frame    *f = static_cast<Frame*>(ctx);
+    filter_t *x[order + 1], *y[order + 1];
+
+    f->unwrap(f->raw, f->mask + first, count, f->last + first, f->wrap + first, f->in + first);
+
+    for (int r = 0; r <= order; ++r)
+    {
+      x[r] = f->xr[r] + first;
+      y[r] = f->yr[r] + first;
+    }
+
+    f->iir(f->in + first, x, y, butterA, butterB, 1.0, order, count, f->out + first);
+  };
+};
+
+int main(int argc, char **argv)
+{
+  unsigned n        = (argc > 1) ? strtoul(argv[1], NULL, 0) : 4000;
+  unsigned maxParts = (argc > 2) ? strtoul(argv[2], NULL, 0) : std::thread::hardware_concurrency();
+  int      firstCpu = (argc > 3) ? atoi(argv[3]) : -1;
+  int      frames   = 20000;
+
+  // The samples follow a header, as in a frame
+  std::vector<uint8_t> data(smurfdatalength);
+  smurf_t             *raw = reinterpret_cast<smurf_t*>(data.data() + smurfheaderlength);
+
+  printf("%u channels, %s unwrap and %s IIR kernels\n", n,
+    unwrap_kernel_name(select_unwrap_kernel()), iir_kernel_name(select_iir_kernel()));
+  printf("partitions   row_stride (ns/frame)   packed (ns/frame)\n");
+
+  for (unsigned p = 1; p <= maxParts; p *= 2)
+  {
+    double ns[2];
+
+    for (int packed = 0; packed < 2; ++packed)
+    {
+      Frame          f(n, packed ? n : row_stride(n), raw);
+      ChannelWorkers w;
+      w.start(p, firstCpu);
+
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+      for (int i = 0; i < frames; ++i)
+      {
+        raw[(i * 97) % smurf_raw_samples] = (smurf_t) rand();
+        f.begin();
+        w.run(n, &Frame::block, &f);
+      }
+
+      ns[packed] = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / frames;
+    }
+
+    printf("%10u   %20.0f   %17.0f\n", p, ns[0], ns[1]);
+  }
+
+  return(0);
+}
@@ -0,0 +1,12 @@
+// Stand-in for the rogue header, declarations only: lets the module sources be compiled where
+// rogue is not installed (see tests/CMakeLists.txt). Nothing built with it is linked.
+#pragma once
+
+namespace rogue
+{
+  class GilRelease
+  {
+  public:
+    GilRelease();
+  };
+}
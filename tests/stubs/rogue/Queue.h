@@ -0,0 +1,14 @@
+// Stand-in for the rogue header, declarations only (see GilRelease.h)
+#pragma once
+
+namespace rogue
+{
+  template<typename T> class Queue
+  {
+  public:
+    void setThold(unsigned thold);
+    bool busy();
+    void push(T data);
+    T    pop();
+  };
+}
@@ -0,0 +1,12 @@
+// Stand-in for the rogue header, declarations only (see GilRelease.h)
+#pragma once
+
+namespace rogue
+{
+  class ScopedGil
+  {
+  public:
+    ScopedGil();
+    ~ScopedGil();
+  };
+}
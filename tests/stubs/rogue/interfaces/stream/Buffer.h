@@ -0,0 +1,23 @@
+// Stand-in for the rogue header, declarations only (see rogue/GilRelease.h)
+#pragma once
+
+#include <stdint.h>
+#include <boost/shared_ptr.hpp>
+
+namespace rogue { namespace interfaces { namespace stream {
+
+  class Buffer
+  {
+  public:
+    typedef uint8_t* iterator;
+
+    iterator begin();
+    iterator end();
+    iterator endPayload();
+    uint32_t getPayload();
+    uint32_t getSize();
+  };
+
+  typedef boost::shared_ptr<Buffer> BufferPtr;
+
+}}}
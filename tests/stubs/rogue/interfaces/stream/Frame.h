@@ -0,0 +1,24 @@
+// Stand-in for the rogue header, declarations only (see rogue/GilRelease.h)
+#pragma once
+
+#include <vector>
+#include <rogue/interfaces/stream/Buffer.h>
+
+namespace rogue { namespace interfaces { namespace stream {
+
+  class Frame
+  {
+  public:
+    typedef std::vector<BufferPtr>::iterator BufferIterator;
+
+    BufferIterator beginBuffer();
+    BufferIterator endBuffer();
+    uint32_t       bufferCount();
+    uint32_t       getPayload();
+    uint32_t       getError();
+    uint32_t       getFlags();
+  };
+
+  typedef boost::shared_ptr<Frame> FramePtr;
+
+}}}
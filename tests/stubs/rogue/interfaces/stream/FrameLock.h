@@ -0,0 +1,2 @@
+// Stand-in for the rogue header (see rogue/GilRelease.h). The module doesn't use it directly.
+#pragma once
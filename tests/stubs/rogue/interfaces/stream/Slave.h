@@ -0,0 +1,21 @@
+// Stand-in for the rogue header, declarations only (see rogue/GilRelease.h)
+#pragma once
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include <boost/atomic.hpp>
+#include <rogue/interfaces/stream/Frame.h>
+#include <rogue/Queue.h>
+
+namespace rogue { namespace interfaces { namespace stream {
+
+  class Slave
+  {
+  public:
+    virtual ~Slave() {}
+    virtual void acceptFrame(FramePtr frame) {}
+  };
+
+  typedef boost::shared_ptr<Slave> SlavePtr;
+
+}}}
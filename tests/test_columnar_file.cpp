@@ -0,0 +1,241 @@
+// Data files written by FileWriter (raw) and ColumnarWriter (columnar, with and without the
+// codec), read back with SmurfFileReader: whole packets, channels and header fields, across
+// chunks and a change in the number of channels, and files cut while being written.
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include <random>
+#include "smurf_file_reader.h"
+#include "columnar_writer.h"
+#include "file_writer.h"
+#include "test_util.h"
+
+static const std::size_t numFrames = 5500;
+
+static uint32_t channels(std::size_t f)
+{
+  return (f < 2000) ? 528 : (f < 2100) ? 4096 : 1000;
+}
+
+static avgdata_t value(std::size_t f, uint32_t ch)
+{
+  uint32_t h = (f * 2654435761u) ^ (ch * 40503u);
+  h ^= h >> 13;
+  h *= 0x5bd1e995;
+  h ^= h >> 15;
+
+  return (avgdata_t) (100000 * sin(f * 0.003 + ch)) + (avgdata_t) (h % 64) - 32;
+}
+
+static uint64_t unix_time(std::size_t f)
+{
+  return 1000000000ULL + 250000ULL * f;
+}
+
+// The packets, with random values in the header fields
+static std::vector<std::vector<uint8_t> > make_packets(void)
+{
+  std::mt19937                        rng(3);
+  std::vector<std::vector<uint8_t> >  pk(numFrames);
+  bool                                field[smurfheaderlength] = { false };
+
+  for (int g = 0; g < hfCount; ++g)
+    for (std::size_t b = 0; b < smurfHeaderLayoutV1[g].width; ++b)
+      field[smurfHeaderLayoutV1[g].offset + b] = true;
+
+  for (std::size_t f = 0; f < numFrames; ++f)
+  {
+    uint32_t ch = channels(f);
+    pk[f].resize(smurfheaderlength + ch * sizeof(avgdata_t));
+
+    for (std::size_t b = 0; b < smurfheaderlength; ++b)
+      pk[f][b] = field[b] ? rng() : 0;
+
+    setHeaderField<hfFrameCounter, uint32_t>(pk[f].data(), f);
+    setHeaderField<hfUnixTime, uint64_t>(pk[f].data(), unix_time(f));
+    setHeaderField<hfNumberChannels, uint32_t>(pk[f].data(), ch);
+
+    avgdata_t *p = reinterpret_cast<avgdata_t*>(pk[f].data() + smurfheaderlength);
+
+    for (uint32_t j = 0; j < ch; ++j)
+      p[j] = value(f, j);
+  }
+
+  return pk;
+}
+
+// format: 0 raw, 1 columnar, 2 columnar with the codec
+static void write_file(const std::string &name, int format, const std::vector<std::vector<uint8_t> > &pk)
+{
+  FileWriter     w;
+  ColumnarWriter c(w);
+
+  CHECK(w.open(name.c_str(), format == 1, false));
+
+  if (format)
+    c.begin(1000, (format == 2) ? ColumnarCodecDelta : ColumnarCodecNone);
+
+  for (std::size_t f = 0; f < pk.size(); ++f)
+  {
+    SmurfPacketView v = { pk[f].data(), pk[f].size(), pk[f].data(), smurfheaderlength,
+                          reinterpret_cast<const avgdata_t*>(pk[f].data() + smurfheaderlength), channels(f) };
+
+    if (format)
+      c.append(v);
+    else
+      w.write(v.data, v.length);
+  }
+
+  c.end();
+  w.close();
+  CHECK(!w.getErrorCnt());
+}
+
+static void check_file(const std::string &name, int format, const std::vector<std::vector<uint8_t> > &pk)
+{
+  SmurfFileReader r(name);
+
+  CHECK(r.getNumFrames() == numFrames);
+  CHECK(r.getMaxChannels() == 4096);
+  CHECK(r.isColumnar() == (format != 0));
+
+  if (format)
+    CHECK(r.getCodec() == ((format == 2) ? ColumnarCodecDelta : ColumnarCodecNone));
+
+  // Whole packets, every frame around the chunk and channel count boundaries
+  for (std::size_t f = 0; f < numFrames; f += ((f > 1990) && (f < 2110)) ? 1 : 37)
+  {
+    SmurfPacket_RO  p = r.getPacket(f);
+    SmurfPacketView v = p->getView();
+
+    CHECK(v.length == pk[f].size());
+    CHECK(!memcmp(v.data, pk[f].data(), v.length));
+    CHECK(r.getNumChannels(f) == channels(f));
+  }
+
+  // Channels, with 0 for frames which don't have them
+  std::vector<avgdata_t> out(numFrames + 100);
+  uint32_t               chans[] = { 0, 5, 527, 999, 4095 };
+
+  for (std::size_t i = 0; i < sizeof(chans) / sizeof(chans[0]); ++i)
+  {
+    uint32_t ch = chans[i];
+
+    CHECK(r.readChannel(ch, 0, numFrames + 100, out.data()) == numFrames);
+
+    for (std::size_t f = 0; f < numFrames; ++f)
+      CHECK(out[f] == ((ch < channels(f)) ? value(f, ch) : 0));
+
+    CHECK(r.readChannel(ch, 1995, 10, out.data()) == 10);
+
+    for (std::size_t f = 0; f < 10; ++f)
+      CHECK(out[f] == ((ch < channels(1995 + f)) ? value(1995 + f, ch) : 0));
+  }
+
+  // Header fields
+  std::vector<uint64_t> t(numFrames);
+  CHECK(r.readHeaderField(hfUnixTime, 0, numFrames, t.data()) == numFrames);
+
+  for (std::size_t f = 0; f < numFrames; ++f)
+    CHECK(t[f] == unix_time(f));
+
+  CHECK(r.findUnixTime(unix_time(777) - 5) == 777);
+  CHECK(r.findUnixTime(0) == 0);
+  CHECK(r.findUnixTime(~0ULL) == numFrames);
+}
+
+static long file_size(const std::string &name)
+{
+  FILE *f = fopen(name.c_str(), "rb");
+
+  if (!f)
+    return(-1);
+
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  fclose(f);
+
+  return(size);
+}
+
+int main(void)
+{
+  char dir[] = "/tmp/smurf_test_XXXXXX";
+
+  if (!mkdtemp(dir))
+  {
+    perror("mkdtemp");
+    return(1);
+  }
+
+  std::vector<std::vector<uint8_t> > pk = make_packets();
+  std::string                        names[3] = { std::string(dir) + "/raw.dat", std::string(dir) + "/col.dat", std::string(dir) + "/codec.dat" };
+
+  for (int format = 0; format < 3; ++format)
+  {
+    write_file(names[format], format, pk);
+    check_file(names[format], format, pk);
+  }
+
+  CHECK(file_size(names[2]) < file_size(names[1]));
+
+  // A packet outlives its reader
+  SmurfPacket_RO keep;
+  {
+    SmurfFileReader r(names[0]);
+    keep = r.getPacket(3);
+  }
+  CHECK(keep->getFrameCounter() == 3);
+  CHECK(keep->getValue(7) == value(3, 7));
+
+  // Files cut while being written: a raw one in the middle of a packet, a columnar one without
+  // its index and trailer, and one in the middle of a chunk
+  CHECK(!truncate(names[0].c_str(), 1000 * (smurfheaderlength + 528 * sizeof(avgdata_t)) + 77));
+  {
+    SmurfFileReader r(names[0]);
+    CHECK(r.getNumFrames() == 1000);
+  }
+
+  CHECK(!truncate(names[1].c_str(), file_size(names[1]) - 32));
+  {
+    SmurfFileReader r(names[1]);
+    CHECK(r.getNumFrames() == numFrames);
+  }
+
+  CHECK(!truncate(names[2].c_str(), file_size(names[2]) / 2));
+  {
+    SmurfFileReader r(names[2]);
+    CHECK(r.getNumFrames() > 0);
+    CHECK(r.getNumFrames() < numFrames);
+
+    std::vector<avgdata_t> out(r.getNumFrames());
+    CHECK(r.readChannel(5, 0, out.size(), out.data()) == out.size());
+
+    for (std::size_t f = 0; f < out.size(); ++f)
+      CHECK(out[f] == value(f, 5));
+  }
+
+  bool thrown = false;
+
+  try
+  {
+    SmurfFileReader r(std::string(dir) + "/missing.dat");
+  }
+  catch (std::runtime_error &e)
+  {
+    thrown = true;
+  }
+
+  CHECK(thrown);
+
+  for (int i = 0; i < 3; ++i)
+    unlink(names[i].c_str());
+
+  rmdir(dir);
+
+  return(test_result());
+}
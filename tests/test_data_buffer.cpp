@@ -0,0 +1,292 @@
+// DataBuffer (data_buffer.h): what each reader policy does when the reader is full, a full
+// reader holding its oldest packet, run time size changes, and one writer with several reader
+// threads.
+
+#include <stdint.h>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include "data_buffer.h"
+#include "test_util.h"
+
+// Write packet 'n' (its number in the first value), returns false if it is dropped
+static bool write(DataBuffer &b, int n)
+{
+  SmurfPacket p = b.getWritePtr();
+
+  if (!p)
+    return(false);
+
+  p->setPayloadLength(2);
+  p->setValue(0, n);
+  p->setValue(1, n);
+  b.doneWriting();
+
+  return(true);
+}
+
+// Read the next packet of reader 'r', returns its number
+static int read(DataBuffer &b, std::size_t r)
+{
+  int n = b.getReadPtr(r)->getValue(0);
+  b.doneReading(r);
+
+  return(n);
+}
+
+static double seconds_since(std::chrono::steady_clock::time_point t)
+{
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - t).count();
+}
+
+static void test_drop_oldest(void)
+{
+  DataBuffer  b(4, 2);
+  std::size_t r = b.attachReader(DataBuffer::DropOldest, 0);
+
+  for (int n = 0; n < 10; ++n)
+    CHECK(write(b, n));
+
+  // The reader keeps the newest packets
+  CHECK(b.getLag(r) == 4);
+  CHECK(b.getOWCnt(r) == 6);
+  CHECK(b.getHighWater(r) == 4);
+
+  for (int n = 6; n < 10; ++n)
+    CHECK(read(b, r) == n);
+
+  CHECK(b.isEmpty(r));
+
+  bool thrown = false;
+
+  try
+  {
+    b.getReadPtr(r);
+  }
+  catch (std::runtime_error &e)
+  {
+    thrown = true;
+  }
+
+  CHECK(thrown);
+  CHECK(b.getROFCnt(r) == 1);
+}
+
+static void test_drop_newest(void)
+{
+  DataBuffer  b(4, 2);
+  std::size_t r0 = b.attachReader(DataBuffer::DropNewest, 0);
+  std::size_t r1 = b.attachReader(DataBuffer::DropOldest, 0);
+
+  for (int n = 0; n < 10; ++n)
+    CHECK(write(b, n) == (n < 4));
+
+  // The packets are dropped for all the readers
+  CHECK(b.getDropCnt() == 6);
+  CHECK(b.getOWCnt(r0) == 0);
+  CHECK(b.getOWCnt(r1) == 0);
+
+  for (int n = 0; n < 4; ++n)
+  {
+    CHECK(read(b, r0) == n);
+    CHECK(read(b, r1) == n);
+  }
+
+  CHECK(write(b, 10));
+  CHECK(read(b, r0) == 10);
+}
+
+static void test_held_slot(void)
+{
+  DataBuffer  b(4, 2);
+  std::size_t r0 = b.attachReader(DataBuffer::DropOldest, 0);
+  std::size_t r1 = b.attachReader(DataBuffer::DropOldest, 0);
+
+  for (int n = 0; n < 4; ++n)
+    CHECK(write(b, n));
+
+  // r0 holds its oldest packet while the writer needs the slot: the packet is not dropped, and
+  // the one r0 holds is not overwritten
+  SmurfPacket_RO held = b.getReadPtr(r0);
+
+  for (int n = 4; n < 8; ++n)
+    CHECK(write(b, n));
+
+  CHECK(b.getDropCnt() == 0);
+  CHECK(held->getValue(0) == 0);
+  CHECK(held->getValue(1) == 0);
+
+  held.reset();
+  b.doneReading(r0);
+
+  // r0 lost the packets overwritten while it held packet 0, r1 the ones it didn't read
+  for (int n = 4; n < 8; ++n)
+  {
+    CHECK(read(b, r0) == n);
+    CHECK(read(b, r1) == n);
+  }
+
+  CHECK(b.getOWCnt(r0) == 3);
+  CHECK(b.getOWCnt(r1) == 4);
+}
+
+static void test_blocking(void)
+{
+  DataBuffer  b(4, 3);
+  std::size_t r0 = b.attachReader(DataBuffer::Blocking, 50);
+  std::size_t r1 = b.attachReader(DataBuffer::Blocking, 1000);
+
+  for (int n = 0; n < 4; ++n)
+    CHECK(write(b, n));
+
+  // A reader makes room while the writer waits: nothing is lost
+  std::thread t([&b, r0, r1]()
+  {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    read(b, r0);
+    read(b, r1);
+  });
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  CHECK(write(b, 4));
+  t.join();
+
+  CHECK(seconds_since(start) >= 0.015);
+  CHECK(b.getOWCnt(r0) == 0);
+  CHECK(b.getTimeoutCnt(r0) == 0);
+
+  // Nobody reads: the writer waits for the shortest timeout once, then both readers drop their
+  // oldest packets without waiting
+  start = std::chrono::steady_clock::now();
+
+  for (int n = 5; n < 25; ++n)
+    CHECK(write(b, n));
+
+  double s = seconds_since(start);
+  CHECK(s >= 0.045);
+  CHECK(s < 0.5);
+  CHECK(b.getTimeoutCnt(r0) + b.getTimeoutCnt(r1) == 2);
+  CHECK(b.getOWCnt(r0) == 20);
+
+  // Once a reader caught up, the writer waits for it again
+  while (!b.isEmpty(r0))
+    read(b, r0);
+
+  while (!b.isEmpty(r1))
+    read(b, r1);
+
+  for (int n = 25; n < 29; ++n)
+    CHECK(write(b, n));
+
+  start = std::chrono::steady_clock::now();
+  CHECK(write(b, 29));
+  CHECK(seconds_since(start) >= 0.045);
+  CHECK(b.getTimeoutCnt(r0) + b.getTimeoutCnt(r1) == 4);
+}
+
+static void test_size(void)
+{
+  DataBuffer  b(4, 1);
+  std::size_t r = b.attachReader(DataBuffer::DropOldest, 0);
+
+  CHECK(write(b, 0));
+
+  // Applied once the reader has caught up
+  b.setSize(16);
+  CHECK(write(b, 1));
+  CHECK(b.getSize() == 4);
+
+  read(b, r);
+  read(b, r);
+  CHECK(write(b, 2));
+  CHECK(b.getSize() == 16);
+
+  for (int n = 3; n < 20; ++n)
+    CHECK(write(b, n));
+
+  CHECK(b.getLag(r) == 16);
+
+  for (int n = 4; n < 20; ++n)
+    CHECK(read(b, r) == n);
+
+  bool thrown = false;
+
+  try
+  {
+    b.setSize(DataBufferMaxSize + 1);
+  }
+  catch (std::runtime_error &e)
+  {
+    thrown = true;
+  }
+
+  CHECK(thrown);
+}
+
+// One writer, a fast and a slow reader thread: each reader sees increasing packet numbers, and
+// a packet never changes while it is read
+static void test_threads(void)
+{
+  const int         numPackets = 200000;
+  DataBuffer        b(4, 2);
+  std::size_t       r[2] = { b.attachReader(DataBuffer::DropOldest, 0), b.attachReader(DataBuffer::DropOldest, 0) };
+  std::atomic<bool> done(false);
+  std::atomic<long> bad(0);
+
+  std::thread t[2];
+
+  for (int i = 0; i < 2; ++i)
+  {
+    t[i] = std::thread([&, i]()
+    {
+      int last = -1;
+
+      while (true)
+      {
+        if (!b.waitForData(r[i], 100))
+        {
+          if (done)
+            break;
+
+          continue;
+        }
+
+        SmurfPacket_RO p = b.getReadPtr(r[i]);
+        int            n = p->getValue(0);
+
+        if (n <= last)
+          ++bad;
+
+        for (int k = 0; k < (i ? 1000 : 1); ++k)
+          if ((p->getValue(0) != n) || (p->getValue(1) != n))
+            ++bad;
+
+        last = n;
+        p.reset();
+        b.doneReading(r[i]);
+      }
+    });
+  }
+
+  for (int n = 0; n < numPackets; ++n)
+    write(b, n);
+
+  done = true;
+  t[0].join();
+  t[1].join();
+
+  CHECK(bad == 0);
+  CHECK(b.getDropCnt() == 0);
+}
+
+int main(void)
+{
+  test_drop_oldest();
+  test_drop_newest();
+  test_held_slot();
+  test_blocking();
+  test_size();
+  test_threads();
+
+  return(test_result());
+}
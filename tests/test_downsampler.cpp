@@ -0,0 +1,189 @@
+// Downsampler (downsampler.h): the number of packets each trigger sends out (Frames, Syncword,
+// EpicsSeconds), and streams added and removed by another thread while the processing loop runs
+// tick() and emit().
+
+#include <string.h>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include "downsampler.h"
+#include "smurf_header_layout.h"
+#include "test_util.h"
+
+static const std::size_t numCh = 16;
+
+// The frames of the processing thread: the header fields the triggers look at, and a payload
+struct Frames
+{
+  std::vector<uint8_t>   header;
+  std::vector<avgdata_t> data;
+  SmurfHeader            H;
+
+  Frames() : header(smurfheaderlength, 0), data(numCh, 0) {};
+
+  // Frame 'n': the sync word changes every 'syncEvery' frames, and the timing system time moves
+  // by 'ns' per frame
+  void set(uint32_t n, uint32_t syncEvery, uint64_t ns)
+  {
+    uint64_t t = 1000000000ULL * 1000 + ns * n;
+
+    setHeaderField<hfFrameCounter, uint32_t>(header.data(), n);
+    setHeaderField<hfExternalTimeClock, uint64_t>(header.data(), n / syncEvery);
+    setHeaderField<hfCounter2, uint64_t>(header.data(), ((t / 1000000000ULL) << 32) | (t % 1000000000ULL));
+    H.copy_header(header.data());
+
+    for (std::size_t j = 0; j < numCh; ++j)
+      data[j] = n;
+  };
+
+  // One frame of the processing loop
+  void run(Downsampler &d)
+  {
+    if (d.tick(&H))
+      d.emit(header.data(), data.data(), numCh);
+  };
+};
+
+// Counts the packets of a stream, and checks that each one is a whole frame
+class Counter : public PacketSubscriber
+{
+public:
+  Counter() : count(0), bad(0) {};
+
+  void process(SmurfPacket_RO p)
+  {
+    uint32_t n = p->getFrameCounter();
+
+    if (p->getPayloadLength() != numCh)
+      ++bad;
+
+    for (std::size_t j = 0; j < numCh; ++j)
+      if (p->getValue(j) != (avgdata_t) n)
+        ++bad;
+
+    ++count;
+  };
+
+  std::atomic<long> count;
+  std::atomic<long> bad;
+};
+
+static void test_triggers(void)
+{
+  Downsampler d;
+  Frames      f;
+
+  int every    = d.add("every", DownsamplerStream::Frames, 1, 4);
+  int frames   = d.add("frames", DownsamplerStream::Frames, 7, 4);
+  int sync     = d.add("sync", DownsamplerStream::Syncword, 3, 4);
+  int seconds  = d.add("seconds", DownsamplerStream::EpicsSeconds, 2, 4);
+
+  std::shared_ptr<Counter> c = std::make_shared<Counter>();
+  d.get(sync)->getSubscribers().attach(c, "counter", false, DataBuffer::DropOldest, 0);
+
+  // 10000 frames at 4 kHz: 2.5 s, the sync word changes every 5 frames
+  for (uint32_t n = 0; n < 10000; ++n)
+  {
+    f.set(n, 5, 250000);
+    f.run(d);
+  }
+
+  CHECK(d.get(every)->getEmitCnt() == 10000);
+  CHECK(d.get(frames)->getEmitCnt() == 10000 / 7);
+  CHECK(d.get(sync)->getEmitCnt() == (10000 / 5 - 1) / 3);  // 1999 changes, the first frame sets the reference
+  CHECK(c->count == (long) d.get(sync)->getEmitCnt());
+  CHECK(c->bad == 0);
+
+  // 50 frames a second for 11 s, starting on a 2 s boundary: a packet at 2, 4, 6, 8 and 10 s
+  Downsampler d2;
+  int         s2 = d2.add("seconds", DownsamplerStream::EpicsSeconds, 2, 4);
+
+  for (uint32_t n = 0; n < 550; ++n)
+  {
+    f.set(n, 1, 20000000);
+    f.run(d2);
+  }
+
+  CHECK(d.get(seconds)->getEmitCnt() == 1);  // 1000 s to 1002.5 s
+  CHECK(d2.get(s2)->getEmitCnt() == 5);
+
+  bool thrown = false;
+
+  try
+  {
+    d.add("zero", DownsamplerStream::Frames, 0, 4);
+  }
+  catch (std::runtime_error &e)
+  {
+    thrown = true;
+  }
+
+  CHECK(thrown);
+
+  d.remove(frames);
+  CHECK(d.getIds().size() == 3);
+}
+
+// The processing loop runs while another thread adds and removes streams. A stream which stays
+// the whole time counts exactly, and the removed ones are destroyed without the loop waiting.
+static void test_add_remove(void)
+{
+  const uint32_t           numFrames = 200000;
+  Downsampler              d;
+  std::atomic<bool>        done(false);
+  std::atomic<long>        changes(0);
+  std::shared_ptr<Counter> c = std::make_shared<Counter>();
+
+  int fixed = d.add("fixed", DownsamplerStream::Frames, 10, 16);
+  d.get(fixed)->getSubscribers().attach(c, "counter", true, DataBuffer::Blocking, 1000);
+
+  std::thread t([&]()
+  {
+    while (!done)
+    {
+      std::shared_ptr<Counter> k = std::make_shared<Counter>();
+
+      int id = d.add("temp", DownsamplerStream::Frames, 1 + changes % 3, 4);
+      d.get(id)->getSubscribers().attach(k, "counter", (changes % 2) != 0, DataBuffer::DropOldest, 0);
+      std::this_thread::yield();
+      d.remove(id);
+
+      if (k->bad)
+        ++c->bad;
+
+      ++changes;
+    }
+  });
+
+  Frames f;
+
+  while (!changes)
+    std::this_thread::yield();
+
+  for (uint32_t n = 0; n < numFrames; ++n)
+  {
+    f.set(n, 1, 250000);
+    f.run(d);
+  }
+
+  done = true;
+  t.join();
+
+  // Let the threaded subscriber read the last packets
+  for (int i = 0; (i < 1000) && (c->count < (long) (numFrames / 10)); ++i)
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+  printf("%ld streams added and removed during %u frames\n", (long) changes, numFrames);
+  CHECK(d.get(fixed)->getEmitCnt() == numFrames / 10);
+  CHECK(c->count == (long) (numFrames / 10));
+  CHECK(c->bad == 0);
+  CHECK(d.getIds().size() == 1);
+}
+
+int main(void)
+{
+  test_triggers();
+  test_add_remove();
+
+  return(test_result());
+}
@@ -0,0 +1,312 @@
+// The vector kernels (filter_kernels.h, unwrap.h) against the scalar ones, on the CPU features
+// this machine has:
+// - iir_scalar is bit-exact with the original direct form loop of SmurfFilter;
+// - unwrap_scalar is bit-exact with the original unwrap loop of SmurfProcessor::runThread;
+// - the unwrap and flat average kernels are bit-exact with the scalar ones;
+// - the IIR and SOS vector kernels use FMA, so they are checked against the bounds documented
+//   in filter_kernels.h instead.
+
+#include <math.h>
+#include <string.h>
+#include <vector>
+#include <random>
+#include <algorithm>
+#include "filter_kernels.h"
+#include "unwrap.h"
+#include "common.h"
+#include "test_util.h"
+
+// 4th order Butterworth from smurf.cfg, and the same filter as 2 second order sections
+static const filter_t butterA[5] = { 1.0, -3.741497676422641, 5.25738179278082, -3.2878720008343643, 0.7720723746179725 };
+static const filter_t butterB[5] = { 5.280633861680253e-06, 2.112253544672101e-05, 3.168380317008152e-05, 2.112253544672101e-05, 5.280633861680253e-06 };
+static const sos_t    butterSos[10] = { 5.280633861680253e-06, 1.0561267723360506e-05, 5.280633861680253e-06, -1.823774361444, 0.8327382324533122,
+                                        1.0,                   2.0,                    1.0,                   -1.9177233149794197, 0.927148946126764 };
+
+static const unsigned records = 16;
+
+// Ring buffer of the direct form, with the record pointers the kernels take
+struct DirectForm
+{
+  unsigned              n;
+  int                   bn;
+  std::vector<filter_t> xd, yd;
+  std::vector<avgdata_t> out;
+  filter_t             *x[records], *y[records];
+
+  DirectForm(unsigned channels) : n(channels), bn(0), xd(channels * records), yd(channels * records), out(channels) {};
+
+  void run(iir_kernel_t k, const avgdata_t *in, int order)
+  {
+    bn = (bn + 1) % records;
+
+    for (int r = 0; r <= order; ++r)
+    {
+      unsigned nx = (bn + records - r) % records;
+      x[r] = &xd[nx * n];
+      y[r] = &yd[nx * n];
+    }
+
+    k(in, x, y, butterA, butterB, 1.0, order, n, out.data());
+  };
+
+  // The loop SmurfFilter::filter ran before the kernels, operation for operation
+  void original(const avgdata_t *in, int order)
+  {
+    bn = (bn + 1) % records;
+
+    for (unsigned j = 0; j < n; ++j)
+      xd[bn * n + j] = (filter_t) in[j];
+
+    for (unsigned j = 0; j < n; ++j)
+    {
+      yd[bn * n + j] = butterB[0] * xd[bn * n + j];
+
+      for (int r = 1; r <= order; ++r)
+      {
+        unsigned nx = (bn + records - r) % records;
+        yd[bn * n + j] += butterB[r] * xd[nx * n + j] - butterA[r] * yd[nx * n + j];
+      }
+
+      yd[bn * n + j] = yd[bn * n + j] / butterA[0];
+      out[j] = (avgdata_t) (yd[bn * n + j] * 1.0);
+    }
+  };
+};
+
+// Sine of +-2^30 counts plus noise, different for each channel
+static void make_input(std::mt19937 &rng, unsigned frame, std::vector<avgdata_t> &in)
+{
+  for (unsigned j = 0; j < in.size(); ++j)
+    in[j] = (avgdata_t) (sin((frame + 37 * j) * 0.001) * (1 << 30)) + (avgdata_t) (rng() % 2001) - 1000;
+}
+
+static void test_iir(void)
+{
+  const unsigned n = 531;  // not a multiple of the vector width
+  std::mt19937   rng(3);
+  std::vector<avgdata_t> in(n);
+
+  DirectForm ref(n), scalar(n), avx2(n), avx512(n);
+  bool       hasAvx2   = cpu_has_avx2() && cpu_has_fma();
+  bool       hasAvx512 = cpu_has_avx512();
+  double     maxY[2]    = { 0, 0 };
+  long       diffOut[2] = { 0, 0 };
+  int        maxOut[2]  = { 0, 0 };
+  long       outputs    = 0;
+
+  for (unsigned f = 0; f < 20000; ++f)
+  {
+    make_input(rng, f, in);
+
+    ref.original(in.data(), 4);
+    scalar.run(iir_scalar, in.data(), 4);
+    CHECK(!memcmp(scalar.out.data(), ref.out.data(), n * sizeof(avgdata_t)));
+    CHECK(!memcmp(&scalar.yd[scalar.bn * n], &ref.yd[ref.bn * n], n * sizeof(filter_t)));
+
+    DirectForm *v[2]   = { &avx2, &avx512 };
+    iir_kernel_t k[2]  = { iir_avx2, iir_avx512 };
+    bool        has[2] = { hasAvx2, hasAvx512 };
+
+    for (int i = 0; i < 2; ++i)
+    {
+      if (!has[i])
+        continue;
+
+      v[i]->run(k[i], in.data(), 4);
+
+      for (unsigned j = 0; j < n; ++j)
+      {
+        maxY[i]   = std::max(maxY[i], fabs(v[i]->yd[v[i]->bn * n + j] - ref.yd[ref.bn * n + j]) / (1 << 30));
+        maxOut[i] = std::max(maxOut[i], abs(v[i]->out[j] - ref.out[j]));
+        diffOut[i] += (v[i]->out[j] != ref.out[j]);
+      }
+    }
+
+    outputs += n;
+  }
+
+  for (int i = 0; i < 2; ++i)
+  {
+    printf("iir %s: history %.2e of full scale, outputs off by %d count in %ld of %ld\n",
+      i ? "avx512" : "avx2", maxY[i], maxOut[i], diffOut[i], outputs);
+    CHECK(maxY[i] < 1e-11);
+    CHECK(maxOut[i] <= 1);
+    CHECK(diffOut[i] * 100 < outputs);  // about 0.1%
+  }
+}
+
+static void test_sos(void)
+{
+  const unsigned n = 531;
+  std::mt19937   rng(4);
+  std::vector<avgdata_t> in(n), out(n);
+
+  sos_kernel_t k[3]   = { sos_scalar, sos_avx2, sos_avx512 };
+  bool         has[3] = { true, cpu_has_avx2() && cpu_has_fma(), cpu_has_avx512() };
+  std::vector<sos_t> state[3];
+  double       maxDiff[3] = { 0, 0, 0 };
+  DirectForm   ref(n);
+
+  for (int i = 0; i < 3; ++i)
+    state[i].assign(2 * 2 * n, 0);
+
+  for (unsigned f = 0; f < 20000; ++f)
+  {
+    // 2^20 counts sine plus noise, as in the bound of filter_kernels.h
+    for (unsigned j = 0; j < n; ++j)
+      in[j] = (avgdata_t) (sin((f + 37 * j) * 0.001) * (1 << 20)) + (avgdata_t) (rng() % 2001) - 1000;
+
+    ref.run(iir_scalar, in.data(), 4);
+
+    for (int i = 0; i < 3; ++i)
+    {
+      if (!has[i])
+        continue;
+
+      k[i](in.data(), state[i].data(), n, butterSos, 2, 1.0f, n, out.data());
+
+      if (f > 100)
+        for (unsigned j = 0; j < n; ++j)
+          maxDiff[i] = std::max(maxDiff[i], fabs((double) out[j] - ref.out[j]));
+    }
+  }
+
+  for (int i = 0; i < 3; ++i)
+  {
+    printf("sos %s: %.1f counts from the double direct form\n", sos_kernel_name(k[i]), maxDiff[i]);
+    CHECK(maxDiff[i] <= 2e-5 * (1 << 20));
+  }
+}
+
+static void test_avg(void)
+{
+  std::mt19937 rng(5);
+  avg_kernel_t k[3]   = { avg_scalar, avg_avx2, avg_avx512 };
+  bool         has[3] = { true, cpu_has_avx2(), cpu_has_avx512() };
+
+  for (unsigned n = 1; n < 600; n += 53)
+  {
+    std::vector<avgdata_t> in(n), ref(n), out(n);
+    std::vector<int64_t>   sum[3];
+    std::vector<double>    dsum(n, 0);
+
+    for (int i = 0; i < 3; ++i)
+      sum[i].assign(n, 0);
+
+    for (int f = 1; f <= 200; ++f)
+    {
+      for (unsigned j = 0; j < n; ++j)
+      {
+        in[j]    = (avgdata_t) rng();  // full int32 range
+        dsum[j] += in[j];
+        ref[j]   = (avgdata_t) (dsum[j] / f);
+      }
+
+      for (int i = 0; i < 3; ++i)
+      {
+        if (!has[i])
+          continue;
+
+        k[i](in.data(), sum[i].data(), n);
+        CHECK(sum[i] == sum[0]);
+      }
+
+      avg_divide(sum[0].data(), f, n, out.data());
+      CHECK(out == ref);
+    }
+  }
+}
+
+// The unwrap loop SmurfProcessor::runThread ran before the kernels, operation for operation: the
+// previous sample of a channel is read from the previous frame ('p'), through the mask
+static void original_unwrap(const smurf_t *d, const smurf_t *p, const uint *mask, uint n, wrap_t *wrap_counter, avgdata_t *input_data)
+{
+  uint j, dctr;
+
+  for(j = 0; j < n; j++)
+  {
+    dctr = mask[j];
+
+    if(mask[j] > 4095)
+      break;
+
+    if ((d[dctr] > upper_unwrap) && (p[dctr] < lower_unwrap)) // unwrap, add 1
+    {
+      wrap_counter[j]-= 0x10000; // decrement wrap counter
+    }
+    else if((d[dctr] < lower_unwrap) && (p[dctr] > upper_unwrap))
+    {
+      wrap_counter[j]+= 0x10000; // inccrement wrap counter
+    }
+
+    input_data[j] = (avgdata_t)(d[dctr]) + (avgdata_t) wrap_counter[j];
+  }
+}
+
+static void test_unwrap(void)
+{
+  std::mt19937    rng(1);
+  unwrap_kernel_t k[3]   = { unwrap_scalar, unwrap_avx2, unwrap_avx512 };
+  bool            has[3] = { true, cpu_has_avx2(), cpu_has_avx512() };
+  unsigned        sizes[] = { 0, 1, 7, 8, 15, 16, 17, 528, 4096 };
+
+  for (std::size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s)
+  {
+    unsigned n = sizes[s];
+
+    // The samples follow a header, and end the buffer: the kernels must not read past them
+    std::vector<uint8_t>   frame(smurfdatalength);
+    smurf_t               *raw = reinterpret_cast<smurf_t*>(frame.data() + smurfheaderlength);
+    std::vector<uint>      mask(n);
+    std::vector<smurf_t>   last[3];
+    std::vector<wrap_t>    wrap[3];
+    std::vector<avgdata_t> out[3];
+    std::vector<smurf_t>   prev(smurf_raw_samples, 0);
+    std::vector<wrap_t>    refWrap(n, 0);
+    std::vector<avgdata_t> refOut(n, 0);
+
+    for (unsigned j = 0; j < n; ++j)
+      mask[j] = (j == 0) ? 0 : (j == 1) ? smurf_raw_samples - 1 : rng() % smurf_raw_samples;
+
+    for (int i = 0; i < 3; ++i)
+    {
+      last[i].assign(n, 0);
+      wrap[i].assign(n, 0);
+      out[i].assign(n, 0);
+    }
+
+    for (int f = 0; f < 500; ++f)
+    {
+      for (unsigned j = 0; j < smurf_raw_samples; ++j)
+        raw[j] = (smurf_t) rng();
+
+      original_unwrap(raw, prev.data(), mask.data(), n, refWrap.data(), refOut.data());
+      std::copy(raw, raw + smurf_raw_samples, prev.begin());
+
+      for (int i = 0; i < 3; ++i)
+      {
+        if (!has[i])
+          continue;
+
+        k[i](raw, mask.data(), n, last[i].data(), wrap[i].data(), out[i].data());
+        CHECK(last[i] == last[0]);
+        CHECK(wrap[i] == wrap[0]);
+        CHECK(out[i]  == out[0]);
+        CHECK(wrap[i] == refWrap);
+        CHECK(out[i]  == refOut);
+      }
+    }
+  }
+}
+
+int main(void)
+{
+  printf("avx2 %d, avx512 %d, fma %d\n", cpu_has_avx2(), cpu_has_avx512(), cpu_has_fma());
+
+  test_iir();
+  test_sos();
+  test_avg();
+  test_unwrap();
+
+  return(test_result());
+}
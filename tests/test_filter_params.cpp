@@ -0,0 +1,141 @@
+// FilterParamsPublisher (filter_params.h): versions and acknowledgements, which retired objects
+// are freed, and a reader racing two writers: it always sees a whole object, which is not freed
+// while it uses it, and the writers don't lose each other's changes.
+
+#include <thread>
+#include <atomic>
+#include "filter_params.h"
+#include "test_util.h"
+
+static void test_versions(void)
+{
+  FilterParamsPublisher pub;
+  FilterParams          p;
+
+  CHECK(pub.read()->version == 0);
+  CHECK(pub.read()->order == 0);
+
+  p.order = 4;
+  p.a[4]  = 0.5;
+  CHECK(pub.publish(p) == 1);
+  CHECK(pub.latest().order == 4);
+  CHECK(pub.getAckVersion() == 0);
+
+  const FilterParams *r = pub.read();
+  CHECK(r->version == 1);
+  CHECK(r->a[4] == 0.5);
+  CHECK(pub.getAckVersion() == 1);
+
+  // update() starts from the latest settings
+  CHECK(pub.update([](FilterParams &q) { q.g = 2; }) == 2);
+  r = pub.read();
+  CHECK(r->order == 4);
+  CHECK(r->g == 2);
+  CHECK(r->sameFilter(p));
+  CHECK(!r->sameSettings(p));
+}
+
+static void test_reclaim(void)
+{
+  FilterParamsPublisher pub;
+  FilterParams          p;
+
+  // Nothing is freed before the reader acknowledges a newer version
+  for (int i = 0; i < 3; ++i)
+    pub.publish(p);
+
+  CHECK(pub.getRetiredCnt() == 3);
+
+  // The reader now uses version 3, so the next publication frees versions 0 to 2, and keeps 3
+  CHECK(pub.read()->version == 3);
+  pub.publish(p);
+  CHECK(pub.getRetiredCnt() == 1);
+
+  pub.read();
+  pub.publish(p);
+  pub.publish(p);
+  CHECK(pub.getRetiredCnt() == 2);
+}
+
+// Each update sets all the coefficients and the gain to one more than before
+static void increment(FilterParams &q)
+{
+  q.g += 1;
+
+  for (int r = 0; r < 16; ++r)
+  {
+    q.a[r] = q.g;
+    q.b[r] = q.g;
+  }
+}
+
+static void test_race(void)
+{
+  const int             numUpdates = 20000;
+  FilterParamsPublisher pub;
+  std::atomic<bool>     done(false);
+  std::atomic<long>     bad(0), reads(0);
+
+  pub.update(increment);
+
+  std::thread reader([&]()
+  {
+    uint64_t last = 0;
+
+    while (!done)
+    {
+      const FilterParams *p = pub.read();
+
+      if (p->version < last)
+        ++bad;
+
+      last = p->version;
+
+      // The object stays valid and unchanged until the next read()
+      for (int k = 0; k < 10; ++k)
+        for (int r = 0; r < 16; ++r)
+          if ((p->a[r] != p->g) || (p->b[r] != p->g))
+            ++bad;
+
+      ++reads;
+    }
+  });
+
+  while (!reads)
+    std::this_thread::yield();
+
+  std::thread writers[2];
+
+  for (int w = 0; w < 2; ++w)
+  {
+    writers[w] = std::thread([&]()
+    {
+      for (int i = 0; i < numUpdates; ++i)
+        pub.update(increment);
+    });
+  }
+
+  writers[0].join();
+  writers[1].join();
+  done = true;
+  reader.join();
+
+  printf("%ld reads during %d updates\n", (long) reads, 2 * numUpdates);
+  CHECK(bad == 0);
+  CHECK(pub.latest().g == 2 * numUpdates + 2);  // the default gain is 1
+  CHECK(pub.latest().version == (uint64_t) (2 * numUpdates + 1));
+
+  // Once the reader has the latest version, only the object it replaced is kept
+  pub.read();
+  pub.update(increment);
+  CHECK(pub.getRetiredCnt() == 1);
+}
+
+int main(void)
+{
+  test_versions();
+  test_reclaim();
+  test_race();
+
+  return(test_result());
+}
@@ -0,0 +1,120 @@
+// The sample codec (sample_codec.h): round trips of every width and length, the scalar and
+// AVX2 kernels giving the same bytes, and invalid (truncated or corrupted) encodings rejected.
+
+#include <string.h>
+#include <vector>
+#include <algorithm>
+#include <random>
+#include "sample_codec.h"
+#include "common.h"
+#include "test_util.h"
+
+// n samples whose differences fit in 'width' bits (any values if width is 32)
+static std::vector<avgdata_t> make_column(std::mt19937 &rng, std::size_t n, int width)
+{
+  std::vector<avgdata_t> x(n);
+  uint32_t               v = rng();
+
+  for (std::size_t i = 0; i < n; ++i)
+  {
+    uint32_t r = rng();
+    int32_t  d = (width == 0)  ? 0 :
+                 (width == 32) ? (int32_t) r :
+                 (int32_t) (r & ((1u << width) - 1)) - (int32_t) (1u << (width - 1));
+
+    v   += (uint32_t) d;
+    x[i] = (avgdata_t) v;
+  }
+
+  return x;
+}
+
+static void test_round_trip(void)
+{
+  std::mt19937 rng(1);
+
+  for (int trial = 0; trial < 2000; ++trial)
+  {
+    std::size_t            n = (trial < 600) ? trial : rng() % 5000;
+    std::vector<avgdata_t> x = make_column(rng, n, rng() % 33);
+    std::vector<uint8_t>   enc(sample_codec_bound(n));
+    std::vector<avgdata_t> dec(n + 1, 12345);
+
+    std::size_t len = encode_samples(x.data(), n, enc.data());
+
+    CHECK(len <= sample_codec_bound(n));
+    CHECK(decode_samples(enc.data(), len, n, dec.data()));
+    CHECK(std::equal(x.begin(), x.end(), dec.begin()));
+    CHECK(dec[n] == 12345);  // nothing written past the end
+  }
+}
+
+static void test_kernels(void)
+{
+  if (!cpu_has_avx2())
+  {
+    printf("no avx2, kernel comparison skipped\n");
+    return;
+  }
+
+  std::mt19937 rng(2);
+
+  for (int width = 0; width <= 32; ++width)
+  {
+    for (int trial = 0; trial < 20; ++trial)
+    {
+      std::vector<avgdata_t> x    = make_column(rng, SampleCodecBlock, width);
+      avgdata_t              prev = (avgdata_t) rng();
+      std::vector<uint8_t>   a(sample_codec_bound(SampleCodecBlock)), b(a.size());
+      std::vector<avgdata_t> da(SampleCodecBlock), db(SampleCodecBlock);
+
+      std::size_t la = sample_encode_scalar(x.data(), prev, a.data());
+      std::size_t lb = sample_encode_avx2(x.data(), prev, b.data());
+
+      CHECK(la == lb);
+      CHECK(!memcmp(a.data(), b.data(), la));
+
+      sample_decode_scalar(a.data(), prev, da.data());
+      sample_decode_avx2(a.data(), prev, db.data());
+
+      CHECK(da == x);
+      CHECK(db == x);
+    }
+  }
+}
+
+static void test_invalid(void)
+{
+  std::mt19937 rng(3);
+
+  for (std::size_t n = 1; n < 2000; n += 97)
+  {
+    std::vector<avgdata_t> x = make_column(rng, n, 20);
+    std::vector<uint8_t>   enc(sample_codec_bound(n));
+    std::vector<avgdata_t> dec(n);
+
+    std::size_t len = encode_samples(x.data(), n, enc.data());
+
+    // Every truncation is rejected, and so is trailing data
+    for (std::size_t l = 0; l < len; ++l)
+      CHECK(!decode_samples(enc.data(), l, n, dec.data()));
+
+    enc.push_back(0);
+    CHECK(!decode_samples(enc.data(), len + 1, n, dec.data()));
+
+    // A block width over 32 bits
+    enc[4] = 33;
+    CHECK(!decode_samples(enc.data(), len, n, dec.data()));
+  }
+}
+
+int main(void)
+{
+  printf("sample codec kernel: %s\n", sample_codec_kernel_name());
+
+  test_round_trip();
+  test_kernels();
+  test_invalid();
+
+  return(test_result());
+}
@@ -0,0 +1,127 @@
+// TesBiasPublisher (tes_bias_array.h): the 20-bit values round trip through the publisher, and a
+// reader racing setWords() never sees a mix of two arrays.
+
+#include <string.h>
+#include <thread>
+#include <atomic>
+#include "tes_bias_array.h"
+#include "test_util.h"
+
+// Decode the TesBiasBufferSize bytes the reader copied
+static void decode(const uint8_t *bytes, int32_t *values)
+{
+  uint8_t      b[TesBiasBufferSize + 1] = { 0 };  // TesBiasArray reads 4 bytes
+  TesBiasArray a(b);
+
+  memcpy(b, bytes, TesBiasBufferSize);
+
+  for (std::size_t i = 0; i < TesBiasCount; ++i)
+    values[i] = a.getWord(i);
+}
+
+static void test_values(void)
+{
+  TesBiasPublisher p;
+  uint8_t          bytes[TesBiasBufferSize];
+  int32_t          v[TesBiasCount];
+
+  p.read(bytes);
+  decode(bytes, v);
+
+  for (std::size_t i = 0; i < TesBiasCount; ++i)
+    CHECK(v[i] == 0);
+
+  // Neighbouring values share a byte, and are sign extended from 20 bits
+  for (std::size_t i = 0; i < TesBiasCount; ++i)
+    p.setWord(i, (i % 2) ? -(int32_t) (i * 1000 + 1) : (int32_t) (0x7FFFF - i));
+
+  p.read(bytes);
+  decode(bytes, v);
+
+  for (std::size_t i = 0; i < TesBiasCount; ++i)
+  {
+    int32_t x = (i % 2) ? -(int32_t) (i * 1000 + 1) : (int32_t) (0x7FFFF - i);
+    CHECK(v[i] == x);
+    CHECK(p.getWord(i) == x);
+  }
+
+  bool thrown = false;
+
+  try
+  {
+    p.setWord(TesBiasCount, 0);
+  }
+  catch (std::runtime_error &e)
+  {
+    thrown = true;
+  }
+
+  CHECK(thrown);
+}
+
+// The writer publishes arrays of 16 equal values, array n holding n, negative when n is even. The
+// reader checks that all the values of each copy are equal, and that n never goes back.
+static void test_race(void)
+{
+  const int32_t     numArrays = 500000;  // n fits in 19 bits
+  TesBiasPublisher  p;
+  std::atomic<bool> done(false);
+  std::atomic<long> mixed(0), back(0), reads(0);
+
+  std::thread t([&]()
+  {
+    uint8_t bytes[TesBiasBufferSize];
+    int32_t v[TesBiasCount];
+    int32_t last = 0;
+    int32_t n;
+
+    while (!done)
+    {
+      p.read(bytes);
+      decode(bytes, v);
+
+      for (std::size_t i = 1; i < TesBiasCount; ++i)
+        if (v[i] != v[0])
+          ++mixed;
+
+      n = v[0] & 0x7FFFF;
+
+      if ((n < last) || ((v[0] < 0) != (n && !(n % 2))))
+        ++back;
+
+      last = n;
+      ++reads;
+    }
+  });
+
+  int32_t v[TesBiasCount];
+
+  // Wait for the reader to run, so it races the writes even on a single CPU
+  while (!reads)
+    std::this_thread::yield();
+
+  for (int32_t n = 1; n <= numArrays; ++n)
+  {
+    // Alternate the sign too, so the bytes shared by two values change as well
+    for (std::size_t i = 0; i < TesBiasCount; ++i)
+      v[i] = (n % 2) ? n : n | ~0x7FFFF;
+
+    p.setWords(v);
+  }
+
+  done = true;
+  t.join();
+
+  printf("%ld reads during %d publications\n", (long) reads, numArrays);
+  CHECK(mixed == 0);
+  CHECK(back == 0);
+  CHECK(reads > 0);
+}
+
+int main(void)
+{
+  test_values();
+  test_race();
+
+  return(test_result());
+}
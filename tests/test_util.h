@@ -0,0 +1,23 @@
+#ifndef _TEST_UTIL_H_
+#define _TEST_UTIL_H_
+
+#include <stdio.h>
+
+// Minimal checks for the unit tests: a failed CHECK prints where, and the test carries on, so
+// one run shows all the failures. main() returns test_result().
+static int test_failures = 0;
+
+#define CHECK(cond) \
+  do { if (!(cond)) { ++test_failures; printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); } } while (0)
+
+static inline int test_result(void)
+{
+  if (test_failures)
+    printf("%d check(s) failed\n", test_failures);
+  else
+    printf("OK\n");
+
+  return(test_failures ? 1 : 0);
+}
+
+#endif
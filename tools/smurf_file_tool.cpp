@@ -0,0 +1,227 @@
+// Command line access to the SMuRF data files (.part_NNNNN), raw or columnar:
+//
+//   smurf_file_tool info <file>...
+//   smurf_file_tool dump <file> [first [count]]
+//   smurf_file_tool channel <channel> <out> <file>...
+//   smurf_file_tool convert <in> <out> raw|columnar [codec [chunk_frames]]
+//
+// 'channel' writes one channel of the files, one after the other, as int32 values to <out>,
+// or as text ("frame_counter unix_time value" lines) if <out> is '-'.
+// 'convert' rewrites a file in the raw or the columnar format (codec 0 = none, 1 = delta).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+#include "smurf_file_reader.h"
+#include "columnar_writer.h"
+#include "file_writer.h"
+
+static const std::size_t block = 65536;  // frames per read
+
+static int usage(void)
+{
+  fprintf(stderr, "usage: smurf_file_tool info <file>...\n");
+  fprintf(stderr, "       smurf_file_tool dump <file> [first [count]]\n");
+  fprintf(stderr, "       smurf_file_tool channel <channel> <out|-> <file>...\n");
+  fprintf(stderr, "       smurf_file_tool convert <in> <out> raw|columnar [codec [chunk_frames]]\n");
+  return(2);
+}
+
+static int info(int argc, char **argv)
+{
+  for (int i = 0; i < argc; ++i)
+  {
+    SmurfFileReader r(argv[i]);
+    std::size_t     n = r.getNumFrames();
+
+    printf("%s: %s", argv[i], r.isColumnar() ? "columnar" : "raw");
+
+    if (r.isColumnar())
+      printf(" (codec %u)", r.getCodec());
+
+    printf(", %zu frames, up to %zu channels\n", n, r.getMaxChannels());
+
+    if (!n)
+      continue;
+
+    uint64_t fc[2], ut[2], ep[2];
+    r.readHeaderField(hfFrameCounter, 0, 1, &fc[0]);
+    r.readHeaderField(hfFrameCounter, n - 1, 1, &fc[1]);
+    r.readHeaderField(hfUnixTime, 0, 1, &ut[0]);
+    r.readHeaderField(hfUnixTime, n - 1, 1, &ut[1]);
+    r.readHeaderField(hfCounter2, 0, 1, &ep[0]);
+    r.readHeaderField(hfCounter2, n - 1, 1, &ep[1]);
+
+    printf("  frame counter %llu to %llu\n", (unsigned long long) fc[0], (unsigned long long) fc[1]);
+    printf("  unix time     %.6f to %.6f (%.3f s)\n", ut[0] * 1e-9, ut[1] * 1e-9, (ut[1] - ut[0]) * 1e-9);
+    printf("  epics time    %llu.%09llu to %llu.%09llu\n",
+      (unsigned long long) (ep[0] >> 32), (unsigned long long) (ep[0] & 0xffffffff),
+      (unsigned long long) (ep[1] >> 32), (unsigned long long) (ep[1] & 0xffffffff));
+  }
+
+  return(0);
+}
+
+static int dump(int argc, char **argv)
+{
+  if (argc < 1)
+    return(usage());
+
+  SmurfFileReader r(argv[0]);
+  std::size_t     first = (argc > 1) ? strtoull(argv[1], NULL, 0) : 0;
+  std::size_t     count = (argc > 2) ? strtoull(argv[2], NULL, 0) : r.getNumFrames();
+
+  for (std::size_t f = first; (f < r.getNumFrames()) && (f - first < count); ++f)
+  {
+    SmurfPacket_RO p = r.getPacket(f);
+
+    printf("frame %zu: counter %u, unix time %llu, epics %llu.%09llu, channels %u, control 0x%02x, tes bias",
+      f, p->getFrameCounter(), (unsigned long long) p->getUnixTime(),
+      (unsigned long long) (p->getCounter2() >> 32), (unsigned long long) (p->getCounter2() & 0xffffffff),
+      p->getNumberChannels(), p->getControlField());
+
+    for (std::size_t b = 0; b < TesBiasCount; ++b)
+      printf(" %d", p->getTESBias(b));
+
+    printf("\n ");
+
+    for (std::size_t c = 0; c < p->getPayloadLength(); ++c)
+      printf(" %d%s", p->getValue(c), ((c % 16 == 15) && (c + 1 < p->getPayloadLength())) ? "\n " : "");
+
+    printf("\n");
+  }
+
+  return(0);
+}
+
+static int channel(int argc, char **argv)
+{
+  if (argc < 3)
+    return(usage());
+
+  std::size_t ch   = strtoull(argv[0], NULL, 0);
+  bool        text = !strcmp(argv[1], "-");
+  FILE       *out  = text ? stdout : fopen(argv[1], "wb");
+
+  if (!out)
+  {
+    perror(argv[1]);
+    return(1);
+  }
+
+  std::vector<avgdata_t> v(block);
+  std::vector<uint64_t>  fc(block), ut(block);
+  std::size_t            total = 0;
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+  for (int i = 2; i < argc; ++i)
+  {
+    SmurfFileReader r(argv[i]);
+
+    for (std::size_t f = 0; f < r.getNumFrames(); f += block)
+    {
+      std::size_t n = r.readChannel(ch, f, block, v.data());
+
+      if (text)
+      {
+        r.readHeaderField(hfFrameCounter, f, n, fc.data());
+        r.readHeaderField(hfUnixTime, f, n, ut.data());
+
+        for (std::size_t j = 0; j < n; ++j)
+          fprintf(out, "%llu %llu %d\n", (unsigned long long) fc[j], (unsigned long long) ut[j], v[j]);
+      }
+      else if (fwrite(v.data(), sizeof(avgdata_t), n, out) != n)
+      {
+        perror(argv[1]);
+        return(1);
+      }
+
+      total += n;
+    }
+  }
+
+  double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  if (!text)
+    fclose(out);
+
+  fprintf(stderr, "%zu frames of channel %zu in %.3f s\n", total, ch, s);
+  return(0);
+}
+
+static int convert(int argc, char **argv)
+{
+  if (argc < 3)
+    return(usage());
+
+  bool columnar = !strcmp(argv[2], "columnar");
+
+  if (!columnar && strcmp(argv[2], "raw"))
+    return(usage());
+
+  uint32_t    codec  = (argc > 3) ? (uint32_t) strtoul(argv[3], NULL, 0) : (uint32_t) ColumnarCodecNone;
+  std::size_t frames = (argc > 4) ? strtoull(argv[4], NULL, 0) : 1000;
+
+  SmurfFileReader r(argv[0]);
+  FileWriter      w;
+  ColumnarWriter  c(w);
+
+  if (!w.open(argv[1], false, false))
+    return(1);
+
+  if (columnar)
+    c.begin(frames, codec);
+
+  for (std::size_t f = 0; f < r.getNumFrames(); ++f)
+  {
+    SmurfPacket_RO  p = r.getPacket(f);
+    SmurfPacketView v = p->getView();
+
+    if (columnar)
+      c.append(v);
+    else
+      w.write(v.data, v.length);
+  }
+
+  c.end();
+  w.close();
+
+  if (w.getErrorCnt())
+  {
+    fprintf(stderr, "%s: write errors\n", argv[1]);
+    return(1);
+  }
+
+  printf("%s: %zu frames, %zu bytes\n", argv[1], r.getNumFrames(), w.getBytes());
+  return(0);
+}
+
+int main(int argc, char **argv)
+{
+  if (argc < 2)
+    return(usage());
+
+  try
+  {
+    if (!strcmp(argv[1], "info"))
+      return(info(argc - 2, argv + 2));
+
+    if (!strcmp(argv[1], "dump"))
+      return(dump(argc - 2, argv + 2));
+
+    if (!strcmp(argv[1], "channel"))
+      return(channel(argc - 2, argv + 2));
+
+    if (!strcmp(argv[1], "convert"))
+      return(convert(argc - 2, argv + 2));
+  }
+  catch (std::exception &e)
+  {
+    fprintf(stderr, "%s\n", e.what());
+    return(1);
+  }
+
+  return(usage());
+}